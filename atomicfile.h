@@ -0,0 +1,69 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ATOMICFILE_H_
+#define ATOMICFILE_H_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+  Replace 'filename' with 'contents': they are written to a new, uniquely named file next to it
+  (mkstemp) that is then renamed over it. Whoever reads the file sees either the old or the new
+  contents, and concurrent runs writing the same file never write into each other's temporary file.
+*/
+inline bool writeFileAtomically(std::string const &filename, std::string const &contents, mode_t mode)
+{
+  std::string tmpfilename = filename + ".XXXXXX";
+  int fd = mkstemp(&tmpfilename[0]);
+  if (fd < 0)
+    return false;
+
+  bool ok = fchmod(fd, mode) == 0;
+  char const *data = contents.data();
+  std::size_t size = contents.size();
+  while (ok && size)
+  {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      ok = false;
+    else
+    {
+      data += written;
+      size -= written;
+    }
+  }
+  if (close(fd) != 0)
+    ok = false;
+
+  if (!ok || std::rename(tmpfilename.c_str(), filename.c_str()) != 0)
+  {
+    std::remove(tmpfilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif
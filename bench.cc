@@ -0,0 +1,193 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "bench.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+  --bench=<runs>[,<concurrency>]: run the whole pipeline (connecting to the session bus,
+  opening sessions, unlocking, scanning items, deriving and decrypting the key) 'runs' times,
+  spread over 'concurrency' workers that each do their share one after the other.
+
+  Every run is a fresh process (forked from a worker), so it pays for everything a real
+  invocation does. It continues in main() as if it was started normally (with its output
+  discarded) and reports its stage timings over a pipe (see Bench). The worker adds the time
+  and result of the run as a whole:
+
+    run <0|1> <microseconds>
+*/
+namespace
+{
+  struct Samples
+  {
+    std::string d_backend;
+    std::string d_stage;
+    std::vector<double> d_ms;
+  };
+
+  // nearest-rank percentile of sorted samples
+  double percentile(std::vector<double> const &sorted, double p)
+  {
+    std::size_t rank = static_cast<std::size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[rank ? rank - 1 : 0];
+  }
+
+  void writeLine(int fd, std::string const &line)
+  {
+    [[maybe_unused]] ssize_t written = write(fd, line.data(), line.size());
+  }
+}
+
+// returns the exit code for the benchmarking process, or -1 in the (forked) process that
+// should go on to do a run.
+int runBench(unsigned int runs, unsigned int concurrency)
+{
+  concurrency = std::max(1u, std::min(concurrency, runs));
+
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    std::cout << "Failed to create pipe for benchmark" << std::endl;
+    return 1;
+  }
+
+  // (anything still buffered would otherwise be written again by every process)
+  std::cout.flush();
+  g_log.flush();
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<pid_t> workers;
+  for (unsigned int w = 0; w < concurrency; ++w)
+  {
+    pid_t worker = fork();
+    if (worker < 0)
+    {
+      std::cout << "Failed to start benchmark worker" << std::endl;
+      break;
+    }
+    if (worker > 0)
+    {
+      workers.push_back(worker);
+      continue;
+    }
+
+    close(fds[0]);
+    unsigned int share = runs / concurrency + (w < runs % concurrency ? 1 : 0);
+    for (unsigned int i = 0; i < share; ++i)
+    {
+      auto runstart = std::chrono::steady_clock::now();
+      pid_t run = fork();
+      if (run == 0)
+      {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+          dup2(devnull, STDOUT_FILENO);
+          close(devnull);
+        }
+        g_bench.enable(fds[1]);
+        return -1;
+      }
+      int status = 0;
+      bool ok = run > 0 && waitpid(run, &status, 0) == run && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      writeLine(fds[1], "run " + std::to_string(ok ? 1 : 0) + " " +
+                std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - runstart).count()) + "\n");
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+
+  // read everything until the last worker (and run) has closed the pipe
+  std::string report;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0)
+      report.append(buffer, n);
+  close(fds[0]);
+  for (pid_t worker : workers)
+    waitpid(worker, nullptr, 0);
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // samples per backend and stage, in the order they were first seen
+  std::vector<Samples> samples(1, Samples{"(run)", "total", {}});
+  std::map<std::string, std::size_t> index;
+  unsigned int succeeded = 0;
+  unsigned int failed = 0;
+  std::istringstream lines(report);
+  std::string line;
+  while (std::getline(lines, line))
+  {
+    std::istringstream record(line);
+    std::string type, backend, stage;
+    long long us = 0;
+    if (!(record >> type))
+      continue;
+    if (type == "run")
+    {
+      int ok = 0;
+      if (!(record >> ok >> us))
+        continue;
+      ++(ok ? succeeded : failed);
+      samples[0].d_ms.push_back(us / 1000.);
+    }
+    else if (type == "stage" && (record >> backend >> stage >> us))
+    {
+      auto it = index.find(backend + " " + stage);
+      if (it == index.end())
+      {
+        it = index.emplace(backend + " " + stage, samples.size()).first;
+        samples.push_back(Samples{backend, stage, {}});
+      }
+      samples[it->second].d_ms.push_back(us / 1000.);
+    }
+  }
+
+  std::cout << "Benchmark: " << succeeded + failed << " runs (" << concurrency << " concurrent) in "
+            << std::fixed << std::setprecision(3) << wall << " s, "
+            << std::setprecision(1) << (succeeded + failed) / wall << " runs/s, "
+            << succeeded << " succeeded, " << failed << " failed" << std::endl << std::endl;
+  std::cout << std::left << std::setw(16) << "backend" << std::setw(24) << "stage"
+            << std::right << std::setw(8) << "count" << std::setw(12) << "p50 (ms)" << std::setw(12) << "p90 (ms)"
+            << std::setw(12) << "p99 (ms)" << std::setw(12) << "max (ms)" << std::endl;
+  std::cout << std::setprecision(3);
+  for (auto &s : samples)
+  {
+    if (s.d_ms.empty())
+      continue;
+    std::sort(s.d_ms.begin(), s.d_ms.end());
+    std::cout << std::left << std::setw(16) << s.d_backend << std::setw(24) << s.d_stage
+              << std::right << std::setw(8) << s.d_ms.size() << std::setw(12) << percentile(s.d_ms, 50)
+              << std::setw(12) << percentile(s.d_ms, 90) << std::setw(12) << percentile(s.d_ms, 99)
+              << std::setw(12) << s.d_ms.back() << std::endl;
+  }
+  return (failed || succeeded < runs) ? 1 : 0;
+}
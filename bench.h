@@ -0,0 +1,82 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <chrono>
+#include <string>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+  Stage timings for --bench=<runs>[,<concurrency>]. Every benchmarked run is a process of its
+  own (see runBench()), which reports each stage it went through to the benchmarking process
+  over a pipe, one line per stage:
+
+    stage <backend> <stage> <microseconds>
+
+  The backend is the one metrics are being recorded for at the time (see Metrics::setBackend()).
+  Every line is sent with a single (small) write, so lines of concurrent runs never get mixed up.
+*/
+class Bench
+{
+  int d_fd;
+
+ public:
+  inline Bench();
+  inline void enable(int fd);
+  inline bool enabled() const;
+  inline void observe(std::string const &stage, std::chrono::steady_clock::duration duration);
+  inline void observe(std::string const &stage, std::chrono::steady_clock::time_point since);
+};
+
+inline Bench::Bench()
+  :
+  d_fd(-1)
+{}
+
+inline void Bench::enable(int fd)
+{
+  d_fd = fd;
+}
+
+inline bool Bench::enabled() const
+{
+  return d_fd >= 0;
+}
+
+inline void Bench::observe(std::string const &stage, std::chrono::steady_clock::duration duration)
+{
+  if (d_fd < 0)
+    return;
+  std::string line = "stage " + g_metrics.backend() + " " + stage + " " +
+    std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(duration).count()) + "\n";
+  [[maybe_unused]] ssize_t written = write(d_fd, line.data(), line.size());
+}
+
+inline void Bench::observe(std::string const &stage, std::chrono::steady_clock::time_point since)
+{
+  observe(stage, std::chrono::steady_clock::now() - since);
+}
+
+extern Bench g_bench;
+
+#endif
@@ -29,127 +29,825 @@
 #include <iomanip>
 #include <vector>
 #include <map>
+#include <tuple>
+#include <optional>
+#include <utility>
 
 #include "globals.h"
+#include "log.h"
+#include "dbusmarshal.h"
+#include "dbuswire.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "bench.h"
+#include "dbustranscript.h"
 
-template<typename>
-struct is_std_map : std::false_type {};
+struct DBusObjectPath
+{
+  std::string d_value;
+};
 
-template<typename T, typename U>
-struct is_std_map<std::map<T, U>> : std::true_type {};
+// D-Bus signature as a compile-time string
+template <std::size_t N>
+struct DBusSignature
+{
+  char d_sig[N + 1];
 
+  constexpr char const *c_str() const { return d_sig; }
+  constexpr std::size_t size() const { return N; }
+};
+
+template <std::size_t N>
+constexpr DBusSignature<N - 1> makeDBusSignature(char const (&str)[N])
+{
+  DBusSignature<N - 1> ret{};
+  for (std::size_t i = 0; i < N; ++i)
+    ret.d_sig[i] = str[i];
+  return ret;
+}
+
+template <std::size_t N, std::size_t M>
+constexpr DBusSignature<N + M> operator+(DBusSignature<N> const &lhs, DBusSignature<M> const &rhs)
+{
+  DBusSignature<N + M> ret{};
+  for (std::size_t i = 0; i < N; ++i)
+    ret.d_sig[i] = lhs.d_sig[i];
+  for (std::size_t i = 0; i <= M; ++i)
+    ret.d_sig[N + i] = rhs.d_sig[i];
+  return ret;
+}
+
+// a variant whose contents are known at compile time (eg. the 'v' returned by Properties.Get)
 template <typename T>
-class recursive_wrapper
+struct DBusVariantOf
 {
-  // Wrapper over unique_ptr.
-  std::unique_ptr<T> d_impl;
+  T d_value;
+};
 
- public:
-  // Automatic construction from a `T`, not a `T*`.
-  recursive_wrapper(T &&obj) : d_impl(new T(std::move(obj))) {}
-  recursive_wrapper(T const &obj) : d_impl(new T(obj)) {}
+// a variant holding one of several types (eg. the values returned by Properties.GetAll). Contents
+// of any other type are skipped (leaving d_value empty) instead of failing the whole reply.
+template <typename... T>
+struct DBusVariantOneOf
+{
+  std::variant<std::monostate, T...> d_value;
+
+  template <typename U>
+  U const *get() const { return std::get_if<U>(&d_value); }
+};
+
+/*
+  DBusType<T> maps a C++ type to its D-Bus signature and (de)marshals values of that type:
+
+    std::string           -> s
+    DBusObjectPath        -> o
+    int32_t               -> i
+    int64_t               -> x
+    uint64_t              -> t
+    bool                  -> b
+    unsigned char         -> y
+    std::vector<T>        -> aT
+    std::map<K, V>        -> a{KV}
+    std::tuple<T...>      -> (T...)
+    DBusVariantOf<T>      -> v  (containing T)
+    DBusVariantOneOf<T...> -> v  (containing one of T..., or something else, see below)
+
+  Every type can be written to and read from a libdbus message (DBusMessageIter) and from a
+  DBusWireMessage's body (DBusWireWriter/DBusWireReader, for the native transport). The libdbus
+  read() only checks the (integer) type code of every element it visits, so a mismatching
+  reply is rejected while it is being decoded, without comparing signature strings. The wire
+  format has no type codes outside of variants, there the body's signature is compared once
+  (see DBusReply::as()) and read() only checks the contents of variants.
+*/
+template <typename T>
+struct DBusType;
+
+template <int Code, char Char, typename T, typename Wire = T>
+struct DBusBasicType
+{
+  static constexpr int code = Code;
+  static constexpr DBusSignature<1> signature{{Char, '\0'}};
 
-  // Copy constructor copies `T`.
-  recursive_wrapper(const recursive_wrapper &other) : recursive_wrapper(*other.d_impl) {}
-  recursive_wrapper &operator=(const recursive_wrapper &other)
+  static void write(DBusMessageIter *iter, T const &value)
   {
-    *d_impl = *other.d_impl;
-    return *this;
+    Wire v = value;
+    dbus_message_iter_append_basic(iter, Code, &v);
   }
 
-  // unique_ptr destroys `T` for us.
-  ~recursive_wrapper() = default;
+  static bool read(DBusMessageIter *iter, T *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != Code)
+      return false;
+    Wire v;
+    dbus_message_iter_get_basic(iter, &v);
+    *value = v;
+    return true;
+  }
 
-  // Access propagates constness.
-  T &operator*() { return *d_impl; }
-  T const &operator*() const { return *d_impl; }
+  static void write(DBusWireWriter *writer, T const &value)
+  {
+    if constexpr (Code == DBUS_TYPE_BYTE)
+      writer->putByte(value);
+    else if constexpr (sizeof(Wire) == 8)
+      writer->putUint64(static_cast<uint64_t>(value));
+    else
+      writer->putUint32(static_cast<uint32_t>(value));
+  }
 
-  T *operator->() { return d_impl.get(); }
-  const T *operator->() const { return d_impl.get(); }
+  static bool read(DBusWireReader *reader, T *value)
+  {
+    if constexpr (Code == DBUS_TYPE_BYTE)
+      return reader->getByte(value);
+    else if constexpr (Code == DBUS_TYPE_BOOLEAN)
+      return reader->getBool(value);
+    else if constexpr (sizeof(Wire) == 8)
+    {
+      uint64_t v = 0;
+      if (!reader->getUint64(&v))
+        return false;
+      *value = static_cast<T>(v);
+      return true;
+    }
+    else
+    {
+      uint32_t v = 0;
+      if (!reader->getUint32(&v))
+        return false;
+      *value = static_cast<T>(v);
+      return true;
+    }
+  }
 };
 
+template <> struct DBusType<int32_t> : DBusBasicType<DBUS_TYPE_INT32, 'i', int32_t> {};
+template <> struct DBusType<int64_t> : DBusBasicType<DBUS_TYPE_INT64, 'x', int64_t, dbus_int64_t> {};
+template <> struct DBusType<uint64_t> : DBusBasicType<DBUS_TYPE_UINT64, 't', uint64_t, dbus_uint64_t> {};
+template <> struct DBusType<bool> : DBusBasicType<DBUS_TYPE_BOOLEAN, 'b', bool, dbus_bool_t> {};
+template <> struct DBusType<unsigned char> : DBusBasicType<DBUS_TYPE_BYTE, 'y', unsigned char> {};
 
-using DBusArg = std::variant<std::string, int32_t, int64_t, bool, recursive_wrapper<struct DBusVariant>, struct DBusObjectPath,
-                             struct DBusArray, recursive_wrapper<struct DBusDict>>;
+template <>
+struct DBusType<std::string>
+{
+  static constexpr int code = DBUS_TYPE_STRING;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_STRING_AS_STRING);
 
-struct DBusObjectPath
+  static void write(DBusMessageIter *iter, std::string const &value)
+  {
+    char const *str = value.c_str();
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &str);
+  }
+
+  static bool read(DBusMessageIter *iter, std::string *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING)
+      return false;
+    char const *str;
+    dbus_message_iter_get_basic(iter, &str);
+    *value = str;
+    return true;
+  }
+
+  static void write(DBusWireWriter *writer, std::string const &value)
+  {
+    writer->putString(value);
+  }
+
+  static bool read(DBusWireReader *reader, std::string *value)
+  {
+    return reader->getString(value);
+  }
+};
+
+template <>
+struct DBusType<DBusObjectPath>
 {
-  std::string d_value;
+  static constexpr int code = DBUS_TYPE_OBJECT_PATH;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_OBJECT_PATH_AS_STRING);
+
+  static void write(DBusMessageIter *iter, DBusObjectPath const &value)
+  {
+    char const *str = value.d_value.c_str();
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &str);
+  }
+
+  static bool read(DBusMessageIter *iter, DBusObjectPath *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_OBJECT_PATH)
+      return false;
+    char const *str;
+    dbus_message_iter_get_basic(iter, &str);
+    value->d_value = str;
+    return true;
+  }
+
+  static void write(DBusWireWriter *writer, DBusObjectPath const &value)
+  {
+    writer->putString(value.d_value);
+  }
+
+  static bool read(DBusWireReader *reader, DBusObjectPath *value)
+  {
+    return reader->getString(&value->d_value);
+  }
 };
 
-struct DBusArray : public std::vector<DBusArg>
+template <typename T>
+struct DBusType<DBusVariantOf<T>>
 {
-  using std::vector<DBusArg>::vector;
+  static constexpr int code = DBUS_TYPE_VARIANT;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_VARIANT_AS_STRING);
+
+  static void write(DBusMessageIter *iter, DBusVariantOf<T> const &value)
+  {
+    DBusMessageIter iter_sub;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, DBusType<T>::signature.c_str(), &iter_sub);
+    DBusType<T>::write(&iter_sub, value.d_value);
+    dbus_message_iter_close_container(iter, &iter_sub);
+  }
+
+  static bool read(DBusMessageIter *iter, DBusVariantOf<T> *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+      return false;
+    DBusMessageIter iter_sub;
+    dbus_message_iter_recurse(iter, &iter_sub);
+    return DBusType<T>::read(&iter_sub, &value->d_value);
+  }
+
+  static void write(DBusWireWriter *writer, DBusVariantOf<T> const &value)
+  {
+    writer->putSignature(DBusType<T>::signature.c_str());
+    DBusType<T>::write(writer, value.d_value);
+  }
+
+  static bool read(DBusWireReader *reader, DBusVariantOf<T> *value)
+  {
+    std::string contained;
+    return reader->getSignature(&contained) && contained == DBusType<T>::signature.c_str() &&
+      DBusType<T>::read(reader, &value->d_value);
+  }
 };
 
-struct DBusVariant
+template <typename... T>
+struct DBusType<DBusVariantOneOf<T...>>
 {
-  DBusArg d_value;
+  static constexpr int code = DBUS_TYPE_VARIANT;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_VARIANT_AS_STRING);
+
+  template <typename Writer>
+  static void write(Writer *writer, DBusVariantOneOf<T...> const &value)
+  {
+    std::visit([writer](auto const &v)
+    {
+      using V = std::decay_t<decltype(v)>;
+      if constexpr (!std::is_same_v<V, std::monostate>)
+        DBusType<DBusVariantOf<V>>::write(writer, DBusVariantOf<V>{v});
+    }, value.d_value);
+  }
+
+  static bool read(DBusMessageIter *iter, DBusVariantOneOf<T...> *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+      return false;
+    DBusMessageIter iter_sub;
+    dbus_message_iter_recurse(iter, &iter_sub);
+    // try the types in order, the first that decodes the contents wins
+    value->d_value = std::monostate{};
+    (readAs<T>(iter_sub, value) || ...);
+    return true;
+  }
+
+  static bool read(DBusWireReader *reader, DBusVariantOneOf<T...> *value)
+  {
+    std::string contained;
+    if (!reader->getSignature(&contained))
+      return false;
+    // the first type with the contents' signature reads them, contents of any other type are skipped
+    value->d_value = std::monostate{};
+    bool known = false;
+    bool ok = ((contained == DBusType<T>::signature.c_str() && (known = true) && readAs<T>(reader, value)) || ...);
+    if (known)
+      return ok;
+    char const *signature = contained.c_str();
+    return reader->skip(&signature) && *signature == '\0';
+  }
+
+ private:
+  template <typename U>
+  static bool readAs(DBusMessageIter iter, DBusVariantOneOf<T...> *value)
+  {
+    U v;
+    if (!DBusType<U>::read(&iter, &v))
+      return false;
+    value->d_value = std::move(v);
+    return true;
+  }
+
+  template <typename U>
+  static bool readAs(DBusWireReader *reader, DBusVariantOneOf<T...> *value)
+  {
+    U v;
+    if (!DBusType<U>::read(reader, &v))
+      return false;
+    value->d_value = std::move(v);
+    return true;
+  }
 };
 
-struct DBusDictElement
+template <typename T>
+struct DBusType<std::vector<T>>
 {
-  //std::variant<std::string, int32_t, int64_t, bool> d_key;
-  DBusArg d_key; // NOTE: only basic types are allowed as dict key by dbus spec
-  DBusArg d_value;
+  static constexpr int code = DBUS_TYPE_ARRAY;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_ARRAY_AS_STRING) + DBusType<T>::signature;
+
+  static void write(DBusMessageIter *iter, std::vector<T> const &value)
+  {
+    DBusMessageIter iter_sub;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, DBusType<T>::signature.c_str(), &iter_sub);
+    if constexpr (std::is_same_v<T, unsigned char>)
+    {
+      unsigned char const *data = value.data();
+      dbus_message_iter_append_fixed_array(&iter_sub, DBUS_TYPE_BYTE, &data, value.size());
+    }
+    else
+      for (auto const &v : value)
+        DBusType<T>::write(&iter_sub, v);
+    dbus_message_iter_close_container(iter, &iter_sub);
+  }
+
+  static bool read(DBusMessageIter *iter, std::vector<T> *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+        dbus_message_iter_get_element_type(iter) != DBusType<T>::code)
+      return false;
+    DBusMessageIter iter_sub;
+    dbus_message_iter_recurse(iter, &iter_sub);
+    if constexpr (std::is_same_v<T, unsigned char>)
+    {
+      unsigned char const *data = nullptr;
+      int len = 0;
+      dbus_message_iter_get_fixed_array(&iter_sub, &data, &len);
+      value->assign(data, data + len);
+    }
+    else
+    {
+      value->clear();
+      while (dbus_message_iter_get_arg_type(&iter_sub) != DBUS_TYPE_INVALID)
+      {
+        if (!DBusType<T>::read(&iter_sub, &value->emplace_back()))
+          return false;
+        dbus_message_iter_next(&iter_sub);
+      }
+    }
+    return true;
+  }
+
+  static constexpr int alignment = dbusAlignment(DBusType<T>::signature.d_sig[0]);
+
+  static void write(DBusWireWriter *writer, std::vector<T> const &value)
+  {
+    std::size_t length = writer->beginArray(alignment);
+    if constexpr (std::is_same_v<T, unsigned char>)
+      writer->putBytes(value.data(), value.size());
+    else
+      for (auto const &v : value)
+        DBusType<T>::write(writer, v);
+    writer->endArray(length, alignment);
+  }
+
+  static bool read(DBusWireReader *reader, std::vector<T> *value)
+  {
+    std::size_t end = 0;
+    if (!reader->beginArray(alignment, &end))
+      return false;
+    if constexpr (std::is_same_v<T, unsigned char>)
+    {
+      std::size_t size = end - reader->pos();
+      unsigned char const *data = nullptr;
+      if (!reader->getBytes(size, &data))
+        return false;
+      value->assign(data, data + size);
+    }
+    else
+    {
+      value->clear();
+      while (reader->pos() < end)
+        if (!DBusType<T>::read(reader, &value->emplace_back()))
+          return false;
+    }
+    return reader->pos() == end;
+  }
 };
 
-struct DBusDict : public std::vector<DBusDictElement>
+template <typename K, typename V>
+struct DBusType<std::map<K, V>>
+{
+  static constexpr int code = DBUS_TYPE_ARRAY;
+  static constexpr auto signature = makeDBusSignature(DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING) +
+    DBusType<K>::signature + DBusType<V>::signature + makeDBusSignature(DBUS_DICT_ENTRY_END_CHAR_AS_STRING);
+
+  static void write(DBusMessageIter *iter, std::map<K, V> const &value)
+  {
+    DBusMessageIter iter_sub;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, signature.c_str() + 1, &iter_sub);
+    for (auto const &[k, v] : value)
+    {
+      DBusMessageIter iter_entry;
+      dbus_message_iter_open_container(&iter_sub, DBUS_TYPE_DICT_ENTRY, nullptr, &iter_entry);
+      DBusType<K>::write(&iter_entry, k);
+      DBusType<V>::write(&iter_entry, v);
+      dbus_message_iter_close_container(&iter_sub, &iter_entry);
+    }
+    dbus_message_iter_close_container(iter, &iter_sub);
+  }
+
+  static bool read(DBusMessageIter *iter, std::map<K, V> *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+        dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY)
+      return false;
+    DBusMessageIter iter_sub;
+    dbus_message_iter_recurse(iter, &iter_sub);
+    value->clear();
+    while (dbus_message_iter_get_arg_type(&iter_sub) != DBUS_TYPE_INVALID)
+    {
+      DBusMessageIter iter_entry;
+      dbus_message_iter_recurse(&iter_sub, &iter_entry);
+      K k;
+      V v;
+      if (!DBusType<K>::read(&iter_entry, &k) ||
+          !dbus_message_iter_next(&iter_entry) ||
+          !DBusType<V>::read(&iter_entry, &v))
+        return false;
+      value->emplace(std::move(k), std::move(v));
+      dbus_message_iter_next(&iter_sub);
+    }
+    return true;
+  }
+
+  static void write(DBusWireWriter *writer, std::map<K, V> const &value)
+  {
+    std::size_t length = writer->beginArray(8);
+    for (auto const &[k, v] : value)
+    {
+      writer->align(8); // (dict entries are aligned like structs)
+      DBusType<K>::write(writer, k);
+      DBusType<V>::write(writer, v);
+    }
+    writer->endArray(length, 8);
+  }
+
+  static bool read(DBusWireReader *reader, std::map<K, V> *value)
+  {
+    std::size_t end = 0;
+    if (!reader->beginArray(8, &end))
+      return false;
+    value->clear();
+    while (reader->pos() < end)
+    {
+      K k;
+      V v;
+      if (!reader->align(8) ||
+          !DBusType<K>::read(reader, &k) ||
+          !DBusType<V>::read(reader, &v))
+        return false;
+      value->emplace(std::move(k), std::move(v));
+    }
+    return reader->pos() == end;
+  }
+};
+
+// concatenated signature of a list of types (eg. the full signature of a message body)
+template <typename... T>
+constexpr auto dbusSignatureOf()
+{
+  return (makeDBusSignature("") + ... + DBusType<T>::signature);
+}
+
+// write/read a sequence of values to/from consecutive positions of iter
+template <typename... T, std::size_t... I>
+inline void dbusWriteAll(DBusMessageIter *iter, std::tuple<T...> const &values, std::index_sequence<I...>)
 {
-  using std::vector<DBusDictElement>::vector;
+  (DBusType<T>::write(iter, std::get<I>(values)), ...);
+}
+
+template <typename... T, std::size_t... I>
+inline bool dbusReadAll(DBusMessageIter *iter, [[maybe_unused]] std::tuple<T...> *values, std::index_sequence<I...>)
+{
+  bool ok = true;
+  // reads until the first failure, each read is followed by a step to the next element
+  ((ok = ok && DBusType<T>::read(iter, &std::get<I>(*values)) && (dbus_message_iter_next(iter), true)), ...);
+  return ok && dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_INVALID;
+}
+
+template <typename... T, std::size_t... I>
+inline void dbusWriteAll(DBusWireWriter *writer, std::tuple<T...> const &values, std::index_sequence<I...>)
+{
+  (DBusType<T>::write(writer, std::get<I>(values)), ...);
+}
+
+// (unlike the libdbus version, this does not check that nothing follows the values)
+template <typename... T, std::size_t... I>
+inline bool dbusReadAll([[maybe_unused]] DBusWireReader *reader, [[maybe_unused]] std::tuple<T...> *values, std::index_sequence<I...>)
+{
+  bool ok = true;
+  ((ok = ok && DBusType<T>::read(reader, &std::get<I>(*values))), ...);
+  return ok;
+}
+
+template <typename... T>
+struct DBusType<std::tuple<T...>>
+{
+  static constexpr int code = DBUS_TYPE_STRUCT;
+  static constexpr auto signature = makeDBusSignature(DBUS_STRUCT_BEGIN_CHAR_AS_STRING) + dbusSignatureOf<T...>() +
+    makeDBusSignature(DBUS_STRUCT_END_CHAR_AS_STRING);
+
+  static void write(DBusMessageIter *iter, std::tuple<T...> const &value)
+  {
+    DBusMessageIter iter_sub;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, nullptr, &iter_sub);
+    dbusWriteAll(&iter_sub, value, std::index_sequence_for<T...>{});
+    dbus_message_iter_close_container(iter, &iter_sub);
+  }
+
+  static bool read(DBusMessageIter *iter, std::tuple<T...> *value)
+  {
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRUCT)
+      return false;
+    DBusMessageIter iter_sub;
+    dbus_message_iter_recurse(iter, &iter_sub);
+    return dbusReadAll(&iter_sub, value, std::index_sequence_for<T...>{});
+  }
+
+  static void write(DBusWireWriter *writer, std::tuple<T...> const &value)
+  {
+    writer->align(8);
+    dbusWriteAll(writer, value, std::index_sequence_for<T...>{});
+  }
+
+  static bool read(DBusWireReader *reader, std::tuple<T...> *value)
+  {
+    return reader->align(8) && dbusReadAll(reader, value, std::index_sequence_for<T...>{});
+  }
 };
 
+/*
+  Typed method descriptor. In and Out are std::tuple's of the argument and reply types,
+  for example:
+
+    DBusMethod<std::tuple<std::string, DBusVariantOf<std::string>>,
+               std::tuple<DBusVariantOf<std::string>, DBusObjectPath>> constexpr OpenSession{"org.freedesktop.Secret.Service", "OpenSession"};
+
+  has in_signature "sv" and out_signature "vo", both known at compile time.
+*/
+template <typename In, typename Out>
+struct DBusMethod;
+
+template <typename... In, typename... Out>
+struct DBusMethod<std::tuple<In...>, std::tuple<Out...>>
+{
+  using Args = std::tuple<In...>;
+  using Reply = std::tuple<Out...>;
+
+  static constexpr auto in_signature = dbusSignatureOf<In...>();
+  static constexpr auto out_signature = dbusSignatureOf<Out...>();
+
+  char const *d_interface;
+  char const *d_member;
+};
+
+// appends a value to the lookup key of a cached message template
+inline void dbusAppendKey(std::string *key, std::string const &value)
+{
+  *key += value;
+  *key += '\0';
+}
+
+inline void dbusAppendKey(std::string *key, DBusObjectPath const &value)
+{
+  dbusAppendKey(key, value.d_value);
+}
+
+template <typename T>
+inline std::enable_if_t<std::is_arithmetic_v<T>> dbusAppendKey(std::string *key, T value)
+{
+  dbusAppendKey(key, std::to_string(value));
+}
+
+template <typename T>
+inline void dbusAppendKey(std::string *key, DBusVariantOf<T> const &value)
+{
+  dbusAppendKey(key, value.d_value);
+}
+
+template <typename T>
+inline void dbusAppendKey(std::string *key, std::vector<T> const &value)
+{
+  dbusAppendKey(key, value.size());
+  for (auto const &v : value)
+    dbusAppendKey(key, v);
+}
+
+template <typename... T>
+inline void dbusAppendKey(std::string *key, std::tuple<T...> const &value)
+{
+  std::apply([key](auto const &... v) { (dbusAppendKey(key, v), ...); }, value);
+}
+
+template <typename T>
+inline constexpr DBusMethod<std::tuple<std::string, std::string>, std::tuple<DBusVariantOf<T>>> DBusPropertiesGet{"org.freedesktop.DBus.Properties", "Get"};
+template <typename... T>
+inline constexpr DBusMethod<std::tuple<std::string>, std::tuple<std::map<std::string, DBusVariantOneOf<T...>>>> DBusPropertiesGetAll{"org.freedesktop.DBus.Properties", "GetAll"};
+
+/*
+  Owned reply to a method call (or a signal), received on either transport. Any number of them
+  can be kept around at the same time (see callAsync()). as<>() decodes all fields in a single
+  pass over the message, the resulting tuple is the random access view of the reply.
+*/
+class DBusReply
+{
+  mutable std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> d_message;
+  std::unique_ptr<DBusWireMessage> d_wiremessage; // (native transport)
+
+ public:
+  inline explicit DBusReply(DBusMessage *message = nullptr);
+  inline explicit DBusReply(std::unique_ptr<DBusWireMessage> message);
+  DBusReply(DBusReply &&other) = default;
+  DBusReply &operator=(DBusReply &&other) = default;
+  inline bool ok() const;
+  inline int type() const;
+  inline std::string interface() const;
+  inline std::string member() const;
+  inline std::string path() const;
+
+  // decode the full reply as the given types (see DBusType)
+  template <typename... Out>
+  inline std::optional<std::tuple<Out...>> as() const;
+
+  // the reply as a libdbus message (converted on first use if it came in on the native
+  // transport, only for the transcript and trace output)
+  inline DBusMessage *dbusMessage() const;
+};
+
+/*
+  A method call that has been sent, but whose reply has not been read yet (see
+  DBusCon::callAsync()). Several of these can be in flight at the same time.
+*/
+class DBusPending
+{
+  friend class DBusCon;
+  std::unique_ptr<DBusPendingCall, decltype(&::dbus_pending_call_unref)> d_pending; // libdbus
+  uint32_t d_serial;                                                                // DBusWire
+  int d_timeoutms;
+  std::string d_stage;
+  std::chrono::steady_clock::time_point d_sent;
+  std::string d_key;                                                                // transcript
+
+ public:
+  inline DBusPending();
+  inline bool ok() const;
+};
+
+template <typename... Out>
+struct DBusPendingReply : public DBusPending
+{};
+
+inline DBusPending::DBusPending()
+  :
+  d_pending(nullptr, &::dbus_pending_call_unref),
+  d_serial(0),
+  d_timeoutms(0)
+{}
+
+inline bool DBusPending::ok() const
+{
+  return d_pending || d_serial;
+}
+
 class DBusCon
 {
-  DBusError d_error;
+  DBusCallError d_error;
   DBusConnection *d_connection;
-  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> d_reply;
+  std::unique_ptr<DBusWire> d_wire; // native transport (used instead of d_connection when set)
+  std::map<std::string, std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)>> d_templates;
+  std::map<std::string, DBusWireMessage> d_wiretemplates;
   bool d_ok;
 
+  // times the message builders of call() and callCached() (see tools/dbus_transport_bench.cc)
+  friend void benchMessageConstruction(DBusCon *dbuscon, bool native, int calls);
+
  public:
   inline DBusCon();
   inline ~DBusCon();
   inline bool ok() const;
-
-  inline void callMethod(std::string const &destination, std::string const &path, std::string const &interface, std::string const &method, std::vector<DBusArg> const &args);
-  inline void callMethod(std::string const &destination, std::string const &path, std::string const &interface, std::string const &method);
-  inline void showResponse(DBusMessage *reply);
+  inline bool connected();
+
+  template <typename... In, typename... Out>
+  inline std::optional<std::tuple<Out...>> call(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                std::string const &destination, std::string const &path,
+                                                std::tuple<In...> const &args);
+  template <typename... Out>
+  inline std::optional<std::tuple<Out...>> call(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                                                std::string const &destination, std::string const &path);
+  template <typename... In, typename... Out>
+  inline std::optional<std::tuple<Out...>> callCached(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                      std::string const &destination, std::string const &path,
+                                                      std::tuple<In...> const &args);
+  inline void showResponse(DBusMessage *reply, bool secret = false);
+
+  template <typename... In, typename... Out>
+  inline DBusPendingReply<Out...> callAsync(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                            std::string const &destination, std::string const &path,
+                                            std::tuple<In...> const &args);
+  template <typename... Out>
+  inline DBusPendingReply<Out...> callAsync(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                                            std::string const &destination, std::string const &path);
+  template <typename... In, typename... Out>
+  inline DBusPendingReply<Out...> callCachedAsync(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                  std::string const &destination, std::string const &path,
+                                                  std::tuple<In...> const &args);
+  template <typename... Out>
+  inline std::optional<std::tuple<Out...>> wait(DBusPendingReply<Out...> *pending);
+  inline DBusReply waitReply(DBusPending *pending);
+
+  template <typename... In, typename... Out>
+  inline bool send(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                   std::string const &destination, std::string const &path,
+                   std::tuple<In...> const &args);
+  template <typename... Out>
+  inline bool send(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                   std::string const &destination, std::string const &path);
 
   inline bool matchSignal(std::string const &matchingrule);
   inline bool waitSignal(int attempts, int timeoutms_per_attempt, std::string const &interface, std::string const &name);
-
-  template <typename T>
-  inline T get(std::string const &sig, std::vector<int> const &idx, T def = T{});
-
-  template <typename T>
-  inline T get(std::string const &sig, int idx, T def = T{});
+  inline DBusReply nextSignal(int timeoutms, std::string const &interface);
 
  private:
-  template <typename T>
-  inline void addBasic(T const &t, DBusMessageIter *dbus_iter, bool isvar = false, bool isarray = false);
-  inline void passArg(DBusDictElement const &arg, DBusMessageIter *dbus_iter, bool isvar = false, bool isarray = false);
-  inline void passArg(DBusArg const &arg, DBusMessageIter *dbus_iter, bool isvar = false, bool isarray = false);
-  inline void showresponse2(DBusMessageIter *iter, int indent);
-
-  template <typename T>
-  inline bool setBasicTypeReturn(T *target, int current_type, DBusMessageIter *iter);
-  template <typename T>
-  inline void set(T *ret, DBusMessageIter *iter, int current_type);
-  template <typename T>
-  inline T get2(DBusMessageIter *iter, std::vector<int> const &idx, T def = T{});
+  inline void showresponse2(DBusMessageIter *iter, int indent, std::ostream &out, bool secret, bool dictentry = false);
+  inline bool ensureTransport();
+  inline bool native() const;
+  inline void setError(DBusError *error);
+  inline DBusReply sendAndBlock(DBusMessage *message);
+  inline DBusReply sendAndBlock(DBusWireMessage *message);
+  inline void sendAsync(DBusMessage *message, DBusPending *pending);
+  inline void sendAsync(DBusWireMessage *message, DBusPending *pending);
+  inline DBusReply finishCall(std::string const &stage, std::string const &key,
+                              std::chrono::steady_clock::time_point sent, DBusReply reply);
+  inline DBusReply popMessage(int timeoutms, std::chrono::steady_clock::time_point start);
+  inline void reportError(std::string const &stage);
+  template <typename... In, typename... Out>
+  inline static std::string templateKey(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                        std::string const &destination, std::tuple<In...> const &args);
+  template <typename... In, typename... Out>
+  inline DBusMessage *cachedMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                       std::string const &destination, std::string const &path,
+                                       std::tuple<In...> const &args);
+  template <typename... In, typename... Out>
+  inline DBusWireMessage cachedWireMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                              std::string const &destination, std::string const &path,
+                                              std::tuple<In...> const &args);
+  template <typename... In, typename... Out>
+  inline DBusMessage *newMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                    std::string const &destination, std::string const &path,
+                                    std::tuple<In...> const &args);
+  template <typename... In, typename... Out>
+  inline static DBusWireMessage newWireMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                  std::string const &destination, std::string const &path,
+                                                  std::tuple<In...> const &args);
 };
 
 inline DBusCon::DBusCon()
   :
   d_connection(nullptr),
-  d_reply(nullptr, &::dbus_message_unref),
   d_ok(false)
 {
-  dbus_error_init(&d_error);
-  d_connection = dbus_bus_get_private(DBUS_BUS_SESSION, &d_error);
+  if (g_transcript.replaying())
+  {
+    d_ok = true;
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (g_nativedbus)
+  {
+    d_wire.reset(new DBusWire);
+    if (d_wire->connect())
+    {
+      d_ok = true;
+      g_bench.observe("connect", start);
+      return;
+    }
+    LOG_DEBUG(DBus) << "Native dbus connection failed, falling back to libdbus";
+    d_wire.reset();
+  }
+
+  DBusError error;
+  dbus_error_init(&error);
+  d_connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+  setError(&error);
 
   if (d_connection)
     d_ok = true;
+  g_bench.observe("connect", start);
 }
 
 inline DBusCon::~DBusCon()
@@ -159,8 +857,6 @@ inline DBusCon::~DBusCon()
     dbus_connection_close(d_connection);
     dbus_connection_unref(d_connection);
   }
-  if (dbus_error_is_set(&d_error))
-    dbus_error_free(&d_error);
 }
 
 inline bool DBusCon::ok() const
@@ -168,50 +864,86 @@ inline bool DBusCon::ok() const
   return d_ok;
 }
 
+// takes over (and frees) an error set by libdbus
+inline void DBusCon::setError(DBusError *error)
+{
+  if (!dbus_error_is_set(error))
+    return;
+  d_error.set(error->name, error->message ? error->message : "");
+  dbus_error_free(error);
+}
+
 inline bool DBusCon::matchSignal(std::string const &matchingrule)
 {
   //Rules are specified as a string of comma separated key/value pairs. An example is "type='signal',sender='org.freedesktop.DBus', interface='org.freedesktop.DBus',member='Foo', path='/bar/foo',destination=':452345.34'"
   // Possible keys you can match on are type, sender, interface, member, path, destination and numbered keys to match message args (keys are 'arg0', 'arg1', etc.).
-  dbus_bus_add_match(d_connection, matchingrule.c_str(), &d_error);
-  if (dbus_error_is_set(&d_error))
+  if (g_transcript.replaying())
+    return true;
+  if (!ensureTransport())
+    return false;
+  if (d_wire)
+    d_wire->addMatch(matchingrule, &d_error);
+  else
+  {
+    DBusError error;
+    dbus_error_init(&error);
+    dbus_bus_add_match(d_connection, matchingrule.c_str(), &error);
+    setError(&error);
+  }
+  if (d_error.isSet())
   {
     std::cout << "ERROR: ::dbus_message_new_method_call - Unable to allocate memory for the message!" << std::endl;
+    d_error.clear();
     return false;
   }
-  dbus_connection_flush(d_connection);
+  if (!d_wire)
+    dbus_connection_flush(d_connection);
   return true;
 }
 
+// the next incoming message, whichever transport it comes in on (or from the transcript). An
+// empty reply (!ok()) if there is none within timeoutms
+inline DBusReply DBusCon::popMessage(int timeoutms, std::chrono::steady_clock::time_point start)
+{
+  DBusReply message(g_transcript.replaying() ? DBusReply(g_transcript.signal(start)) :
+                    d_wire ? DBusReply(d_wire->popMessage(timeoutms)) : DBusReply(dbus_connection_pop_message(d_connection)));
+  if (message.ok() && g_transcript.recording())
+    g_transcript.recordSignal(message.dbusMessage(), std::chrono::steady_clock::now() - start);
+  return message;
+}
+
 inline bool DBusCon::waitSignal(int attempts, int timeoutms_per_attempt, std::string const &interface, std::string const &name)
 {
-  if (g_verbose) std::cout << "(waitSignal)";
-  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_signal_msg(nullptr, &::dbus_message_unref);
+  LOG_DEBUG(DBus) << "(waitSignal " << interface << "." << name << ")";
+  g_log.flush(); // (this may wait for the user)
+  auto start = std::chrono::steady_clock::now();
   for (int i = 0; i < attempts; ++i)
   {
-    if (g_verbose) std::cout << "." << std::flush;
-    dbus_connection_read_write(d_connection, timeoutms_per_attempt);
-    while (true)
+    int attempt_timeoutms = deadlineTimeout(timeoutms_per_attempt);
+    if (deadlineExpired("waitSignal(" + interface + "." + name + ")"))
+      break;
+    LOG_TRACE(DBus) << "(waitSignal attempt " << i + 1 << "/" << attempts << ")";
+    if (!d_wire && !g_transcript.replaying())
+      dbus_connection_read_write(d_connection, attempt_timeoutms);
+    for (int timeoutms = attempt_timeoutms; ; timeoutms = 0)
     {
-      dbus_signal_msg.reset(dbus_connection_pop_message(d_connection));
-      if (!dbus_signal_msg)
+      DBusReply dbus_signal_msg(popMessage(timeoutms, start));
+      if (!dbus_signal_msg.ok())
         break;
 
-      // showResponse(dbus_signal_msg.get());
-      // std::cout << "sender " << dbus_message_get_sender(dbus_signal_msg.get()) << std::endl;
-      // std::cout << "path   " << dbus_message_get_path(dbus_signal_msg.get()) << std::endl;
-      // std::cout << "iface  " << dbus_message_get_interface(dbus_signal_msg.get()) << std::endl;
-      // std::cout << "dest   " << dbus_message_get_destination(dbus_signal_msg.get()) << std::endl;
-      // std::cout << "member " << dbus_message_get_member(dbus_signal_msg.get()) << std::endl;
-      // std::cout << "type   " << dbus_message_get_type(dbus_signal_msg.get()) << std::endl;
+      // showResponse(dbus_signal_msg.dbusMessage());
+      // std::cout << "path   " << dbus_signal_msg.path() << std::endl;
+      // std::cout << "iface  " << dbus_signal_msg.interface() << std::endl;
+      // std::cout << "member " << dbus_signal_msg.member() << std::endl;
+      // std::cout << "type   " << dbus_signal_msg.type() << std::endl;
 
       // check if the message is a signal from the correct interface and with the correct name
-      if (dbus_message_is_signal(dbus_signal_msg.get(), interface.c_str(), name.c_str()))
+      if (dbus_signal_msg.type() == DBUS_MESSAGE_TYPE_SIGNAL && dbus_signal_msg.interface() == interface &&
+          dbus_signal_msg.member() == name)
       {
-        if (g_verbose)
-        {
-          std::cout << std::endl << " *** RECEIVED SIGNAL WE WERE WATING FOR... " << std::endl;
-          showResponse(dbus_signal_msg.get());
-        }
+        LOG_DEBUG(DBus) << " *** RECEIVED SIGNAL WE WERE WATING FOR... ";
+        if (LOG_TRACE_ENABLED(DBus))
+          showResponse(dbus_signal_msg.dbusMessage());
         return true;
       }
       // else
@@ -220,240 +952,455 @@ inline bool DBusCon::waitSignal(int attempts, int timeoutms_per_attempt, std::st
       // }
     }
   }
-  if (g_verbose) std::cout << std::endl;
+  LOG_DEBUG(DBus) << "(waitSignal: no signal)";
   return false;
 }
 
-template <typename T>
-inline void DBusCon::addBasic(T const &t, DBusMessageIter *dbus_iter, bool isvar, bool isarray)
+/*
+  The next signal from 'interface' (subscribe to it with matchSignal() first) that arrives
+  within timeoutms. Any other message that arrives in the meantime is dropped. Returns an empty
+  reply (!ok()) if there was none.
+*/
+inline DBusReply DBusCon::nextSignal(int timeoutms, std::string const &interface)
 {
-  if constexpr (std::is_same_v<T, DBusObjectPath>)
+  timeoutms = deadlineTimeout(timeoutms);
+  auto start = std::chrono::steady_clock::now();
+  // (only block if nothing was queued already, eg. read along with an earlier reply or signal)
+  if (!d_wire && !g_transcript.replaying() &&
+      dbus_connection_get_dispatch_status(d_connection) != DBUS_DISPATCH_DATA_REMAINS)
+    dbus_connection_read_write(d_connection, timeoutms);
+  for (int t = timeoutms; ; t = 0)
   {
-    if (isvar)
+    DBusReply message(popMessage(t, start));
+    if (!message.ok())
+      return DBusReply();
+
+    if (message.type() == DBUS_MESSAGE_TYPE_SIGNAL && message.interface() == interface)
     {
-      DBusMessageIter dbus_iter_sub;
-      dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_VARIANT, DBUS_TYPE_OBJECT_PATH_AS_STRING, &dbus_iter_sub);
-      dbus_message_iter_append_basic(&dbus_iter_sub, DBUS_TYPE_OBJECT_PATH, &t.d_value);
-      dbus_message_iter_close_container(dbus_iter, &dbus_iter_sub);
+      LOG_DEBUG(DBus) << "(Signal " << interface << "." << message.member() << " from " << message.path() << ")";
+      if (LOG_TRACE_ENABLED(DBus))
+        showResponse(message.dbusMessage());
+      return message;
     }
-    else
-      dbus_message_iter_append_basic(dbus_iter, DBUS_TYPE_OBJECT_PATH, &t.d_value);
   }
-  if constexpr (std::is_same_v<T, std::string>)
+}
+
+// false once the bus connection is lost (or, when replaying, all recorded signals are used up)
+inline bool DBusCon::connected()
+{
+  if (g_transcript.replaying())
+    return g_transcript.hasSignals();
+  if (d_wire)
+    return d_wire->connected();
+  return d_connection && dbus_connection_get_is_connected(d_connection);
+}
+
+// false if there is no connection to send on. Once the native transport has given up (see
+// DBusWire::fail()), the rest of the run continues on a libdbus connection.
+inline bool DBusCon::ensureTransport()
+{
+  if (!d_wire || d_wire->connected())
+    return d_wire || d_connection;
+
+  LOG_DEBUG(DBus) << "Native dbus connection lost, falling back to libdbus";
+  d_wire.reset();
+  DBusError error;
+  dbus_error_init(&error);
+  d_connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+  setError(&error);
+  if (!d_connection)
   {
-    if (isvar)
-    {
-      DBusMessageIter dbus_iter_sub;
-      dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_VARIANT, DBUS_TYPE_STRING_AS_STRING, &dbus_iter_sub);
-      dbus_message_iter_append_basic(&dbus_iter_sub, DBUS_TYPE_STRING, &t);
-      dbus_message_iter_close_container(dbus_iter, &dbus_iter_sub);
-    }
-    else
-      dbus_message_iter_append_basic(dbus_iter, DBUS_TYPE_STRING, &t);
+    std::cout << "Error: " << std::endl << d_error.d_name << " : " << d_error.d_message << std::endl;
+    d_error.clear();
+    d_ok = false;
+    return false;
   }
-  else if constexpr (std::is_same_v<T, int32_t>)
+  return true;
+}
+
+// whether the next call goes out on the native transport, ie. is built as a DBusWireMessage
+// (when it has failed, the call is built for libdbus, see ensureTransport())
+inline bool DBusCon::native() const
+{
+  return d_wire && d_wire->connected();
+}
+
+inline DBusReply DBusCon::sendAndBlock(DBusMessage *message)
+{
+  std::string stage(std::string(dbus_message_get_interface(message)) + "." + dbus_message_get_member(message));
+
+  int timeoutms = deadlineTimeout(25000); // (libdbus' default timeout)
+  if (deadlineExpired(stage) || (!g_transcript.replaying() && !ensureTransport()))
+    return DBusReply();
+
+  // on timeout, libdbus (and DBusWire) drop the pending call, a late reply is discarded
+  std::string key = (g_transcript.recording() || g_transcript.replaying()) ? DBusTranscript::key(message) : std::string();
+  auto sent = std::chrono::steady_clock::now();
+  if (g_transcript.replaying())
+    return finishCall(stage, key, sent, DBusReply(g_transcript.reply(key, sent, timeoutms, &d_error)));
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessage *reply = dbus_connection_send_with_reply_and_block(d_connection, message, timeoutms, &error);
+  setError(&error);
+  return finishCall(stage, key, sent, DBusReply(reply));
+}
+
+inline DBusReply DBusCon::sendAndBlock(DBusWireMessage *message)
+{
+  std::string stage(message->d_interface + "." + message->d_member);
+
+  int timeoutms = deadlineTimeout(25000);
+  if (deadlineExpired(stage))
+    return DBusReply();
+
+  std::string key = g_transcript.recording() ? DBusTranscript::key(*message) : std::string();
+  auto sent = std::chrono::steady_clock::now();
+  return finishCall(stage, key, sent, DBusReply(d_wire->sendWithReplyAndBlock(message, timeoutms, &d_error)));
+}
+
+// the bookkeeping shared by every call, on either transport, once its reply (or error) is in
+inline DBusReply DBusCon::finishCall(std::string const &stage, std::string const &key,
+                                     std::chrono::steady_clock::time_point sent, DBusReply reply)
+{
+  auto duration = std::chrono::steady_clock::now() - sent;
+  g_metrics.observeCall(duration, reply.ok());
+  g_bench.observe(stage.substr(stage.rfind('.') + 1), sent);
+  if (g_transcript.recording())
+    g_transcript.recordReply(key, stage, reply.dbusMessage(), &d_error, duration);
+  if (!reply.ok())
   {
-    if (isvar)
-    {
-      DBusMessageIter dbus_iter_sub;
-      dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_VARIANT, DBUS_TYPE_INT32_AS_STRING, &dbus_iter_sub);
-      dbus_message_iter_append_basic(&dbus_iter_sub, DBUS_TYPE_INT32, &t);
-      dbus_message_iter_close_container(dbus_iter, &dbus_iter_sub);
-    }
-    dbus_message_iter_append_basic(dbus_iter, DBUS_TYPE_INT32, &t);
+    reportError(stage);
+    return DBusReply();
   }
-  else if constexpr (std::is_same_v<T, int64_t>)
+
+  // show output
+  if (LOG_TRACE_ENABLED(DBus))
+    showResponse(reply.dbusMessage(), DBusTranscript::isSecretReply(stage, reply.dbusMessage()));
+
+  return reply;
+}
+
+template <typename... In, typename... Out>
+inline DBusMessage *DBusCon::newMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                           std::string const &destination, std::string const &path,
+                                           std::tuple<In...> const &args)
+{
+  DBusMessage *dbus_message = dbus_message_new_method_call(destination.c_str(), path.c_str(), method.d_interface, method.d_member);
+  if (!dbus_message)
   {
-    if (isvar)
-    {
-      DBusMessageIter dbus_iter_sub;
-      dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_VARIANT, DBUS_TYPE_INT64_AS_STRING, &dbus_iter_sub);
-      dbus_message_iter_append_basic(&dbus_iter_sub, DBUS_TYPE_INT64, &t);
-      dbus_message_iter_close_container(dbus_iter, &dbus_iter_sub);
-    }
-    dbus_message_iter_append_basic(dbus_iter, DBUS_TYPE_INT64, &t);
+    std::cout << "ERROR: ::dbus_message_new_method_call - Unable to allocate memory for the message!" << std::endl;
+    return nullptr;
   }
-  else if constexpr (std::is_same_v<T, bool>)
+
+  if constexpr (sizeof...(In) > 0)
   {
-    if (isvar)
-    {
-      DBusMessageIter dbus_iter_sub;
-      dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_VARIANT, DBUS_TYPE_BOOLEAN_AS_STRING, &dbus_iter_sub);
-      dbus_message_iter_append_basic(&dbus_iter_sub, DBUS_TYPE_BOOLEAN, &t);
-      dbus_message_iter_close_container(dbus_iter, &dbus_iter_sub);
-    }
-    int32_t b = t ? 1 : 0;
-    dbus_message_iter_append_basic(dbus_iter, DBUS_TYPE_BOOLEAN, &b);
+    DBusMessageIter dbus_iter;
+    dbus_message_iter_init_append(dbus_message, &dbus_iter);
+    dbusWriteAll(&dbus_iter, args, std::index_sequence_for<In...>{});
   }
+  return dbus_message;
 }
 
-inline void DBusCon::passArg(DBusDictElement const &arg, DBusMessageIter *dbus_iter, bool isvar, bool isarray)
+template <typename... In, typename... Out>
+inline DBusWireMessage DBusCon::newWireMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                  std::string const &destination, std::string const &path,
+                                                  std::tuple<In...> const &args)
 {
-  if (g_verbose) std::cout << "Got arg : " << "DICTELEM" << std::endl;
-
-  DBusMessageIter dbus_iter_dict;
-  dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_DICT_ENTRY, NULL, &dbus_iter_dict);
-  passArg(arg.d_key, &dbus_iter_dict, false, false);
-  passArg(arg.d_value, &dbus_iter_dict, false, false);
-  dbus_message_iter_close_container(dbus_iter, &dbus_iter_dict);
+  DBusWireMessage message(DBusWireMessage::methodCall(destination, path, method.d_interface, method.d_member));
+  if constexpr (sizeof...(In) > 0)
+  {
+    message.d_signature = method.in_signature.c_str();
+    DBusWireWriter writer(&message.d_body);
+    dbusWriteAll(&writer, args, std::index_sequence_for<In...>{});
+  }
+  return message;
 }
 
-inline void DBusCon::passArg(DBusArg const &arg, DBusMessageIter *dbus_iter, bool isvar, bool isarray)
+template <typename... In, typename... Out>
+inline std::optional<std::tuple<Out...>> DBusCon::call(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                       std::string const &destination, std::string const &path,
+                                                       std::tuple<In...> const &args)
 {
-  if (std::holds_alternative<int64_t>(arg))
+  if (native())
   {
-    if (g_verbose) std::cout << "Got arg : " << std::get<int64_t>(arg) << std::endl;
-    addBasic(std::get<int64_t>(arg), dbus_iter, isvar, isarray);
+    DBusWireMessage message(newWireMethodCall(method, destination, path, args));
+    return sendAndBlock(&message).template as<Out...>();
   }
-  else if (std::holds_alternative<int32_t>(arg))
+
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(newMethodCall(method, destination, path, args), &::dbus_message_unref);
+  if (!dbus_message)
+    return std::nullopt;
+
+  return sendAndBlock(dbus_message.get()).template as<Out...>();
+}
+
+/*
+  Same as call(), but for calls that are repeated with identical arguments on many different
+  objects (eg. Properties.Get(Item, Label) for every item in a collection): the message is
+  marshalled once per (destination, interface, member, args) and cached, every next call
+  only copies the cached message and sets its path.
+*/
+template <typename... In, typename... Out>
+inline std::optional<std::tuple<Out...>> DBusCon::callCached(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                             std::string const &destination, std::string const &path,
+                                                             std::tuple<In...> const &args)
+{
+  if (native())
   {
-    if (g_verbose) std::cout << "Got arg : " << std::get<int32_t>(arg) << std::endl;
-    addBasic(std::get<int32_t>(arg), dbus_iter, isvar, isarray);
+    DBusWireMessage message(cachedWireMethodCall(method, destination, path, args));
+    return sendAndBlock(&message).template as<Out...>();
   }
-  else if (std::holds_alternative<std::string>(arg))
+
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(cachedMethodCall(method, destination, path, args), &::dbus_message_unref);
+  if (!dbus_message)
+    return std::nullopt;
+
+  return sendAndBlock(dbus_message.get()).template as<Out...>();
+}
+
+// callCached(), pipelined (see callAsync())
+template <typename... In, typename... Out>
+inline DBusPendingReply<Out...> DBusCon::callCachedAsync(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                         std::string const &destination, std::string const &path,
+                                                         std::tuple<In...> const &args)
+{
+  DBusPendingReply<Out...> pending;
+  if (native())
   {
-    if (g_verbose) std::cout << "Got arg : '" << std::get<std::string>(arg) << "'" << std::endl;
-    addBasic(std::get<std::string>(arg), dbus_iter, isvar, isarray);
+    DBusWireMessage message(cachedWireMethodCall(method, destination, path, args));
+    sendAsync(&message, &pending);
+    return pending;
   }
-  else if (std::holds_alternative<bool>(arg))
+
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(cachedMethodCall(method, destination, path, args), &::dbus_message_unref);
+  if (dbus_message)
+    sendAsync(dbus_message.get(), &pending);
+  return pending;
+}
+
+template <typename... In, typename... Out>
+inline std::string DBusCon::templateKey(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                        std::string const &destination, std::tuple<In...> const &args)
+{
+  std::string key(destination);
+  key += '\0';
+  key += method.d_interface;
+  key += '\0';
+  key += method.d_member;
+  key += '\0';
+  dbusAppendKey(&key, args);
+  return key;
+}
+
+template <typename... In, typename... Out>
+inline DBusMessage *DBusCon::cachedMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                              std::string const &destination, std::string const &path,
+                                              std::tuple<In...> const &args)
+{
+  std::string key(templateKey(method, destination, args));
+  auto it = d_templates.find(key);
+  if (it == d_templates.end())
   {
-    if (g_verbose) std::cout << "Got arg : " << std::boolalpha << std::get<bool>(arg) << std::noboolalpha << std::endl;
-    addBasic(std::get<bool>(arg), dbus_iter, isvar, isarray);
+    std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> tmpl(newMethodCall(method, destination, path, args), &::dbus_message_unref);
+    if (!tmpl)
+      return nullptr;
+    it = d_templates.emplace(std::move(key), std::move(tmpl)).first;
   }
-  else if (std::holds_alternative<DBusArray>(arg))
+
+  DBusMessage *dbus_message = dbus_message_copy(it->second.get());
+  if (!dbus_message || !dbus_message_set_path(dbus_message, path.c_str()))
   {
-    if (g_verbose) std::cout << "Got arg : " << "ARRAY" << std::endl;
+    std::cout << "ERROR: ::dbus_message_copy - Unable to allocate memory for the message!" << std::endl;
+    if (dbus_message)
+      dbus_message_unref(dbus_message);
+    return nullptr;
+  }
+  return dbus_message;
+}
 
-    DBusMessageIter dbus_array_iter;
+template <typename... In, typename... Out>
+inline DBusWireMessage DBusCon::cachedWireMethodCall(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                     std::string const &destination, std::string const &path,
+                                                     std::tuple<In...> const &args)
+{
+  std::string key(templateKey(method, destination, args));
+  auto it = d_wiretemplates.find(key);
+  if (it == d_wiretemplates.end())
+    it = d_wiretemplates.emplace(std::move(key), newWireMethodCall(method, destination, path, args)).first;
+
+  DBusWireMessage message(it->second);
+  message.d_path = path;
+  return message;
+}
 
-    char const *arraytype = DBUS_TYPE_INVALID;
-    DBusArray const *array = &std::get<DBusArray>(arg);
-    if (array->empty()) // something
-      ;
-    else
-    {
-      if (std::holds_alternative<int64_t>(array->at(0)))
-        arraytype = DBUS_TYPE_INT64_AS_STRING;
-      else if (std::holds_alternative<int32_t>(array->at(0)))
-        arraytype = DBUS_TYPE_INT32_AS_STRING;
-      else if (std::holds_alternative<std::string>(array->at(0)))
-        arraytype = DBUS_TYPE_STRING_AS_STRING;
-      else if (std::holds_alternative<bool>(array->at(0)))
-        arraytype = DBUS_TYPE_BOOLEAN_AS_STRING;
-      else if (std::holds_alternative<DBusArray>(array->at(0)))
-        arraytype = DBUS_TYPE_ARRAY_AS_STRING;
-      else if (std::holds_alternative<DBusObjectPath>(array->at(0)))
-        arraytype = DBUS_TYPE_OBJECT_PATH_AS_STRING;
-      else if (std::holds_alternative<recursive_wrapper<DBusVariant>>(array->at(0)))
-        arraytype = DBUS_TYPE_VARIANT_AS_STRING;
-      // to do?
-      //else if (std::holds_alternative<recursive_wrapper<DBusDict>>(array->at(0)))
-      //  arraytype = DBUS_TYPE_VARIANT_AS_STRING;
-    }
-    if (arraytype == DBUS_TYPE_INVALID)
-      return;
+inline void DBusCon::reportError(std::string const &stage)
+{
+  std::cout << "Error: " << std::endl << d_error.d_name << " : " << d_error.d_message << std::endl;
+  // (a call that failed for any other reason, eg. the peer disconnecting, is not reported as a deadline)
+  deadlineExpired(stage);
+  d_error.clear();
+}
 
-    dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_ARRAY, arraytype, &dbus_array_iter);
-    for (uint i = 0; i < array->size(); ++i)
-      passArg(array->at(i), &dbus_array_iter, isvar, isarray);
-    dbus_message_iter_close_container(dbus_iter, &dbus_array_iter);
+inline void DBusCon::sendAsync(DBusMessage *message, DBusPending *pending)
+{
+  pending->d_stage = std::string(dbus_message_get_interface(message)) + "." + dbus_message_get_member(message);
+  pending->d_timeoutms = deadlineTimeout(25000);
+  if (deadlineExpired(pending->d_stage))
+    return;
+
+  pending->d_sent = std::chrono::steady_clock::now();
+  if (g_transcript.recording() || g_transcript.replaying())
+    pending->d_key = DBusTranscript::key(message);
+  if (g_transcript.replaying())
+  {
+    pending->d_serial = 1; // (only marks it as sent)
+    return;
   }
-  else if (std::holds_alternative<DBusObjectPath>(arg))
+  if (!ensureTransport())
+    return;
+
+  DBusPendingCall *p = nullptr;
+  if (dbus_connection_send_with_reply(d_connection, message, &p, pending->d_timeoutms) && p)
+    pending->d_pending.reset(p);
+  dbus_connection_flush(d_connection);
+}
+
+inline void DBusCon::sendAsync(DBusWireMessage *message, DBusPending *pending)
+{
+  pending->d_stage = message->d_interface + "." + message->d_member;
+  pending->d_timeoutms = deadlineTimeout(25000);
+  if (deadlineExpired(pending->d_stage))
+    return;
+
+  pending->d_sent = std::chrono::steady_clock::now();
+  if (g_transcript.recording())
+    pending->d_key = DBusTranscript::key(*message);
+  d_wire->send(message, &pending->d_serial);
+}
+
+/*
+  Send a call without waiting for its reply: any number of calls can be sent this way before
+  waiting for the first reply, so their round trips overlap.
+*/
+template <typename... In, typename... Out>
+inline DBusPendingReply<Out...> DBusCon::callAsync(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                                                   std::string const &destination, std::string const &path,
+                                                   std::tuple<In...> const &args)
+{
+  DBusPendingReply<Out...> pending;
+  if (native())
   {
-    if (g_verbose) std::cout << "Got arg : (o)'" << std::get<DBusObjectPath>(arg).d_value << "'" << std::endl;
-    addBasic(std::get<DBusObjectPath>(arg), dbus_iter, isvar, isarray);
+    DBusWireMessage message(newWireMethodCall(method, destination, path, args));
+    sendAsync(&message, &pending);
+    return pending;
   }
-  else if (std::holds_alternative<recursive_wrapper<DBusVariant>>(arg))
+
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(newMethodCall(method, destination, path, args), &::dbus_message_unref);
+  if (dbus_message)
+    sendAsync(dbus_message.get(), &pending);
+  return pending;
+}
+
+template <typename... Out>
+inline DBusPendingReply<Out...> DBusCon::callAsync(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                                                   std::string const &destination, std::string const &path)
+{
+  return callAsync(method, destination, path, std::tuple<>{});
+}
+
+inline DBusReply DBusCon::waitReply(DBusPending *pending)
+{
+  if (!pending->ok())
+    return DBusReply();
+
+  DBusReply reply;
+  if (g_transcript.replaying())
   {
-    if (g_verbose) std::cout << "Got arg : " << "VARIANT" << std::endl;
-    passArg(std::get<recursive_wrapper<DBusVariant>>(arg)->d_value, dbus_iter, true, isarray);
+    reply = DBusReply(g_transcript.reply(pending->d_key, pending->d_sent, pending->d_timeoutms, &d_error));
+    pending->d_serial = 0;
   }
-  else if (std::holds_alternative<recursive_wrapper<DBusDict>>(arg))
+  else if (pending->d_serial) // (sent on the native connection)
   {
-    if (g_verbose) std::cout << "Got arg : " << "DICT" << std::endl;
-
-    DBusMessageIter dbus_array_iter;
-    std::string dictspec = DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING;
-    if (std::get<recursive_wrapper<DBusDict>>(arg)->empty())
-      ; // handle this somehow?
+    if (d_wire)
+      reply = DBusReply(d_wire->waitReply(pending->d_serial, pending->d_timeoutms, &d_error, pending->d_sent));
     else
+      d_error.set(DBUS_ERROR_DISCONNECTED, "Native connection was closed");
+    pending->d_serial = 0;
+  }
+  else
+  {
+    dbus_pending_call_block(pending->d_pending.get());
+    DBusMessage *message = dbus_pending_call_steal_reply(pending->d_pending.get());
+    pending->d_pending.reset();
+    DBusError error;
+    dbus_error_init(&error);
+    if (message && dbus_set_error_from_message(&error, message)) // (a timeout also results in an error reply)
     {
-      DBusDictElement elem = std::get<recursive_wrapper<DBusDict>>(arg)->at(0);
-      // key
-      if (std::holds_alternative<int64_t>(elem.d_key))
-        dictspec += DBUS_TYPE_INT64_AS_STRING;
-      else if (std::holds_alternative<int32_t>(elem.d_key))
-        dictspec += DBUS_TYPE_INT32_AS_STRING;
-      else if (std::holds_alternative<std::string>(elem.d_key))
-        dictspec += DBUS_TYPE_STRING_AS_STRING;
-      else if (std::holds_alternative<bool>(elem.d_key))
-        dictspec += DBUS_TYPE_BOOLEAN_AS_STRING;
-
-      // value
-      if (std::holds_alternative<int64_t>(elem.d_value))
-        dictspec += DBUS_TYPE_INT64_AS_STRING;
-      else if (std::holds_alternative<int32_t>(elem.d_value))
-        dictspec += DBUS_TYPE_INT32_AS_STRING;
-      else if (std::holds_alternative<std::string>(elem.d_value))
-        dictspec += DBUS_TYPE_STRING_AS_STRING;
-      else if (std::holds_alternative<bool>(elem.d_value))
-        dictspec += DBUS_TYPE_BOOLEAN_AS_STRING;
-      else if (std::holds_alternative<DBusObjectPath>(elem.d_value))
-        dictspec += DBUS_TYPE_OBJECT_PATH_AS_STRING;
-      else if (std::holds_alternative<recursive_wrapper<DBusVariant>>(elem.d_value)) // RECURSE! (?)
-        dictspec += DBUS_TYPE_VARIANT_AS_STRING;
-      else if (std::holds_alternative<DBusArray>(elem.d_value))                      // RECURSE! (?)
-        dictspec += DBUS_TYPE_ARRAY_AS_STRING;
+      dbus_message_unref(message);
+      message = nullptr;
     }
-
-    dictspec += DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
-
-    dbus_message_iter_open_container(dbus_iter, DBUS_TYPE_ARRAY, dictspec.c_str(), &dbus_array_iter);
-    for (uint i = 0; i < std::get<recursive_wrapper<DBusDict>>(arg)->size(); ++i)
-      passArg(std::get<recursive_wrapper<DBusDict>>(arg)->at(i), &dbus_array_iter, isvar, isarray);
-    dbus_message_iter_close_container(dbus_iter, &dbus_array_iter);
+    else if (!message)
+      dbus_set_error(&error, DBUS_ERROR_NO_REPLY, "No reply");
+    setError(&error);
+    reply = DBusReply(message);
   }
+  return finishCall(pending->d_stage, pending->d_key, pending->d_sent, std::move(reply));
 }
 
-inline void DBusCon::callMethod(std::string const &destination, std::string const &path, std::string const &interface, std::string const &method, std::vector<DBusArg> const &args)
+template <typename... Out>
+inline std::optional<std::tuple<Out...>> DBusCon::wait(DBusPendingReply<Out...> *pending)
 {
-  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(dbus_message_new_method_call(destination.c_str(), path.c_str(), interface.c_str(), method.c_str()), &::dbus_message_unref);
-  if (!dbus_message)
-  {
-    std::cout << "ERROR: ::dbus_message_new_method_call - Unable to allocate memory for the message!" << std::endl;
-    return;
-  }
+  return waitReply(pending).template as<Out...>();
+}
 
-  // set args
-  if (!args.empty())
+/*
+  Sends a method call without waiting for (or wanting) a reply. Used for the clean up calls
+  (Lock, Close) at the end of a backend, which are also sent when the deadline has already
+  passed, so the keyring is always left in the state we found it in.
+*/
+template <typename... In, typename... Out>
+inline bool DBusCon::send(DBusMethod<std::tuple<In...>, std::tuple<Out...>> const &method,
+                          std::string const &destination, std::string const &path,
+                          std::tuple<In...> const &args)
+{
+  if (g_transcript.replaying())
+    return true;
+  if (native())
   {
-    DBusMessageIter dbus_iter;
-    dbus_message_iter_init_append(dbus_message.get(), &dbus_iter);
-
-    for (auto const &a : args)
-      passArg(a, &dbus_iter);
+    DBusWireMessage message(newWireMethodCall(method, destination, path, args));
+    message.d_flags |= DBUS_HEADER_FLAG_NO_REPLY_EXPECTED;
+    return d_wire->send(&message);
   }
+  if (!ensureTransport())
+    return false;
 
-  // get reply
-  d_reply.reset(dbus_connection_send_with_reply_and_block(d_connection, dbus_message.get(), DBUS_TIMEOUT_USE_DEFAULT, &d_error));
-  if (!d_reply)
-  {
-    std::cout << "Error: " << std::endl << d_error.name << " : " << d_error.message << std::endl;
-    return;
-  }
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> dbus_message(newMethodCall(method, destination, path, args), &::dbus_message_unref);
+  if (!dbus_message)
+    return false;
+  dbus_message_set_no_reply(dbus_message.get(), true);
 
-  // show output
-  if (g_verbose)
-    showResponse(d_reply.get());
+  if (!dbus_connection_send(d_connection, dbus_message.get(), nullptr))
+    return false;
+  dbus_connection_flush(d_connection);
+  return true;
 }
 
+template <typename... Out>
+inline bool DBusCon::send(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                          std::string const &destination, std::string const &path)
+{
+  return send(method, destination, path, std::tuple<>{});
+}
 
-inline void DBusCon::callMethod(std::string const &destination, std::string const &path, std::string const &interface, std::string const &method)
+template <typename... Out>
+inline std::optional<std::tuple<Out...>> DBusCon::call(DBusMethod<std::tuple<>, std::tuple<Out...>> const &method,
+                                                       std::string const &destination, std::string const &path)
 {
-  return callMethod(destination, path, interface, method, {});
+  return call(method, destination, path, std::tuple<>{});
 }
 
-inline void DBusCon::showresponse2(DBusMessageIter *iter, int indent)
+inline void DBusCon::showresponse2(DBusMessageIter *iter, int indent, std::ostream &out, bool secret, bool dictentry)
 {
   // auto charsinnumber = [](int num)
   // {
@@ -467,351 +1414,175 @@ inline void DBusCon::showresponse2(DBusMessageIter *iter, int indent)
   int idx = 0;
   while ((current_type = dbus_message_iter_get_arg_type(iter)) != DBUS_TYPE_INVALID)
   {
+    // a dict entry's key is a name (eg. 'Chromium Safe Storage'), only its value may be secret
+    bool redact = secret && !(dictentry && idx == 0);
+
     char *cursig = dbus_message_iter_get_signature(iter);
-    std::cout << std::string(indent, ' ') << idx++ << ". Got reply (" << (char)current_type
-              << ") (sig: \"" << cursig << "\") : ";
+    out << std::string(indent, ' ') << idx++ << ". Got reply (" << (char)current_type
+        << ") (sig: \"" << cursig << "\") : ";
     dbus_free(cursig);
 
-    if (current_type == DBUS_TYPE_VARIANT || current_type == DBUS_TYPE_ARRAY || current_type == DBUS_TYPE_DICT_ENTRY || current_type == DBUS_TYPE_STRUCT)
+    if (redact && current_type == DBUS_TYPE_ARRAY && dbus_message_iter_get_element_type(iter) == DBUS_TYPE_BYTE)
+    {
+      DBusMessageIter iter_sub;
+      dbus_message_iter_recurse(iter, &iter_sub);
+      char const *bytes = nullptr;
+      int size = 0;
+      dbus_message_iter_get_fixed_array(&iter_sub, &bytes, &size);
+      out << "VALUE (ay): '" << g_log.secret(std::string(bytes, size)) << "'" << '\n';
+    }
+    else if (current_type == DBUS_TYPE_VARIANT || current_type == DBUS_TYPE_ARRAY || current_type == DBUS_TYPE_DICT_ENTRY || current_type == DBUS_TYPE_STRUCT)
     {
-      std::cout << " -> recursing... ";
-      if (current_type == DBUS_TYPE_ARRAY) std::cout << "(" << dbus_message_iter_get_element_count(iter) << ")";
-      std::cout << std::endl;
+      out << " -> recursing... ";
+      if (current_type == DBUS_TYPE_ARRAY) out << "(" << dbus_message_iter_get_element_count(iter) << ")";
+      out << '\n';
 
       DBusMessageIter iter_sub;
       dbus_message_iter_recurse(iter, &iter_sub);
-      showresponse2(&iter_sub, indent + 4);
+      showresponse2(&iter_sub, indent + 4, out, secret, current_type == DBUS_TYPE_DICT_ENTRY);
     }
     else if (current_type == DBUS_TYPE_OBJECT_PATH)
     {
       char *path;
       dbus_message_iter_get_basic(iter, &path);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (o): '" << path << "'" << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (o): '" << path << "'" << '\n';
     }
     else if (current_type == DBUS_TYPE_STRING)
     {
       char *str;
       dbus_message_iter_get_basic(iter, &str);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (s): '" << str << "'" << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (s): '" << (redact ? g_log.secret(str) : str) << "'" << '\n';
     }
     else if (current_type == DBUS_TYPE_INT32)
     {
       int32_t i = 0;
       dbus_message_iter_get_basic(iter, &i);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (i32): " << i << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (i32): " << i << '\n';
     }
     else if (current_type == DBUS_TYPE_INT64)
     {
       int64_t i = 0;
       dbus_message_iter_get_basic(iter, &i);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (i64): " << i << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (i64): " << i << '\n';
     }
     else if (current_type == DBUS_TYPE_BOOLEAN)
     {
       bool i = 0;
       dbus_message_iter_get_basic(iter, &i);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (b): " << std::boolalpha << i << std::noboolalpha << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (b): " << std::boolalpha << i << std::noboolalpha << '\n';
     }
     else if (current_type == DBUS_TYPE_BYTE)
     {
       unsigned char b = '\0';
       dbus_message_iter_get_basic(iter, &b);
-      std::cout << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (byte): " << b
-                << " " << std::hex << std::setfill('0') << std::setw(2) << (static_cast<int32_t>(b) & 0xFF) << std::dec << std::endl;
+      out << /*std::string(indent + charsinnumber(idx) + 2, ' ') << */"VALUE (byte): " << b
+          << " " << std::hex << std::setfill('0') << std::setw(2) << (static_cast<int32_t>(b) & 0xFF) << std::dec << '\n';
     }
     else
     {
-      std::cout << "[?]" << std::endl;
+      out << "[?]" << '\n';
     }
 
     dbus_message_iter_next(iter);
   }
 }
 
-inline void DBusCon::showResponse(DBusMessage *reply)
+// 'secret': the reply may carry a secret (see DBusTranscript::isSecretReply()), its strings and
+// bytes (other than dict keys) are only shown with --log-secrets
+inline void DBusCon::showResponse(DBusMessage *reply, bool secret)
 {
-  std::cout << " -> Reply signature: " << dbus_message_get_signature(reply) << std::endl;
+  LogMessage message;
+  message.stream() << " -> Reply signature: " << dbus_message_get_signature(reply) << '\n';
 
   DBusMessageIter dbus_iter_reply;
   dbus_message_iter_init(reply, &dbus_iter_reply);
-  showresponse2(&dbus_iter_reply, 4);
+  showresponse2(&dbus_iter_reply, 4, message.stream(), secret);
 }
 
-template <typename T>
-inline bool DBusCon::setBasicTypeReturn(T *target, int current_type, DBusMessageIter *iter)
-{
-  if constexpr (std::is_same_v<T, bool>)
-  {
-    if (current_type == DBUS_TYPE_BOOLEAN)
-    {
-      int32_t b = 0;
-      dbus_message_iter_get_basic(iter, &b);
-      *target = b;
-      return true;
-    }
-  }
-  else if constexpr (std::is_same_v<T, std::string>)
-  {
-    if ((current_type == DBUS_TYPE_STRING || current_type == DBUS_TYPE_OBJECT_PATH) && std::is_same_v<T, std::string>)
-    {
-      char *str;
-      dbus_message_iter_get_basic(iter, &str);
-      *target = str;
-      return true;
-    }
-  }
-  else if constexpr (std::is_same_v<T, int32_t> || std::is_same_v<T, int64_t>)
-  {
-    if (current_type == DBUS_TYPE_INT32 ||
-        current_type == DBUS_TYPE_INT64)
-    {
-      dbus_message_iter_get_basic(iter, target);
-      return true;
-    }
-  }
-  return false;
-}
+inline DBusReply::DBusReply(DBusMessage *message)
+  :
+  d_message(message, &::dbus_message_unref)
+{}
 
+inline DBusReply::DBusReply(std::unique_ptr<DBusWireMessage> message)
+  :
+  d_message(nullptr, &::dbus_message_unref),
+  d_wiremessage(std::move(message))
+{}
 
-template <typename T>
-inline void DBusCon::set(T *ret, DBusMessageIter *iter, int current_type)
+inline bool DBusReply::ok() const
 {
-  if constexpr (std::is_same_v<T, std::vector<std::string>>)
-  {
-    if (current_type == DBUS_TYPE_ARRAY)
-    {
-      DBusMessageIter iter_sub;
-      dbus_message_iter_recurse(iter, &iter_sub);
-      int current_type;
-      while ((current_type = dbus_message_iter_get_arg_type(&iter_sub)) != DBUS_TYPE_INVALID)
-      {
-        if (current_type == DBUS_TYPE_STRING || current_type == DBUS_TYPE_OBJECT_PATH)
-        {
-          char *val;
-          dbus_message_iter_get_basic(&iter_sub, &val);
-          ret->push_back(val);
-        }
-        else
-        {
-          ret->clear();
-          return;
-        }
-        dbus_message_iter_next(&iter_sub);
-      }
-    }
-  }
-
-  if constexpr (std::is_same_v<T, std::vector<unsigned char>>)
-  {
-    if (current_type == DBUS_TYPE_ARRAY)
-    {
-      DBusMessageIter iter_sub;
-      dbus_message_iter_recurse(iter, &iter_sub);
-      int current_type;
-      while ((current_type = dbus_message_iter_get_arg_type(&iter_sub)) != DBUS_TYPE_INVALID)
-      {
-        if (current_type == DBUS_TYPE_BYTE)
-        {
-          unsigned char val;
-          dbus_message_iter_get_basic(&iter_sub, &val);
-          ret->push_back(val);
-        }
-        else
-        {
-          ret->clear();
-          return;
-        }
-        dbus_message_iter_next(&iter_sub);
-      }
-    }
-  }
-
-  if constexpr (is_std_map<T>::value)
-  {
-    if (current_type == DBUS_TYPE_ARRAY)
-    {
-      DBusMessageIter iter_sub;
-      dbus_message_iter_recurse(iter, &iter_sub);
-      int current_type;
-
-      while ((current_type = dbus_message_iter_get_arg_type(&iter_sub)) != DBUS_TYPE_INVALID) // iterate the array
-      {
-        if (current_type != DBUS_TYPE_DICT_ENTRY)
-        {
-          ret->clear();
-          return;
-        }
-        DBusMessageIter iter_sub2;
-        dbus_message_iter_recurse(&iter_sub, &iter_sub2);
-
-        typename T::key_type newkey;
-        typename T::mapped_type newvalue;
-
-        if ((current_type = dbus_message_iter_get_arg_type(&iter_sub2)) == DBUS_TYPE_INVALID)
-        {
-          ret->clear();
-          return;
-        }
-
-        //std::cout << (char) current_type << std::endl;
-
-        // set key (must be basic type as per spec
-        if (!setBasicTypeReturn(&newkey, current_type, &iter_sub2))
-        {
-          ret->clear();
-          return;
-        }
-
-        // next, get the mapped value. each DICT_ENTRY _must_ contain exactly 2 elements, as per spec
-        dbus_message_iter_next(&iter_sub2);
-        if ((current_type = dbus_message_iter_get_arg_type(&iter_sub2)) == DBUS_TYPE_INVALID)
-        {
-          ret->clear();
-          return;
-        }
-
-        //std::cout << (char) current_type << std::endl;
-
-        if (setBasicTypeReturn(&newvalue, current_type, &iter_sub2))
-          ;
-        else if (current_type == DBUS_TYPE_VARIANT) // recurse for this one
-        {
-          DBusMessageIter iter_sub3;
-          dbus_message_iter_recurse(&iter_sub2, &iter_sub3);
-
-          if ((current_type = dbus_message_iter_get_arg_type(&iter_sub3)) == DBUS_TYPE_INVALID)
-          {
-            ret->clear();
-            return;
-          }
-
-          // std::cout << (char) current_type << std::endl;
-
-          if (setBasicTypeReturn(&newvalue, current_type, &iter_sub3))
-            ;
-          else //(current_type == ...)
-          { // only basic types inside variant for now...
-            ret->clear();
-            return;
-          }
-        }
-        else // ALL OTHER TYPES NOT YET SUPPORTED FOR MAPPED VALUE
-        {
-          ret->clear();
-          return;
-        }
-
-        // add pair...
-        ret->insert({newkey, newvalue});
-
-        dbus_message_iter_next(&iter_sub);
-      }
-    }
-    return;
-  }
-
-  setBasicTypeReturn(ret, current_type, iter);
-
-  /*
-  if constexpr (std::is_same_v<T, std::string>)
-  {
-    if (current_type == DBUS_TYPE_STRING || current_type == DBUS_TYPE_OBJECT_PATH)
-    {
-      char *val;
-      dbus_message_iter_get_basic(iter, &val);
-      *ret = val;
-    }
-  }
+  return d_message || d_wiremessage;
+}
 
-  if constexpr (std::is_same_v<T, int32_t> || std::is_same_v<T, int64_t>)
-  {
-    if (current_type == DBUS_TYPE_INT32)
-      dbus_message_iter_get_basic(iter, ret);
-    else if (current_type == DBUS_TYPE_INT64)
-      dbus_message_iter_get_basic(iter, ret);
-  }
+inline int DBusReply::type() const
+{
+  if (d_wiremessage)
+    return d_wiremessage->d_type;
+  return d_message ? dbus_message_get_type(d_message.get()) : DBUS_MESSAGE_TYPE_INVALID;
+}
 
-  if constexpr (std::is_same_v<T, bool>)
-  {
-    if (current_type == DBUS_TYPE_BOOLEAN)
-      dbus_message_iter_get_basic(iter, ret);
-  }
-  */
+inline std::string DBusReply::interface() const
+{
+  if (d_wiremessage)
+    return d_wiremessage->d_interface;
+  char const *interface = d_message ? dbus_message_get_interface(d_message.get()) : nullptr;
+  return interface ? interface : "";
 }
 
-template <typename T>
-inline T DBusCon::get2(DBusMessageIter *iter, std::vector<int> const &idx, T def)
+inline std::string DBusReply::member() const
 {
-  T ret(def);
+  if (d_wiremessage)
+    return d_wiremessage->d_member;
+  char const *member = d_message ? dbus_message_get_member(d_message.get()) : nullptr;
+  return member ? member : "";
+}
 
-  int i = 0;
-  int current_type = dbus_message_iter_get_arg_type(iter);
-  while (i < idx.front())
-  {
-    //std::cout << "YO " << i << " TYPE: " << (char)current_type << std::endl;
+inline std::string DBusReply::path() const
+{
+  if (d_wiremessage)
+    return d_wiremessage->d_path;
+  char const *path = d_message ? dbus_message_get_path(d_message.get()) : nullptr;
+  return path ? path : "";
+}
 
-    dbus_message_iter_next(iter);
-    current_type = dbus_message_iter_get_arg_type(iter);
-    if (current_type == DBUS_TYPE_INVALID)
-      return ret;
+inline DBusMessage *DBusReply::dbusMessage() const
+{
+  if (!d_message && d_wiremessage)
+    d_message.reset(d_wiremessage->toDBusMessage());
+  return d_message.get();
+}
 
-    ++i;
-  }
+template <typename... Out>
+inline std::optional<std::tuple<Out...>> DBusReply::as() const
+{
+  if (!ok())
+    return std::nullopt;
 
-  if (current_type == DBUS_TYPE_STRUCT)
+  std::tuple<Out...> ret;
+  if (d_wiremessage)
   {
-    DBusMessageIter iter_sub;
-    dbus_message_iter_recurse(iter, &iter_sub);
-    if (idx.size() < 2)
+    DBusWireReader reader(d_wiremessage->body());
+    if (d_wiremessage->d_signature == dbusSignatureOf<Out...>().c_str())
     {
-      std::cout << "Missing next index" << std::endl;
-      return def;
+      if (dbusReadAll(&reader, &ret, std::index_sequence_for<Out...>{}) && reader.atEnd())
+        return ret;
+      std::cout << "Invalid reply (signature '" << d_wiremessage->d_signature << "')" << std::endl;
+      return std::nullopt;
     }
-    std::vector idx2 = idx;
-    idx2.erase(idx2.begin());
-    return get2<T>(&iter_sub, idx2, def);
-  }
-
-  if (current_type == DBUS_TYPE_VARIANT)
-  {
-    DBusMessageIter iter_sub;
-    dbus_message_iter_recurse(iter, &iter_sub);
-    current_type = dbus_message_iter_get_arg_type(&iter_sub);
-
-    set<T>(&ret, &iter_sub, current_type);
-
-    return ret;
   }
-
-  set<T>(&ret, iter, current_type);
-  return ret;
-}
-
-template <typename T>
-inline T DBusCon::get(std::string const &sig, std::vector<int> const &idx, T def)
-{
-  T ret(def);
-
-  if (!d_reply || dbus_message_get_signature(d_reply.get()) != sig)
+  else
   {
-    if (/*verbose && */d_reply)
-      std::cout << "Unexpected reply signature "
-                << "(got '" << dbus_message_get_signature(d_reply.get())
-                << "', expected '" << sig << "')" << std::endl;
-    return ret;
+    DBusMessageIter iter;
+    dbus_message_iter_init(d_message.get(), &iter);
+    if (dbusReadAll(&iter, &ret, std::index_sequence_for<Out...>{}))
+      return ret;
   }
 
-  // get iterator
-  DBusMessageIter iter;
-  dbus_message_iter_init(d_reply.get(), &iter);
-
-  return get2<T>(&iter, idx, def);
-}
-
-template <typename T>
-inline T DBusCon::get(std::string const &sig, int idx, T def)
-{
-  return get<T>(sig, std::vector<int>{idx}, def);
+  std::cout << "Unexpected reply signature "
+            << "(got '" << (d_wiremessage ? d_wiremessage->d_signature.c_str() : dbus_message_get_signature(d_message.get()))
+            << "', expected '" << dbusSignatureOf<Out...>().c_str() << "')" << std::endl;
+  return std::nullopt;
 }
 
 #endif
@@ -0,0 +1,666 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DBUSMARSHAL_H_
+#define DBUSMARSHAL_H_
+
+#include <dbus/dbus.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+  The D-Bus wire format, for the native transport (see DBusWire). A message is a fixed header
+  (byte order, type, flags, version, body length, serial), an array of header fields (path,
+  interface, member, ...) and the body, every value aligned to its natural boundary.
+
+  Bodies are written and read by DBusType (see dbuscon.h) through DBusWireWriter and
+  DBusWireReader. Messages are written little-endian, received ones may have either byte
+  order. Any valid message can be received: unknown header fields, and values DBusType does
+  not read (eg. the contents of a variant of an unexpected type), are skipped.
+
+  Only the dbus headers' constants are used here, libdbus itself is only needed for
+  toDBusMessage() (--record and trace output).
+*/
+
+// alignment of a value of the type whose signature starts with 'type'
+constexpr int dbusAlignment(char type)
+{
+  switch (type)
+  {
+    case DBUS_TYPE_BYTE:
+    case DBUS_TYPE_SIGNATURE:
+    case DBUS_TYPE_VARIANT:
+      return 1;
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+      return 2;
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+    case DBUS_STRUCT_BEGIN_CHAR:
+    case DBUS_DICT_ENTRY_BEGIN_CHAR:
+      return 8;
+    default: // b, i, u, h, s, o, a
+      return 4;
+  }
+}
+
+// an error reply (or a failure of the transport itself)
+struct DBusCallError
+{
+  std::string d_name;
+  std::string d_message;
+
+  inline void set(std::string const &name, std::string const &message);
+  inline bool isSet() const;
+  inline void clear();
+};
+
+class DBusWireWriter
+{
+  std::string *d_out;
+  bool d_bigendian;
+
+ public:
+  inline explicit DBusWireWriter(std::string *out, bool bigendian = false);
+  inline void align(int alignment);
+  inline void putByte(unsigned char value);
+  inline void putUint32(uint32_t value);
+  inline void putUint64(uint64_t value);
+  inline void putString(std::string const &value); // (also object paths)
+  inline void putSignature(char const *value);
+  inline void putBytes(unsigned char const *data, std::size_t size);
+
+  // an array is written as its length (filled in by endArray()), padding, and its elements
+  inline std::size_t beginArray(int elementalignment);
+  inline void endArray(std::size_t lengthpos, int elementalignment);
+
+  // overwrites the 4 bytes at 'pos'
+  inline void putUint32At(std::size_t pos, uint32_t value);
+};
+
+class DBusWireReader
+{
+  char const *d_data;
+  std::size_t d_size;
+  std::size_t d_pos;
+  bool d_bigendian;
+
+ public:
+  inline DBusWireReader(char const *data, std::size_t size, bool bigendian);
+  inline std::size_t pos() const;
+  inline bool atEnd() const;
+  inline bool align(int alignment);
+  inline bool getByte(unsigned char *value);
+  inline bool getUint32(uint32_t *value);
+  inline bool getUint64(uint64_t *value);
+  inline bool getBool(bool *value);
+  inline bool getString(std::string *value);
+  inline bool getSignature(std::string *value);
+  inline bool getBytes(std::size_t size, unsigned char const **data);
+
+  // reads an array's length and padding, 'end' is the position just after its last element
+  inline bool beginArray(int elementalignment, std::size_t *end);
+
+  // skips one complete value of the type at the start of 'signature', and moves 'signature'
+  // past that type
+  inline bool skip(char const **signature, int depth = 0);
+
+  inline static uint32_t uint32At(char const *data, bool bigendian);
+
+ private:
+  inline bool need(std::size_t size) const;
+};
+
+// moves 'signature' past its first complete type, false if it does not start with one
+inline bool dbusSkipSignature(char const **signature, int depth = 0);
+
+struct DBusWireMessage
+{
+  int d_type;
+  unsigned char d_flags;
+  uint32_t d_serial;
+  uint32_t d_replyserial;
+  std::string d_path;
+  std::string d_interface;
+  std::string d_member;
+  std::string d_errorname;
+  std::string d_destination;
+  std::string d_sender;
+  std::string d_signature;
+  std::string d_body;
+  bool d_bigendian; // (only received messages can be big-endian)
+
+  inline DBusWireMessage();
+  inline static DBusWireMessage methodCall(std::string const &destination, std::string const &path,
+                                           std::string const &interface, std::string const &member);
+
+  inline void marshal(std::string *out) const;
+  inline DBusWireReader body() const;
+
+  // size of the message at the start of 'data': 0 if there is not enough data yet to tell,
+  // -1 if it does not start with a valid message header
+  inline static long messageSize(char const *data, std::size_t size);
+  // 'size' is the message's full size (see messageSize())
+  inline static bool demarshal(char const *data, std::size_t size, DBusWireMessage *message, std::string *error);
+
+  // the same message as a libdbus one (for the transcript and trace output, see DBusReply)
+  inline DBusMessage *toDBusMessage() const;
+};
+
+inline void DBusCallError::set(std::string const &name, std::string const &message)
+{
+  d_name = name;
+  d_message = message;
+}
+
+inline bool DBusCallError::isSet() const
+{
+  return !d_name.empty();
+}
+
+inline void DBusCallError::clear()
+{
+  d_name.clear();
+  d_message.clear();
+}
+
+inline DBusWireWriter::DBusWireWriter(std::string *out, bool bigendian)
+  :
+  d_out(out),
+  d_bigendian(bigendian)
+{}
+
+inline void DBusWireWriter::align(int alignment)
+{
+  d_out->resize((d_out->size() + alignment - 1) & ~static_cast<std::size_t>(alignment - 1), '\0');
+}
+
+inline void DBusWireWriter::putByte(unsigned char value)
+{
+  *d_out += static_cast<char>(value);
+}
+
+inline void DBusWireWriter::putUint32(uint32_t value)
+{
+  align(4);
+  d_out->resize(d_out->size() + 4);
+  putUint32At(d_out->size() - 4, value);
+}
+
+inline void DBusWireWriter::putUint64(uint64_t value)
+{
+  align(8);
+  for (int i = 0; i < 8; ++i)
+    putByte(static_cast<unsigned char>(value >> (d_bigendian ? 56 - 8 * i : 8 * i)));
+}
+
+inline void DBusWireWriter::putUint32At(std::size_t pos, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+    (*d_out)[pos + i] = static_cast<char>(value >> (d_bigendian ? 24 - 8 * i : 8 * i));
+}
+
+inline void DBusWireWriter::putString(std::string const &value)
+{
+  putUint32(value.size());
+  d_out->append(value.c_str(), value.size() + 1);
+}
+
+inline void DBusWireWriter::putSignature(char const *value)
+{
+  std::size_t size = std::strlen(value);
+  putByte(size);
+  d_out->append(value, size + 1);
+}
+
+inline void DBusWireWriter::putBytes(unsigned char const *data, std::size_t size)
+{
+  d_out->append(reinterpret_cast<char const *>(data), size);
+}
+
+inline std::size_t DBusWireWriter::beginArray(int elementalignment)
+{
+  putUint32(0);
+  std::size_t lengthpos = d_out->size() - 4;
+  align(elementalignment); // (even when the array is empty)
+  return lengthpos;
+}
+
+inline void DBusWireWriter::endArray(std::size_t lengthpos, int elementalignment)
+{
+  // the length does not include the padding before the first element
+  std::size_t start = (lengthpos + 4 + elementalignment - 1) & ~static_cast<std::size_t>(elementalignment - 1);
+  putUint32At(lengthpos, d_out->size() - start);
+}
+
+inline DBusWireReader::DBusWireReader(char const *data, std::size_t size, bool bigendian)
+  :
+  d_data(data),
+  d_size(size),
+  d_pos(0),
+  d_bigendian(bigendian)
+{}
+
+inline std::size_t DBusWireReader::pos() const
+{
+  return d_pos;
+}
+
+inline bool DBusWireReader::atEnd() const
+{
+  return d_pos == d_size;
+}
+
+inline bool DBusWireReader::need(std::size_t size) const
+{
+  return size <= d_size - d_pos;
+}
+
+inline bool DBusWireReader::align(int alignment)
+{
+  std::size_t aligned = (d_pos + alignment - 1) & ~static_cast<std::size_t>(alignment - 1);
+  if (aligned > d_size)
+    return false;
+  for (; d_pos < aligned; ++d_pos) // (padding must be zero)
+    if (d_data[d_pos] != '\0')
+      return false;
+  return true;
+}
+
+inline uint32_t DBusWireReader::uint32At(char const *data, bool bigendian)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) << (bigendian ? 24 - 8 * i : 8 * i);
+  return value;
+}
+
+inline bool DBusWireReader::getByte(unsigned char *value)
+{
+  if (!need(1))
+    return false;
+  *value = static_cast<unsigned char>(d_data[d_pos++]);
+  return true;
+}
+
+inline bool DBusWireReader::getUint32(uint32_t *value)
+{
+  if (!align(4) || !need(4))
+    return false;
+  *value = uint32At(d_data + d_pos, d_bigendian);
+  d_pos += 4;
+  return true;
+}
+
+inline bool DBusWireReader::getUint64(uint64_t *value)
+{
+  if (!align(8) || !need(8))
+    return false;
+  *value = 0;
+  for (int i = 0; i < 8; ++i)
+    *value |= static_cast<uint64_t>(static_cast<unsigned char>(d_data[d_pos + i])) << (d_bigendian ? 56 - 8 * i : 8 * i);
+  d_pos += 8;
+  return true;
+}
+
+inline bool DBusWireReader::getBool(bool *value)
+{
+  uint32_t b = 0;
+  if (!getUint32(&b) || b > 1)
+    return false;
+  *value = b;
+  return true;
+}
+
+inline bool DBusWireReader::getString(std::string *value)
+{
+  uint32_t size = 0;
+  if (!getUint32(&size) || !need(static_cast<std::size_t>(size) + 1) ||
+      d_data[d_pos + size] != '\0' || std::memchr(d_data + d_pos, '\0', size))
+    return false;
+  value->assign(d_data + d_pos, size);
+  d_pos += size + 1;
+  return true;
+}
+
+inline bool DBusWireReader::getSignature(std::string *value)
+{
+  unsigned char size = 0;
+  if (!getByte(&size) || !need(static_cast<std::size_t>(size) + 1) ||
+      d_data[d_pos + size] != '\0' || std::memchr(d_data + d_pos, '\0', size))
+    return false;
+  value->assign(d_data + d_pos, size);
+  d_pos += size + 1;
+  return true;
+}
+
+inline bool DBusWireReader::getBytes(std::size_t size, unsigned char const **data)
+{
+  if (!need(size))
+    return false;
+  *data = reinterpret_cast<unsigned char const *>(d_data + d_pos);
+  d_pos += size;
+  return true;
+}
+
+inline bool DBusWireReader::beginArray(int elementalignment, std::size_t *end)
+{
+  uint32_t size = 0;
+  if (!getUint32(&size) || size > DBUS_MAXIMUM_ARRAY_LENGTH || !align(elementalignment) || !need(size))
+    return false;
+  *end = d_pos + size;
+  return true;
+}
+
+inline bool DBusWireReader::skip(char const **signature, int depth)
+{
+  if (depth > DBUS_MAXIMUM_TYPE_RECURSION_DEPTH)
+    return false;
+
+  std::string str;
+  uint32_t u32 = 0;
+  uint64_t u64 = 0;
+  unsigned char byte = 0;
+  bool b = false;
+  switch (*(*signature)++)
+  {
+    case DBUS_TYPE_BYTE:
+      return getByte(&byte);
+    case DBUS_TYPE_BOOLEAN:
+      return getBool(&b);
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+      if (!align(2) || !need(2))
+        return false;
+      d_pos += 2;
+      return true;
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+    case DBUS_TYPE_UNIX_FD:
+      return getUint32(&u32);
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+      return getUint64(&u64);
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+      return getString(&str);
+    case DBUS_TYPE_SIGNATURE:
+      return getSignature(&str);
+    case DBUS_TYPE_VARIANT:
+    {
+      // the variant's own signature must be exactly one complete type
+      if (!getSignature(&str))
+        return false;
+      char const *contained = str.c_str();
+      return skip(&contained, depth + 1) && *contained == '\0';
+    }
+    case DBUS_TYPE_ARRAY:
+    {
+      std::size_t end = 0;
+      if (!beginArray(dbusAlignment(**signature), &end) || !dbusSkipSignature(signature, depth + 1))
+        return false;
+      d_pos = end;
+      return true;
+    }
+    case DBUS_STRUCT_BEGIN_CHAR:
+    case DBUS_DICT_ENTRY_BEGIN_CHAR:
+    {
+      char close = (*signature)[-1] == DBUS_STRUCT_BEGIN_CHAR ? DBUS_STRUCT_END_CHAR : DBUS_DICT_ENTRY_END_CHAR;
+      if (!align(8))
+        return false;
+      while (**signature != close)
+        if (**signature == '\0' || !skip(signature, depth + 1))
+          return false;
+      ++*signature;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+inline bool dbusSkipSignature(char const **signature, int depth)
+{
+  if (depth > DBUS_MAXIMUM_TYPE_RECURSION_DEPTH)
+    return false;
+  switch (*(*signature)++)
+  {
+    case '\0':
+      return false;
+    case DBUS_TYPE_ARRAY:
+      return dbusSkipSignature(signature, depth + 1);
+    case DBUS_STRUCT_BEGIN_CHAR:
+    case DBUS_DICT_ENTRY_BEGIN_CHAR:
+    {
+      char close = (*signature)[-1] == DBUS_STRUCT_BEGIN_CHAR ? DBUS_STRUCT_END_CHAR : DBUS_DICT_ENTRY_END_CHAR;
+      while (**signature != close)
+        if (!dbusSkipSignature(signature, depth + 1))
+          return false;
+      ++*signature;
+      return true;
+    }
+    default:
+      return true;
+  }
+}
+
+inline DBusWireMessage::DBusWireMessage()
+  :
+  d_type(DBUS_MESSAGE_TYPE_INVALID),
+  d_flags(0),
+  d_serial(0),
+  d_replyserial(0),
+  d_bigendian(false)
+{}
+
+inline DBusWireMessage DBusWireMessage::methodCall(std::string const &destination, std::string const &path,
+                                                   std::string const &interface, std::string const &member)
+{
+  DBusWireMessage message;
+  message.d_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+  message.d_destination = destination;
+  message.d_path = path;
+  message.d_interface = interface;
+  message.d_member = member;
+  return message;
+}
+
+inline DBusWireReader DBusWireMessage::body() const
+{
+  return DBusWireReader(d_body.data(), d_body.size(), d_bigendian);
+}
+
+inline void DBusWireMessage::marshal(std::string *out) const
+{
+  out->clear();
+  DBusWireWriter writer(out, d_bigendian);
+  writer.putByte(d_bigendian ? DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+  writer.putByte(d_type);
+  writer.putByte(d_flags);
+  writer.putByte(DBUS_MAJOR_PROTOCOL_VERSION);
+  writer.putUint32(d_body.size());
+  writer.putUint32(d_serial);
+
+  // the header fields are an array of (code, variant) structs, the empty ones are left out. They
+  // are in the order libdbus writes them, so a call marshals to the same bytes either way (see
+  // DBusTranscript::key())
+  std::size_t fields = writer.beginArray(8);
+  auto field = [&writer](int code, char const *signature, std::string const &value)
+  {
+    if (value.empty())
+      return;
+    writer.align(8);
+    writer.putByte(code);
+    writer.putSignature(signature);
+    if (signature[0] == DBUS_TYPE_SIGNATURE)
+      writer.putSignature(value.c_str());
+    else
+      writer.putString(value);
+  };
+  field(DBUS_HEADER_FIELD_PATH, DBUS_TYPE_OBJECT_PATH_AS_STRING, d_path);
+  field(DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING_AS_STRING, d_destination);
+  field(DBUS_HEADER_FIELD_INTERFACE, DBUS_TYPE_STRING_AS_STRING, d_interface);
+  field(DBUS_HEADER_FIELD_MEMBER, DBUS_TYPE_STRING_AS_STRING, d_member);
+  field(DBUS_HEADER_FIELD_ERROR_NAME, DBUS_TYPE_STRING_AS_STRING, d_errorname);
+  if (d_replyserial)
+  {
+    writer.align(8);
+    writer.putByte(DBUS_HEADER_FIELD_REPLY_SERIAL);
+    writer.putSignature(DBUS_TYPE_UINT32_AS_STRING);
+    writer.putUint32(d_replyserial);
+  }
+  field(DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING_AS_STRING, d_sender);
+  field(DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE_AS_STRING, d_signature);
+  writer.endArray(fields, 8);
+
+  writer.align(8); // (the body starts on an 8 byte boundary)
+  out->append(d_body);
+}
+
+inline long DBusWireMessage::messageSize(char const *data, std::size_t size)
+{
+  // byte order, type, flags, version, body length, serial and the header field array's length
+  if (size < 16)
+    return 0;
+  if ((data[0] != DBUS_LITTLE_ENDIAN && data[0] != DBUS_BIG_ENDIAN) || data[3] != DBUS_MAJOR_PROTOCOL_VERSION)
+    return -1;
+  bool bigendian = data[0] == DBUS_BIG_ENDIAN;
+  uint64_t bodysize = DBusWireReader::uint32At(data + 4, bigendian);
+  uint64_t fieldssize = DBusWireReader::uint32At(data + 12, bigendian);
+  if (fieldssize > DBUS_MAXIMUM_ARRAY_LENGTH)
+    return -1;
+  uint64_t total = ((16 + fieldssize + 7) & ~static_cast<uint64_t>(7)) + bodysize;
+  if (total > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    return -1;
+  return static_cast<long>(total);
+}
+
+inline bool DBusWireMessage::demarshal(char const *data, std::size_t size, DBusWireMessage *message, std::string *error)
+{
+  auto invalid = [error](char const *what)
+  {
+    *error = what;
+    return false;
+  };
+
+  if (messageSize(data, size) != static_cast<long>(size))
+    return invalid("Invalid message size");
+
+  *message = DBusWireMessage();
+  message->d_bigendian = data[0] == DBUS_BIG_ENDIAN;
+  DBusWireReader reader(data, size, message->d_bigendian);
+  unsigned char byteorder = 0;
+  unsigned char type = 0;
+  unsigned char version = 0;
+  uint32_t bodysize = 0;
+  if (!reader.getByte(&byteorder) || !reader.getByte(&type) || !reader.getByte(&message->d_flags) ||
+      !reader.getByte(&version) || !reader.getUint32(&bodysize) || !reader.getUint32(&message->d_serial))
+    return invalid("Truncated header");
+  message->d_type = type;
+  if (type == DBUS_MESSAGE_TYPE_INVALID || type > DBUS_MESSAGE_TYPE_SIGNAL || message->d_serial == 0)
+    return invalid("Invalid message type or serial");
+
+  std::size_t fieldsend = 0;
+  if (!reader.beginArray(8, &fieldsend))
+    return invalid("Invalid header fields");
+  while (reader.pos() < fieldsend)
+  {
+    unsigned char code = 0;
+    std::string signature;
+    if (!reader.align(8) || !reader.getByte(&code) || !reader.getSignature(&signature))
+      return invalid("Invalid header field");
+
+    // the fields we use have fixed types, any other field is skipped
+    std::string *str = nullptr;
+    char const *expected = DBUS_TYPE_STRING_AS_STRING;
+    switch (code)
+    {
+      case DBUS_HEADER_FIELD_PATH: str = &message->d_path; expected = DBUS_TYPE_OBJECT_PATH_AS_STRING; break;
+      case DBUS_HEADER_FIELD_INTERFACE: str = &message->d_interface; break;
+      case DBUS_HEADER_FIELD_MEMBER: str = &message->d_member; break;
+      case DBUS_HEADER_FIELD_ERROR_NAME: str = &message->d_errorname; break;
+      case DBUS_HEADER_FIELD_DESTINATION: str = &message->d_destination; break;
+      case DBUS_HEADER_FIELD_SENDER: str = &message->d_sender; break;
+      case DBUS_HEADER_FIELD_SIGNATURE: str = &message->d_signature; expected = DBUS_TYPE_SIGNATURE_AS_STRING; break;
+      case DBUS_HEADER_FIELD_REPLY_SERIAL: expected = DBUS_TYPE_UINT32_AS_STRING; break;
+      default: expected = nullptr;
+    }
+
+    bool ok = false;
+    if (!expected)
+    {
+      char const *s = signature.c_str();
+      ok = reader.skip(&s) && *s == '\0';
+    }
+    else if (signature != expected)
+      ok = false;
+    else if (code == DBUS_HEADER_FIELD_REPLY_SERIAL)
+      ok = reader.getUint32(&message->d_replyserial) && message->d_replyserial != 0;
+    else if (code == DBUS_HEADER_FIELD_SIGNATURE)
+      ok = reader.getSignature(str);
+    else
+      ok = reader.getString(str);
+    if (!ok)
+      return invalid("Invalid header field");
+  }
+  if (reader.pos() != fieldsend || !reader.align(8) || size - reader.pos() != bodysize)
+    return invalid("Invalid header fields");
+  message->d_body.assign(data + reader.pos(), bodysize);
+
+  // the fields every message of its type must have
+  bool complete = true;
+  switch (type)
+  {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      complete = !message->d_path.empty() && !message->d_member.empty();
+      break;
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      complete = message->d_replyserial != 0;
+      break;
+    case DBUS_MESSAGE_TYPE_ERROR:
+      complete = message->d_replyserial != 0 && !message->d_errorname.empty();
+      break;
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      complete = !message->d_path.empty() && !message->d_interface.empty() && !message->d_member.empty();
+      break;
+  }
+  if (!complete || (bodysize && message->d_signature.empty()))
+    return invalid("Missing header fields");
+  return true;
+}
+
+inline DBusMessage *DBusWireMessage::toDBusMessage() const
+{
+  std::string data;
+  marshal(&data);
+  if (!d_serial) // (a call that was not sent yet, libdbus does not accept serial 0)
+    DBusWireWriter(&data, d_bigendian).putUint32At(8, 1);
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessage *message = dbus_message_demarshal(data.data(), data.size(), &error);
+  if (!message)
+    dbus_error_free(&error);
+  return message;
+}
+
+#endif
@@ -0,0 +1,435 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DBUSTRANSCRIPT_H_
+#define DBUSTRANSCRIPT_H_
+
+#include <dbus/dbus.h>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "globals.h"
+#include "log.h"
+#include "dbusmarshal.h"
+
+/*
+  Transcript of a run's dbus traffic (see --record=<file> and --replay=<file>).
+
+  When recording, every method call made through DBusCon is written to the file together
+  with its reply (or error) and the time it took, as is every message seen while waiting for a
+  signal. Replies to the calls that return secrets are redacted first: every string and byte
+  array in them is overwritten (keeping its length and any trailing '=' padding, so it still
+  looks like a secret to the code reading it).
+
+  When replaying, DBusCon does not connect to a bus at all, but answers each call with the
+  reply recorded for the identical call, after the recorded latency (scaled by the replay
+  speed, 0 means no waiting at all).
+
+  The file is plain text, one record per line, messages are hex encoded in dbus' wire format:
+
+    call <request> <microseconds> reply <reply>
+    call <request> <microseconds> error <name> <message>
+    signal <microseconds> <message>
+*/
+class DBusTranscript
+{
+  struct Entry
+  {
+    long long d_us;
+    std::string d_message; // marshalled reply or signal
+    std::string d_errorname;
+    std::string d_errormessage;
+  };
+
+  enum class Mode { None, Record, Replay };
+  Mode d_mode;
+  std::ofstream d_out;
+  std::map<std::string, std::deque<Entry>> d_calls;
+  std::deque<Entry> d_signals;
+  double d_speed;
+
+ public:
+  inline DBusTranscript();
+  inline bool record(std::string const &filename);
+  inline bool replay(std::string const &filename, double speed);
+  inline bool recording() const;
+  inline bool replaying() const;
+
+  // identifies a call: the call itself, serialized (with a fixed serial)
+  inline static std::string key(DBusMessage *call);
+  inline static std::string key(DBusWireMessage const &call);
+
+  inline void recordReply(std::string const &key, std::string const &method, DBusMessage *reply,
+                          DBusCallError const *error, std::chrono::steady_clock::duration duration);
+  inline void recordSignal(DBusMessage *message, std::chrono::steady_clock::duration since);
+
+  // whether the reply to method (interface.member) may carry a secret
+  inline static bool isSecretReply(std::string const &method, DBusMessage *reply);
+
+  // the recorded reply to the call, available at 'sent' + the recorded latency. Returns nullptr
+  // (and sets error) if the call was not recorded or failed, or if the reply takes longer than timeoutms
+  inline DBusMessage *reply(std::string const &key, std::chrono::steady_clock::time_point sent, int timeoutms, DBusCallError *error);
+  // the next recorded signal, available at 'since' + its recorded delay. Returns nullptr if there are none left
+  inline DBusMessage *signal(std::chrono::steady_clock::time_point since);
+  inline bool hasSignals() const;
+
+ private:
+  inline static DBusMessage *redacted(DBusMessage *reply);
+  inline static void copyArgs(DBusMessageIter *from, DBusMessageIter *to);
+  inline static void redact(char *data, int size);
+  inline static std::string marshal(DBusMessage *message);
+  inline static DBusMessage *demarshal(std::string const &hex);
+  inline static std::string toHex(char const *data, std::size_t size);
+  inline static std::string fromHex(std::string const &hex);
+  inline void waitUntil(std::chrono::steady_clock::time_point start, long long us) const;
+};
+
+inline DBusTranscript::DBusTranscript()
+  :
+  d_mode(Mode::None),
+  d_speed(1)
+{}
+
+inline bool DBusTranscript::recording() const
+{
+  return d_mode == Mode::Record;
+}
+
+inline bool DBusTranscript::replaying() const
+{
+  return d_mode == Mode::Replay;
+}
+
+inline bool DBusTranscript::record(std::string const &filename)
+{
+  d_out.open(filename, std::ios_base::trunc);
+  if (!d_out.is_open())
+  {
+    std::cout << "Failed to open file '" << filename << "' for writing" << std::endl;
+    return false;
+  }
+  d_out << "# get_signal_desktop_key dbus transcript" << std::endl;
+  d_mode = Mode::Record;
+  return true;
+}
+
+inline bool DBusTranscript::replay(std::string const &filename, double speed)
+{
+  std::ifstream in(filename);
+  if (!in.is_open())
+  {
+    std::cout << "Failed to open file '" << filename << "' for reading" << std::endl;
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream record(line);
+    std::string type;
+    record >> type;
+    if (type == "call")
+    {
+      std::string callkey, kind;
+      Entry e;
+      record >> callkey >> e.d_us >> kind;
+      if (kind == "reply")
+        record >> e.d_message;
+      else
+      {
+        record >> e.d_errorname >> e.d_errormessage;
+        e.d_errormessage = fromHex(e.d_errormessage);
+      }
+      d_calls[callkey].push_back(std::move(e));
+    }
+    else if (type == "signal")
+    {
+      Entry e;
+      record >> e.d_us >> e.d_message;
+      d_signals.push_back(std::move(e));
+    }
+  }
+  LOG_DEBUG(DBus) << "(Loaded transcript with " << d_calls.size() << " different calls and "
+                  << d_signals.size() << " signals)";
+  d_speed = speed;
+  d_mode = Mode::Replay;
+  return true;
+}
+
+inline std::string DBusTranscript::key(DBusMessage *call)
+{
+  std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> copy(dbus_message_copy(call), &::dbus_message_unref);
+  if (!copy)
+    return std::string();
+  dbus_message_set_serial(copy.get(), 1);
+  return marshal(copy.get());
+}
+
+// (the same key as for the call built by libdbus, both lay out their header fields alike)
+inline std::string DBusTranscript::key(DBusWireMessage const &call)
+{
+  DBusWireMessage copy(call);
+  copy.d_serial = 1;
+  std::string data;
+  copy.marshal(&data);
+  return toHex(data.data(), data.size());
+}
+
+inline void DBusTranscript::recordReply(std::string const &key, std::string const &method, DBusMessage *reply,
+                                        DBusCallError const *error, std::chrono::steady_clock::duration duration)
+{
+  if (d_mode != Mode::Record)
+    return;
+
+  d_out << "call " << key << " " << std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  if (reply)
+  {
+    if (isSecretReply(method, reply))
+    {
+      std::unique_ptr<DBusMessage, decltype(&::dbus_message_unref)> r(redacted(reply), &::dbus_message_unref);
+      d_out << " reply " << marshal(r.get());
+    }
+    else
+      d_out << " reply " << marshal(reply);
+  }
+  else
+  {
+    std::string message(error ? error->d_message : "");
+    d_out << " error " << (error && error->isSet() ? error->d_name : DBUS_ERROR_FAILED) << " " << toHex(message.data(), message.size());
+  }
+  d_out << std::endl;
+}
+
+inline void DBusTranscript::recordSignal(DBusMessage *message, std::chrono::steady_clock::duration since)
+{
+  if (d_mode != Mode::Record)
+    return;
+  d_out << "signal " << std::chrono::duration_cast<std::chrono::microseconds>(since).count() << " " << marshal(message) << std::endl;
+}
+
+inline void DBusTranscript::waitUntil(std::chrono::steady_clock::time_point start, long long us) const
+{
+  if (d_speed > 0)
+    std::this_thread::sleep_until(start + std::chrono::microseconds(static_cast<long long>(us * d_speed)));
+}
+
+inline DBusMessage *DBusTranscript::reply(std::string const &key, std::chrono::steady_clock::time_point sent, int timeoutms, DBusCallError *error)
+{
+  auto it = d_calls.find(key);
+  if (it == d_calls.end() || it->second.empty())
+  {
+    error->set(DBUS_ERROR_FAILED, "Call not found in transcript");
+    return nullptr;
+  }
+
+  // a call made more often than it was recorded gets the last recorded reply again
+  Entry e = it->second.front();
+  if (it->second.size() > 1)
+    it->second.pop_front();
+
+  if (e.d_us * d_speed > timeoutms * 1000.)
+  {
+    waitUntil(sent, timeoutms * 1000ll / (d_speed > 0 ? d_speed : 1));
+    error->set(DBUS_ERROR_NO_REPLY, "Did not receive a reply in time");
+    return nullptr;
+  }
+  waitUntil(sent, e.d_us);
+
+  if (!e.d_errorname.empty())
+  {
+    error->set(e.d_errorname, e.d_errormessage);
+    return nullptr;
+  }
+  return demarshal(e.d_message);
+}
+
+inline bool DBusTranscript::hasSignals() const
+{
+  return !d_signals.empty();
+}
+
+inline DBusMessage *DBusTranscript::signal(std::chrono::steady_clock::time_point since)
+{
+  if (d_signals.empty())
+    return nullptr;
+  Entry e = std::move(d_signals.front());
+  d_signals.pop_front();
+  waitUntil(since, e.d_us);
+  return demarshal(e.d_message);
+}
+
+inline bool DBusTranscript::isSecretReply(std::string const &method, DBusMessage *reply)
+{
+  // Secret Service secrets always travel in a Secret struct, whichever method returns them
+  char const *signature = reply ? dbus_message_get_signature(reply) : nullptr;
+  if (signature && std::strstr(signature, "(oayays)"))
+    return true;
+
+  // KWallet has no such type: all of its replies count, except those that only carry
+  // wallet, folder and entry names, flags or handles
+  std::string const kwallet("org.kde.KWallet.");
+  if (method.compare(0, kwallet.size(), kwallet) != 0)
+    return false;
+  for (char const *m : {"isEnabled", "isOpen", "open", "openAsync", "openPath", "openPathAsync", "close",
+                        "wallets", "networkWallet", "localWallet", "folderList", "hasFolder", "entryList",
+                        "hasEntry", "entryType", "users"})
+    if (method.compare(kwallet.size(), std::string::npos, m) == 0)
+      return false;
+  return true;
+}
+
+// overwrite with 'A's, keep any trailing '=' (base64 padding)
+inline void DBusTranscript::redact(char *data, int size)
+{
+  int end = size;
+  while (end > 0 && data[end - 1] == '=')
+    --end;
+  std::memset(data, 'A', end);
+}
+
+inline DBusMessage *DBusTranscript::redacted(DBusMessage *reply)
+{
+  DBusMessage *r = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (!r)
+    return nullptr;
+  dbus_message_set_serial(r, dbus_message_get_serial(reply));
+  dbus_message_set_reply_serial(r, dbus_message_get_reply_serial(reply));
+  DBusMessageIter from, to;
+  dbus_message_iter_init_append(r, &to);
+  if (dbus_message_iter_init(reply, &from))
+    copyArgs(&from, &to);
+  return r;
+}
+
+inline void DBusTranscript::copyArgs(DBusMessageIter *from, DBusMessageIter *to)
+{
+  for (int type = dbus_message_iter_get_arg_type(from); type != DBUS_TYPE_INVALID;
+       dbus_message_iter_next(from), type = dbus_message_iter_get_arg_type(from))
+  {
+    if (type == DBUS_TYPE_STRING)
+    {
+      char const *str = nullptr;
+      dbus_message_iter_get_basic(from, &str);
+      std::string s(str);
+      redact(s.data(), s.size());
+      str = s.c_str();
+      dbus_message_iter_append_basic(to, type, &str);
+    }
+    else if (dbus_type_is_basic(type))
+    {
+      DBusBasicValue value;
+      dbus_message_iter_get_basic(from, &value);
+      dbus_message_iter_append_basic(to, type, &value);
+    }
+    else if (type == DBUS_TYPE_ARRAY && dbus_message_iter_get_element_type(from) == DBUS_TYPE_BYTE)
+    {
+      DBusMessageIter sub_from, sub_to;
+      dbus_message_iter_recurse(from, &sub_from);
+      char const *data = nullptr;
+      int size = 0;
+      dbus_message_iter_get_fixed_array(&sub_from, &data, &size);
+      std::string bytes(size ? data : "", size);
+      redact(bytes.data(), bytes.size());
+      data = bytes.data();
+      dbus_message_iter_open_container(to, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &sub_to);
+      dbus_message_iter_append_fixed_array(&sub_to, DBUS_TYPE_BYTE, &data, size);
+      dbus_message_iter_close_container(to, &sub_to);
+    }
+    else // container
+    {
+      DBusMessageIter sub_from, sub_to;
+      dbus_message_iter_recurse(from, &sub_from);
+      std::unique_ptr<char, decltype(&::dbus_free)> signature(nullptr, &::dbus_free);
+      if (type == DBUS_TYPE_ARRAY)
+        signature.reset(dbus_message_iter_get_signature(from));
+      else if (type == DBUS_TYPE_VARIANT)
+        signature.reset(dbus_message_iter_get_signature(&sub_from));
+      // (an array's signature includes the 'a', structs and dict entries take none)
+      dbus_message_iter_open_container(to, type, signature ? signature.get() + (type == DBUS_TYPE_ARRAY ? 1 : 0) : nullptr, &sub_to);
+      if (type == DBUS_TYPE_DICT_ENTRY) // keep the key (an entry's name), redact only its value
+      {
+        DBusBasicValue key;
+        dbus_message_iter_get_basic(&sub_from, &key);
+        dbus_message_iter_append_basic(&sub_to, dbus_message_iter_get_arg_type(&sub_from), &key);
+        dbus_message_iter_next(&sub_from);
+      }
+      copyArgs(&sub_from, &sub_to);
+      dbus_message_iter_close_container(to, &sub_to);
+    }
+  }
+}
+
+inline std::string DBusTranscript::marshal(DBusMessage *message)
+{
+  char *data = nullptr;
+  int size = 0;
+  if (!message || !dbus_message_marshal(message, &data, &size))
+    return std::string();
+  std::string ret = toHex(data, size);
+  dbus_free(data);
+  return ret;
+}
+
+inline DBusMessage *DBusTranscript::demarshal(std::string const &hex)
+{
+  std::string data = fromHex(hex);
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessage *message = dbus_message_demarshal(data.data(), data.size(), &error);
+  if (dbus_error_is_set(&error))
+  {
+    std::cout << "Failed to read message from transcript: " << error.message << std::endl;
+    dbus_error_free(&error);
+  }
+  return message;
+}
+
+inline std::string DBusTranscript::toHex(char const *data, std::size_t size)
+{
+  static char const digits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(size * 2 + 1);
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    hex += digits[(data[i] >> 4) & 0xf];
+    hex += digits[data[i] & 0xf];
+  }
+  return hex.empty() ? "-" : hex; // (so an empty field is still a field)
+}
+
+inline std::string DBusTranscript::fromHex(std::string const &hex)
+{
+  auto value = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+  std::string data;
+  for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+    data += static_cast<char>(value(hex[i]) * 16 + value(hex[i + 1]));
+  return data;
+}
+
+extern DBusTranscript g_transcript;
+
+#endif
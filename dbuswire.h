@@ -0,0 +1,455 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DBUSWIRE_H_
+#define DBUSWIRE_H_
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "globals.h"
+#include "log.h"
+#include "deadline.h"
+#include "dbusmarshal.h"
+
+/*
+  Minimal native transport for the session bus: it connects to the bus socket itself,
+  authenticates (SASL EXTERNAL), says Hello and matches replies to calls by serial. It
+  has no locking, no dispatching and no main loop integration, just what DBusCon needs.
+
+  Messages are DBusWireMessage's, (de)marshalled in-tree (see dbusmarshal.h), so a run on
+  the native transport does not call into libdbus at all (with -DLAZY_LOAD_LIBS it is not
+  even loaded), unless it records a transcript or logs the dbus traffic.
+*/
+class DBusWire
+{
+  int d_fd;
+  uint32_t d_serial;
+  std::string d_buffer;
+  std::string d_outbuffer;
+  std::string d_uniquename;
+  std::deque<std::unique_ptr<DBusWireMessage>> d_queue; // received while waiting for a reply
+
+ public:
+  inline DBusWire();
+  inline ~DBusWire();
+  DBusWire(DBusWire const &other) = delete;
+  DBusWire &operator=(DBusWire const &other) = delete;
+
+  inline bool connect();
+  inline bool connected() const;
+  inline std::string const &uniqueName() const;
+
+  inline bool send(DBusWireMessage *message, uint32_t *serial = nullptr);
+  inline std::unique_ptr<DBusWireMessage> sendWithReplyAndBlock(DBusWireMessage *message, int timeoutms, DBusCallError *error);
+  inline std::unique_ptr<DBusWireMessage> waitReply(uint32_t serial, int timeoutms, DBusCallError *error,
+                                                    std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now());
+  inline std::unique_ptr<DBusWireMessage> popMessage(int timeoutms);
+  inline bool addMatch(std::string const &rule, DBusCallError *error);
+
+ private:
+  inline static std::string sessionBusSocket(bool *abstract);
+  inline bool writeAll(char const *data, std::size_t size);
+  inline bool readLine(std::string *line);
+  inline bool authenticate();
+  inline std::unique_ptr<DBusWireMessage> readMessage(int timeoutms);
+  inline void fail(std::string const &reason);
+};
+
+inline DBusWire::DBusWire()
+  :
+  d_fd(-1),
+  d_serial(0)
+{}
+
+inline DBusWire::~DBusWire()
+{
+  if (d_fd >= 0)
+    close(d_fd);
+}
+
+inline bool DBusWire::connected() const
+{
+  return d_fd >= 0;
+}
+
+inline std::string const &DBusWire::uniqueName() const
+{
+  return d_uniquename;
+}
+
+inline std::string DBusWire::sessionBusSocket(bool *abstract)
+{
+  auto unescape = [](std::string const &in)
+  {
+    std::string out;
+    for (unsigned int i = 0; i < in.size(); ++i)
+    {
+      if (in[i] == '%' && i + 2 < in.size())
+      {
+        out += static_cast<char>(std::stoi(in.substr(i + 1, 2), nullptr, 16));
+        i += 2;
+      }
+      else
+        out += in[i];
+    }
+    return out;
+  };
+
+  *abstract = false;
+  char const *env = std::getenv("DBUS_SESSION_BUS_ADDRESS");
+  if (!env)
+  {
+    // same default as libdbus
+    char const *runtimedir = std::getenv("XDG_RUNTIME_DIR");
+    return runtimedir ? std::string(runtimedir) + "/bus" : std::string();
+  }
+
+  // "unix:path=/run/user/1000/bus,guid=...;unix:abstract=/tmp/dbus-XXXX"
+  std::string addresses(env);
+  std::string::size_type start = 0;
+  while (start < addresses.size())
+  {
+    std::string::size_type end = addresses.find(';', start);
+    std::string address = addresses.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    start = (end == std::string::npos) ? addresses.size() : end + 1;
+
+    if (address.compare(0, 5, "unix:") != 0)
+      continue;
+    std::string::size_type kvstart = 5;
+    while (kvstart < address.size())
+    {
+      std::string::size_type kvend = address.find(',', kvstart);
+      std::string kv = address.substr(kvstart, kvend == std::string::npos ? std::string::npos : kvend - kvstart);
+      kvstart = (kvend == std::string::npos) ? address.size() : kvend + 1;
+      if (kv.compare(0, 5, "path=") == 0)
+        return unescape(kv.substr(5));
+      if (kv.compare(0, 9, "abstract=") == 0)
+      {
+        *abstract = true;
+        return unescape(kv.substr(9));
+      }
+    }
+  }
+  return std::string();
+}
+
+inline bool DBusWire::writeAll(char const *data, std::size_t size)
+{
+  while (size)
+  {
+    ssize_t written = write(d_fd, data, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+inline bool DBusWire::readLine(std::string *line)
+{
+  std::string::size_type pos;
+  while ((pos = d_buffer.find("\r\n")) == std::string::npos)
+  {
+    // (a server that never completes the line must not block us forever)
+    pollfd pfd{d_fd, POLLIN, 0};
+    int res = poll(&pfd, 1, deadlineTimeout(25000));
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0 || d_buffer.size() > 4096)
+      return false;
+
+    char buf[256];
+    ssize_t got = read(d_fd, buf, sizeof(buf));
+    if (got <= 0)
+    {
+      if (got < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    d_buffer.append(buf, got);
+  }
+  *line = d_buffer.substr(0, pos);
+  d_buffer.erase(0, pos + 2);
+  return true;
+}
+
+inline bool DBusWire::authenticate()
+{
+  // the client starts with a single nul byte, then authenticates as its uid (hex-encoded ascii)
+  std::string uid = std::to_string(getuid());
+  std::string auth(1, '\0');
+  auth += "AUTH EXTERNAL ";
+  for (char c : uid)
+  {
+    char hex[3];
+    std::snprintf(hex, sizeof(hex), "%02x", static_cast<unsigned char>(c));
+    auth += hex;
+  }
+  auth += "\r\n";
+
+  std::string line;
+  if (!writeAll(auth.data(), auth.size()) || !readLine(&line))
+    return false;
+  LOG_DEBUG(DBus) << "(native dbus) AUTH: " << line;
+  if (line.compare(0, 3, "OK ") != 0)
+    return false;
+  return writeAll("BEGIN\r\n", 7);
+}
+
+inline bool DBusWire::connect()
+{
+  bool abstract = false;
+  std::string socketpath = sessionBusSocket(&abstract);
+  sockaddr_un addr{};
+  if (socketpath.empty() || socketpath.size() + (abstract ? 1 : 0) >= sizeof(addr.sun_path))
+  {
+    LOG_DEBUG(DBus) << "(native dbus) No usable session bus address";
+    return false;
+  }
+
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path + (abstract ? 1 : 0), socketpath.data(), socketpath.size());
+  socklen_t addrlen = offsetof(sockaddr_un, sun_path) + socketpath.size() + (abstract ? 1 : 0);
+
+  d_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (d_fd < 0 ||
+      ::connect(d_fd, reinterpret_cast<sockaddr *>(&addr), addrlen) != 0)
+  {
+    LOG_DEBUG(DBus) << "(native dbus) Failed to connect to '" << socketpath << "': " << std::strerror(errno);
+    return false;
+  }
+
+  if (!authenticate())
+  {
+    LOG_DEBUG(DBus) << "(native dbus) Authentication failed";
+    return false;
+  }
+
+  // anything that follows the handshake is binary
+  DBusWireMessage hello(DBusWireMessage::methodCall(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "Hello"));
+  DBusCallError error;
+  std::unique_ptr<DBusWireMessage> reply(sendWithReplyAndBlock(&hello, DBUS_TIMEOUT_USE_DEFAULT, &error));
+  if (!reply || reply->d_signature != DBUS_TYPE_STRING_AS_STRING || !reply->body().getString(&d_uniquename))
+  {
+    LOG_DEBUG(DBus) << "(native dbus) Hello failed";
+    return false;
+  }
+  LOG_DEBUG(DBus) << "(native dbus) Connected as " << d_uniquename;
+  return true;
+}
+
+inline bool DBusWire::send(DBusWireMessage *message, uint32_t *serial)
+{
+  if (d_fd < 0)
+    return false;
+
+  message->d_serial = ++d_serial;
+  if (serial)
+    *serial = d_serial;
+
+  message->marshal(&d_outbuffer);
+  return writeAll(d_outbuffer.data(), d_outbuffer.size());
+}
+
+inline std::unique_ptr<DBusWireMessage> DBusWire::readMessage(int timeoutms)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+  while (d_fd >= 0)
+  {
+    // a complete message may already be buffered
+    long size = DBusWireMessage::messageSize(d_buffer.data(), d_buffer.size());
+    if (size < 0)
+    {
+      // there is no way to find the start of the next message
+      fail("corrupt message stream");
+      return nullptr;
+    }
+    if (size > 0 && d_buffer.size() >= static_cast<std::size_t>(size))
+    {
+      std::unique_ptr<DBusWireMessage> message(new DBusWireMessage);
+      std::string error;
+      bool valid = DBusWireMessage::demarshal(d_buffer.data(), size, message.get(), &error);
+      d_buffer.erase(0, size);
+      if (!valid)
+      {
+        fail("invalid message (" + error + ")");
+        return nullptr;
+      }
+      return message;
+    }
+
+    // when the time is up, still check once (without waiting) for data that has arrived
+    int remaining = timeoutms < 0 ? -1 :
+      std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (timeoutms >= 0 && remaining < 0)
+      remaining = 0;
+
+    pollfd pfd{d_fd, POLLIN, 0};
+    int res = poll(&pfd, 1, remaining);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return nullptr;
+
+    char buf[4096];
+    ssize_t got = read(d_fd, buf, sizeof(buf));
+    if (got <= 0)
+    {
+      if (got < 0 && errno == EINTR)
+        continue;
+      close(d_fd);
+      d_fd = -1;
+      return nullptr;
+    }
+    d_buffer.append(buf, got);
+  }
+  return nullptr;
+}
+
+// the connection can not be used any more: close it, so it reports as disconnected (and
+// DBusCon falls back to libdbus)
+inline void DBusWire::fail(std::string const &reason)
+{
+  std::cout << "Error: native dbus connection: " << reason << std::endl;
+  if (d_fd >= 0)
+    close(d_fd);
+  d_fd = -1;
+  d_buffer.clear();
+  d_queue.clear();
+}
+
+inline std::unique_ptr<DBusWireMessage> DBusWire::sendWithReplyAndBlock(DBusWireMessage *message, int timeoutms, DBusCallError *error)
+{
+  auto sent = std::chrono::steady_clock::now();
+  uint32_t serial = 0;
+  if (!send(message, &serial))
+  {
+    error->set(DBUS_ERROR_DISCONNECTED, "Failed to send message on native connection");
+    return nullptr;
+  }
+  return waitReply(serial, timeoutms, error, sent);
+}
+
+// the timeout counts from 'sent' (like libdbus' pending calls), not from when we start waiting
+inline std::unique_ptr<DBusWireMessage> DBusWire::waitReply(uint32_t serial, int timeoutms, DBusCallError *error,
+                                                            std::chrono::steady_clock::time_point sent)
+{
+  auto take = [error](std::unique_ptr<DBusWireMessage> message) -> std::unique_ptr<DBusWireMessage>
+  {
+    if (message->d_type == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      // (an error's description, if any, is its first argument)
+      std::string description;
+      if (message->d_signature.compare(0, 1, DBUS_TYPE_STRING_AS_STRING) == 0)
+        message->body().getString(&description);
+      error->set(message->d_errorname, description);
+      return nullptr;
+    }
+    return message;
+  };
+
+  // the reply may have come in already, while waiting for another one
+  for (auto it = d_queue.begin(); it != d_queue.end(); ++it)
+    if ((*it)->d_replyserial == serial)
+    {
+      std::unique_ptr<DBusWireMessage> incoming(std::move(*it));
+      d_queue.erase(it);
+      return take(std::move(incoming));
+    }
+
+  if (timeoutms == DBUS_TIMEOUT_USE_DEFAULT)
+    timeoutms = deadlineTimeout(25000); // libdbus' default
+  auto deadline = sent + std::chrono::milliseconds(timeoutms);
+  while (true)
+  {
+    int remaining = timeoutms == DBUS_TIMEOUT_INFINITE ? -1 :
+      std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (timeoutms != DBUS_TIMEOUT_INFINITE && remaining < 0)
+      remaining = 0; // (still take a reply that has arrived already)
+
+    std::unique_ptr<DBusWireMessage> incoming(readMessage(remaining));
+    if (!incoming)
+    {
+      // readMessage() only returns nothing when the timeout passed (or the connection closed)
+      if (d_fd < 0)
+      {
+        error->set(DBUS_ERROR_DISCONNECTED, "Native connection was closed");
+        return nullptr;
+      }
+      break;
+    }
+
+    if (incoming->d_replyserial == serial)
+      return take(std::move(incoming));
+
+    // not ours (signal, reply to another pending call...), keep it
+    d_queue.push_back(std::move(incoming));
+  }
+
+  error->set(DBUS_ERROR_NO_REPLY, "Did not receive a reply in time");
+  return nullptr;
+}
+
+inline std::unique_ptr<DBusWireMessage> DBusWire::popMessage(int timeoutms)
+{
+  // replies stay queued for waitReply()
+  for (auto it = d_queue.begin(); it != d_queue.end(); ++it)
+    if ((*it)->d_replyserial == 0)
+    {
+      std::unique_ptr<DBusWireMessage> message(std::move(*it));
+      d_queue.erase(it);
+      return message;
+    }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+  while (true)
+  {
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    std::unique_ptr<DBusWireMessage> message(readMessage(remaining < 0 ? 0 : remaining));
+    if (!message || message->d_replyserial == 0)
+      return message;
+    d_queue.push_back(std::move(message));
+  }
+}
+
+inline bool DBusWire::addMatch(std::string const &rule, DBusCallError *error)
+{
+  DBusWireMessage message(DBusWireMessage::methodCall(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "AddMatch"));
+  message.d_signature = DBUS_TYPE_STRING_AS_STRING;
+  DBusWireWriter(&message.d_body).putString(rule);
+  return static_cast<bool>(sendWithReplyAndBlock(&message, DBUS_TIMEOUT_USE_DEFAULT, error));
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEADLINE_H_
+#define DEADLINE_H_
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "globals.h"
+
+// One absolute deadline for the whole run (--deadline=<ms>). Every blocking operation asks
+// how much of it is left, instead of using its own fixed timeout.
+
+inline void setDeadline(long long ms)
+{
+  g_hasdeadline = true;
+  g_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+}
+
+// time left (ms) before the deadline, capped at 'timeoutms'. Without a deadline, just returns 'timeoutms'.
+// a negative 'timeoutms' means 'no timeout'. Rounded up, so a wait that uses it all does not end
+// before the deadline.
+inline int deadlineTimeout(int timeoutms)
+{
+  if (!g_hasdeadline)
+    return timeoutms;
+  long long remaining = std::chrono::ceil<std::chrono::milliseconds>(g_deadline - std::chrono::steady_clock::now()).count();
+  if (remaining <= 0)
+    return 0;
+  if (timeoutms < 0 || remaining < timeoutms)
+    return static_cast<int>(remaining);
+  return timeoutms;
+}
+
+// true if the deadline has passed. The first time, the stage that ran out of time is reported.
+inline bool deadlineExpired(std::string const &stage)
+{
+  if (!g_hasdeadline || std::chrono::steady_clock::now() < g_deadline)
+    return false;
+  if (g_deadlinestage.empty())
+  {
+    g_deadlinestage = stage;
+    std::cout << "Deadline expired during: " << stage << std::endl;
+  }
+  return true;
+}
+
+#endif
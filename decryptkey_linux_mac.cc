@@ -27,6 +27,7 @@
 #include <memory>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include <sstream>
 #include <iomanip>
@@ -106,139 +107,176 @@ namespace bepaald
 
 
 
-std::string decryptKey_linux_mac(std::string const &secret, std::string const &encryptedkeystr)
+namespace
 {
+  // (derived keys and decrypted data are only logged with --log-secrets)
+  std::string secretToHexString(unsigned char const *data, unsigned int length)
+  {
+    return g_log.secretsAllowed() ? bepaald::bytesToHexString(data, length) : Log::redacted(length);
+  }
 
-  //g_verbose = true;
+  unsigned char const salt[] = "saltysalt";
+  uint64_t const salt_length = 9;
+  uint64_t const key_length = 16;
+#if defined (__APPLE__) && defined (__MACH__)
+  int const iterations = 1003;
+#else // linux
+  int const iterations = 1;
+#endif
 
-  std::string decryptedkey;
+  // decrypts the (hex) encrypted key with the key derived from a secret
+  std::string decryptWithKey(unsigned char const *key, std::string const &encryptedkeystr)
+  {
+    std::string decryptedkey;
 
-  // secret -> gotten from kwallet or secretservice dbus session eg: c1nTCJlU5p//wEOI/qVNOg==
-  if (g_verbose) std::cout << "Password: '" << secret << "'" << std::endl;
+    // set encrypted key data
+    uint64_t data_length = encryptedkeystr.size() / 2;
+    std::unique_ptr<unsigned char []> data(new unsigned char[data_length]);
+    bepaald::hexStringToBytes(encryptedkeystr, data.get(), data_length);
+    LOG_DEBUG(Crypto) << "Data: " << bepaald::bytesToHexString(data.get(), data_length);
 
+    // check header
+#if defined (__APPLE__) && defined (__MACH__)
+    unsigned char version_header[3] = {'v', '1', '0'};
+#else // linux
+    unsigned char version_header[3] = {'v', '1', '1'};
+#endif
+    if (std::memcmp(data.get(), version_header, 3) != 0) [[unlikely]]
+      std::cout << "WARNING: Unexpected header value: " << bepaald::bytesToHexString(data.get(), 3) << std::endl;
 
 
+    // set iv
+    uint64_t iv_length = 16;
+    unsigned char iv[] = "                "; // 16 spaces...
+    LOG_DEBUG(Crypto) << "IV: " << bepaald::bytesToHexString(iv, iv_length);
 
 
 
-  // derive decryption key from secret:
-  ////
-  ////  crypto::SymmetricKey::DeriveKeyFromPasswordUsingPbkdf2(
-  ////    crypto::SymmetricKey::AES, password, salt /* = "saltysalt" */, kEncryptionIterations /* = 1*/, kDerivedKeySizeInBits /* = 128 NOTE BITS NOT BYTES */));
 
-  // set the salt
-  uint64_t salt_length = 9;
-  unsigned char salt[] = "saltysalt";
-  if (g_verbose) std::cout << "Salt: " << bepaald::bytesToHexString(salt, salt_length) << std::endl;
+    // init cipher and context
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&::EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), &::EVP_CIPHER_CTX_free);
+    if (!ctx)
+    {
+      std::cout << "Failed to create decryption context" << std::endl;
+      return decryptedkey;
+    }
+
+    // init decrypt
+    if (!EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_cbc(), nullptr, key, iv)) [[unlikely]]
+    {
+      std::cout << "Failed to initialize decryption operation" << std::endl;
+      return decryptedkey;
+    }
+
+    // disable padding ?
+    EVP_CIPHER_CTX_set_padding(ctx.get(), 0);
+
+    // decrypt update
+    int out_len = 0;
+    int output_length = data_length - 3;
+    std::unique_ptr<unsigned char[]> output(new unsigned char[output_length]);
+    if (EVP_DecryptUpdate(ctx.get(), output.get(), &out_len, data.get() + 3, output_length) != 1)
+    {
+      std::cout << "error update" << std::endl;
+      return decryptedkey;
+    }
+
+    // decrypt final
+    int tail_len = 0;
+    int err = 0;
+    if ((err = EVP_DecryptFinal_ex(ctx.get(), output.get() + out_len, &tail_len)) != 1)
+    {
+      std::cout << "error final" << std::endl;
+      std::cout << err << std::endl;
+      return decryptedkey;
+    }
+    out_len += tail_len;
+    //std::cout << out_len << std::endl;
+
+    LOG_DEBUG(Crypto) << "Decrypted: " << secretToHexString(output.get(), output_length);
+
+    // maybe check the tail
+    // all input is always padding to the _next_ mutliple of 16 (64 in this case to 80)
+    // the padding bytes are always the size of the padding (see below)
+    int padding = output_length % 16;
+    int realsize = output_length - (padding ? padding : 16);
+
+    //std::cout << output_length << std::endl;
+    //std::cout << padding << std::endl;
+    //std::cout << realsize << std::endl;
+    for (int i = 0; i < (padding ? padding : 16); ++i)
+      if ((int)output[realsize + i] != (padding ? padding : 16))
+      {
+        std::cout << "Decryption appears to have failed (padding bytes have unexpected value)" << std::endl;
+        return std::string();
+      }
+
+    decryptedkey = bepaald::bytesToPrintableString(output.get(), realsize);
+    if (decryptedkey.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789") != std::string::npos)
+    {
+      std::cout << "Failed to decrypt key correctly" << std::endl;
+      return std::string();
+    }
 
-  // perform the KDF
-  uint64_t key_length = 16;
-  std::unique_ptr<unsigned char []> key(new unsigned char[key_length]);
-#if defined (__APPLE__) && defined (__MACH__)
-  int iterations = 1003;
-#else // linux
-  int iterations = 1;
-#endif
-  if (PKCS5_PBKDF2_HMAC_SHA1(reinterpret_cast<char const *>(secret.data()), secret.size(), salt, salt_length, iterations, key_length, key.get()) != 1)
-  {
-    std::cout << "Error deriving key from password" << std::endl;
     return decryptedkey;
   }
-  if (g_verbose) std::cout << "Derived key: " << bepaald::bytesToHexString(key.get(), key_length) << std::endl;
+}
 
+std::string decryptKey_linux_mac(std::string const &secret, std::string const &encryptedkeystr)
+{
 
+  //g_log.setLevel(LogLevel::Debug);
 
+  std::string decryptedkey;
 
-  // set encrypted key data
-  uint64_t data_length = encryptedkeystr.size() / 2;
-  std::unique_ptr<unsigned char []> data(new unsigned char[data_length]);
-  bepaald::hexStringToBytes(encryptedkeystr, data.get(), data_length);
-  if (g_verbose) std::cout << "Data: " << bepaald::bytesToHexString(data.get(), data_length) << std::endl;
+  // secret -> gotten from kwallet or secretservice dbus session eg: c1nTCJlU5p//wEOI/qVNOg==
+  LOG_DEBUG(Crypto) << "Password: '" << g_log.secret(secret) << "'";
 
-  // check header
-#if defined (__APPLE__) && defined (__MACH__)
-  unsigned char version_header[3] = {'v', '1', '0'};
-#else // linux
-  unsigned char version_header[3] = {'v', '1', '1'};
-#endif
-  if (std::memcmp(data.get(), version_header, 3) != 0) [[unlikely]]
-    std::cout << "WARNING: Unexpected header value: " << bepaald::bytesToHexString(data.get(), 3) << std::endl;
 
 
-  // set iv
-  uint64_t iv_length = 16;
-  unsigned char iv[] = "                "; // 16 spaces...
-  if (g_verbose) std::cout << "IV: " << bepaald::bytesToHexString(iv, iv_length) << std::endl;
 
 
 
+  // derive decryption key from secret:
+  ////
+  ////  crypto::SymmetricKey::DeriveKeyFromPasswordUsingPbkdf2(
+  ////    crypto::SymmetricKey::AES, password, salt /* = "saltysalt" */, kEncryptionIterations /* = 1*/, kDerivedKeySizeInBits /* = 128 NOTE BITS NOT BYTES */));
 
-  // init cipher and context
-  std::unique_ptr<EVP_CIPHER_CTX, decltype(&::EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), &::EVP_CIPHER_CTX_free);
-  if (!ctx)
-  {
-    std::cout << "Failed to create decryption context" << std::endl;
-    return decryptedkey;
-  }
+  // set the salt
+  LOG_DEBUG(Crypto) << "Salt: " << bepaald::bytesToHexString(salt, salt_length);
 
-  // init decrypt
-  if (!EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_cbc(), nullptr, key.get(), iv)) [[unlikely]]
+  // perform the KDF
+  std::unique_ptr<unsigned char []> key(new unsigned char[key_length]);
+  if (PKCS5_PBKDF2_HMAC_SHA1(reinterpret_cast<char const *>(secret.data()), secret.size(), salt, salt_length, iterations, key_length, key.get()) != 1)
   {
-    std::cout << "Failed to initialize decryption operation" << std::endl;
+    std::cout << "Error deriving key from password" << std::endl;
     return decryptedkey;
   }
+  LOG_DEBUG(Crypto) << "Derived key: " << secretToHexString(key.get(), key_length);
 
-  // disable padding ?
-  EVP_CIPHER_CTX_set_padding(ctx.get(), 0);
+  return decryptWithKey(key.get(), encryptedkeystr);
+}
 
-  // decrypt update
-  int out_len = 0;
-  int output_length = data_length - 3;
-  std::unique_ptr<unsigned char[]> output(new unsigned char[output_length]);
-  if (EVP_DecryptUpdate(ctx.get(), output.get(), &out_len, data.get() + 3, output_length) != 1)
-  {
-    std::cout << "error update" << std::endl;
-    return decryptedkey;
-  }
+std::vector<std::string> decryptKeys_linux_mac(std::vector<std::string> const &secrets, std::string const &encryptedkeystr)
+{
+  std::vector<std::string> decryptedkeys(secrets.size());
 
-  // decrypt final
-  int tail_len = 0;
-  int err = 0;
-  if ((err = EVP_DecryptFinal_ex(ctx.get(), output.get() + out_len, &tail_len)) != 1)
+  // derive all keys at once (see pbkdf2_sha1_multi.cc), falling back to one by one
+  std::unique_ptr<unsigned char []> keys(new unsigned char[secrets.size() * key_length]);
+  if (!pbkdf2HmacSha1Multi(secrets, salt, salt_length, iterations, key_length, keys.get()))
   {
-    std::cout << "error final" << std::endl;
-    std::cout << err << std::endl;
-    return decryptedkey;
+    for (unsigned int i = 0; i < secrets.size(); ++i)
+      decryptedkeys[i] = decryptKey_linux_mac(secrets[i], encryptedkeystr);
+    return decryptedkeys;
   }
-  out_len += tail_len;
-  //std::cout << out_len << std::endl;
-
-  if (g_verbose) std::cout << "Decrypted: " << bepaald::bytesToHexString(output.get(), output_length) << std::endl;
-
-  // maybe check the tail
-  // all input is always padding to the _next_ mutliple of 16 (64 in this case to 80)
-  // the padding bytes are always the size of the padding (see below)
-  int padding = output_length % 16;
-  int realsize = output_length - (padding ? padding : 16);
-
-  //std::cout << output_length << std::endl;
-  //std::cout << padding << std::endl;
-  //std::cout << realsize << std::endl;
-  for (int i = 0; i < (padding ? padding : 16); ++i)
-    if ((int)output[realsize + i] != (padding ? padding : 16))
-    {
-      std::cout << "Decryption appears to have failed (padding bytes have unexpected value)" << std::endl;
-      return std::string();
-    }
 
-  decryptedkey = bepaald::bytesToPrintableString(output.get(), realsize);
-  if (decryptedkey.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789") != std::string::npos)
+  for (unsigned int i = 0; i < secrets.size(); ++i)
   {
-    std::cout << "Failed to decrypt key correctly" << std::endl;
-    return std::string();
+    LOG_DEBUG(Crypto) << "Password: '" << g_log.secret(secrets[i]) << "'";
+    LOG_DEBUG(Crypto) << "Derived key: " << secretToHexString(keys.get() + i * key_length, key_length);
+    decryptedkeys[i] = decryptWithKey(keys.get() + i * key_length, encryptedkeystr);
   }
-
-  return decryptedkey;
+  return decryptedkeys;
 }
 
 /*
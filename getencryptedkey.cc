@@ -25,7 +25,7 @@
 
 std::string getEncryptedKey(std::string const &configfile)
 {
-  //g_verbose = true;
+  //g_log.setLevel(LogLevel::Debug);
 
   std::string ekey;
 
@@ -42,16 +42,15 @@ std::string getEncryptedKey(std::string const &configfile)
   bool found = false;
   while (std::getline(config, line))
   {
-    if (g_verbose) std::cout << "Checking line: \"" << line << "\"... " << std::endl;
+    LOG_DEBUG(Config) << "Checking line: \"" << line << "\"... ";
     if (std::regex_match(line, m, keyregex))
     {
       if (m.size() == 2) // m[0] is full match, m[1] is first submatch (which we want)
       {
-        if (g_verbose) std::cout << "Matched!" << std::endl;
+        LOG_DEBUG(Config) << "Matched!";
         found = true;
         break;
       }
-      if (g_verbose) std::cout << std::endl;
     }
   }
 
@@ -62,7 +61,7 @@ std::string getEncryptedKey(std::string const &configfile)
   }
 
   ekey = m[1].str();
-  if (g_verbose) std::cout << "Found encrypted key: " << ekey << std::endl;
+  LOG_DEBUG(Config) << "Found encrypted key: " << ekey;
 
   return ekey;
 }
@@ -0,0 +1,293 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "keyringreader.h"
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+  Reads gnome-keyring's keyring files directly (~/.local/share/keyrings/<name>.keyring), without
+  a running daemon or dbus. This is the format gnome-keyring-daemon writes (see
+  gkm-secret-binary.c in gnome-keyring), all integers are big endian:
+
+    "GnomeKeyring\n\r\0\n"
+    major, minor, crypto (0 = AES), hash (0 = MD5) version     4 bytes
+    keyring name                                               string
+    ctime, mtime                                               2 x time
+    flags, lock timeout, hash iterations                       3 x uint32
+    salt                                                       8 bytes
+    reserved                                                   4 x uint32
+    number of items                                            uint32
+      per item: id, type (uint32), hashed attributes           (not used here)
+    size of the encrypted part                                 uint32
+    encrypted part (AES-128-CBC, no padding)
+
+  where a string is a uint32 length followed by that many bytes (length 0xffffffff meaning
+  'null'), a time is two uint32 (high and low half) and attributes are a uint32 count, followed
+  by per attribute: name (string), type (uint32) and a value (string for type 0, uint32 for
+  type 1).
+
+  The key and iv are the first and second half of the password and salt, hashed with SHA-256
+  'hash iterations' times (this is EVP_BytesToKey()). The decrypted part starts with the MD5 of
+  the rest of it (so a wrong password is detected), followed by per item:
+
+    display name, secret                                       2 x string
+    ctime, mtime                                               2 x time
+    reserved                                                   string + 4 x uint32
+    attributes
+    acl: count (uint32), per entry: uint32, 3 x string, uint32
+
+  Keyrings with an empty password are written as plain text instead (a GKeyFile, with a
+  [keyring] section and an [<n>] section per item, holding its display-name and secret).
+*/
+namespace
+{
+  void skipAttributes(KeyringReader *reader)
+  {
+    uint32_t count = reader->uint32();
+    for (uint32_t i = 0; reader->ok() && i < count; ++i)
+    {
+      reader->string();
+      if (reader->uint32() == 0)
+        reader->string();
+      else
+        reader->uint32();
+    }
+  }
+
+  // a keyring without password, written as a key file
+  void readPlainKeyring(std::string const &text, std::set<std::string> *secrets)
+  {
+    std::istringstream lines(text);
+    std::string line;
+    std::string label;
+    std::string secret;
+    bool initem = false;
+    auto itemDone = [&]()
+    {
+      if (initem && isChromiumLabel(label) && isChromiumSecret(secret))
+      {
+        LOG_DEBUG(Config) << " *** SECRET: " << g_log.secret(secret);
+        secrets->insert(secret);
+      }
+      label.clear();
+      secret.clear();
+    };
+    while (std::getline(lines, line))
+    {
+      if (!line.empty() && line[0] == '[')
+      {
+        itemDone();
+        // item sections are just a number ([0], [1], ...), their attributes are in [<n>:attribute<m>]
+        initem = line.size() > 2 && line.back() == ']' &&
+          line.find_first_not_of("0123456789", 1) == line.size() - 1;
+      }
+      else if (initem && line.compare(0, 13, "display-name=") == 0)
+        label = line.substr(13);
+      else if (initem && line.compare(0, 7, "secret=") == 0)
+        secret = line.substr(7);
+    }
+    itemDone();
+  }
+
+  bool readKeyring(std::string const &filename, std::string const &password, std::set<std::string> *secrets)
+  {
+    std::vector<unsigned char> data;
+    if (!readKeyringFile(filename, &data))
+    {
+      std::cout << "Failed to read keyring file '" << filename << "'" << std::endl;
+      return false;
+    }
+
+    static constexpr unsigned char magic[] = {'G', 'n', 'o', 'm', 'e', 'K', 'e', 'y', 'r', 'i', 'n', 'g', '\n', '\r', '\0', '\n'};
+    if (data.size() < sizeof(magic) || std::memcmp(data.data(), magic, sizeof(magic)) != 0)
+    {
+      std::string text(data.begin(), data.end());
+      if (text.compare(0, 9, "[keyring]") != 0)
+      {
+        std::cout << "File '" << filename << "' is not a gnome-keyring keyring" << std::endl;
+        return false;
+      }
+      LOG_DEBUG(Config) << "(Keyring '" << filename << "' is not encrypted)";
+      readPlainKeyring(text, secrets);
+      return true;
+    }
+
+    KeyringReader header(data.data(), data.size(), sizeof(magic));
+    unsigned char const *version = header.bytes(4);
+    if (!version || version[0] != 0 || version[1] != 0 || version[2] != 0 || version[3] != 0)
+    {
+      std::cout << "Unsupported keyring version or algorithm in '" << filename << "'" << std::endl;
+      return false;
+    }
+    std::string name = header.string();
+    header.bytes(2 * 8);                      // ctime, mtime
+    header.bytes(2 * 4);                      // flags, lock timeout
+    uint32_t iterations = header.uint32();
+    unsigned char const *salt = header.bytes(8);
+    header.bytes(4 * 4);                      // reserved
+    uint32_t items = header.uint32();
+    for (uint32_t i = 0; header.ok() && i < items; ++i)
+    {
+      header.bytes(2 * 4);                    // id, type
+      skipAttributes(&header);
+    }
+    uint32_t cryptsize = header.uint32();
+    unsigned char const *encrypted = header.bytes(cryptsize);
+    if (!encrypted || cryptsize < 16 || cryptsize % 16 != 0 || iterations == 0)
+    {
+      std::cout << "Failed to parse keyring file '" << filename << "'" << std::endl;
+      return false;
+    }
+    LOG_DEBUG(Config) << "(Keyring '" << name << "': " << items << " items, " << iterations << " hash iterations)";
+
+    unsigned char key[16];
+    unsigned char iv[16];
+    if (EVP_BytesToKey(EVP_aes_128_cbc(), EVP_sha256(), salt, reinterpret_cast<unsigned char const *>(password.data()),
+                       password.size(), iterations, key, iv) != 16)
+    {
+      std::cout << "Failed to derive keyring key" << std::endl;
+      return false;
+    }
+
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&::EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), &::EVP_CIPHER_CTX_free);
+    std::vector<unsigned char> decrypted(cryptsize);
+    int outlength = 0;
+    int finallength = 0;
+    bool decryptok = ctx &&
+      EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_cbc(), nullptr, key, iv) == 1 &&
+      EVP_CIPHER_CTX_set_padding(ctx.get(), 0) == 1 &&
+      EVP_DecryptUpdate(ctx.get(), decrypted.data(), &outlength, encrypted, cryptsize) == 1 &&
+      EVP_DecryptFinal_ex(ctx.get(), decrypted.data() + outlength, &finallength) == 1;
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestlength = 0;
+    if (!decryptok ||
+        EVP_Digest(decrypted.data() + 16, decrypted.size() - 16, digest, &digestlength, EVP_md5(), nullptr) != 1 ||
+        digestlength != 16 || CRYPTO_memcmp(digest, decrypted.data(), 16) != 0)
+    {
+      std::cout << "Failed to decrypt keyring '" << filename << "' (wrong password?)" << std::endl;
+      return false;
+    }
+
+    KeyringReader body(decrypted.data(), decrypted.size(), 16);
+    for (uint32_t i = 0; body.ok() && i < items; ++i)
+    {
+      std::string label = body.string();
+      std::string secret = body.string();
+      body.bytes(2 * 8);                      // ctime, mtime
+      body.string();                          // reserved
+      body.bytes(4 * 4);
+      skipAttributes(&body);
+      uint32_t acl = body.uint32();
+      for (uint32_t a = 0; body.ok() && a < acl; ++a)
+      {
+        body.uint32();                        // types allowed
+        body.string();                        // display name
+        body.string();                        // path name
+        body.string();                        // reserved
+        body.uint32();
+      }
+      if (!body.ok())
+        break;
+
+      LOG_DEBUG(Config) << " *** Label: " << label;
+      if (!isChromiumLabel(label))
+        continue;
+      if (!isChromiumSecret(secret))
+      {
+        LOG_DEBUG(Config) << "Item does not hold a valid secret";
+        continue;
+      }
+      LOG_DEBUG(Config) << " *** SECRET: " << g_log.secret(secret);
+      secrets->insert(secret);
+    }
+    OPENSSL_cleanse(decrypted.data(), decrypted.size());
+    if (!body.ok())
+    {
+      std::cout << "Failed to parse items of keyring '" << filename << "'" << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+// 'path' itself if it is a file, else the files in directory 'path' that end in 'extension'
+// (sorted, so the order does not depend on the filesystem)
+bool keyringFiles(std::string const &path, std::string const &extension, std::set<std::string> *filenames)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+  {
+    std::cout << "Failed to find keyring file(s) at '" << path << "'" << std::endl;
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode))
+  {
+    filenames->insert(path);
+    return true;
+  }
+
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+  {
+    std::cout << "Failed to open directory '" << path << "'" << std::endl;
+    return false;
+  }
+  while (dirent *entry = readdir(dir))
+  {
+    std::string filename(entry->d_name);
+    if (filename.size() > extension.size() &&
+        filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0)
+      filenames->insert(path + "/" + filename);
+  }
+  closedir(dir);
+  if (filenames->empty())
+  {
+    std::cout << "No " << extension << " files in '" << path << "'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// 'path' is a keyring file, or a directory whose *.keyring files are all read
+void getSecret_KeyringFile(std::string const &path, std::string const &password, std::set<std::string> *secrets)
+{
+  if (!secrets)
+    return;
+
+  std::set<std::string> filenames;
+  keyringFiles(path, ".keyring", &filenames);
+  for (auto const &filename : filenames)
+  {
+    LOG_DEBUG(Config) << "[" << filename << "]";
+    readKeyring(filename, password, secrets);
+  }
+}
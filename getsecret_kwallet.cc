@@ -21,6 +21,232 @@
 
 #include "dbuscon.h"
 
+#include <algorithm>
+
+// org.kde.KWallet methods used below, with their argument and reply types
+DBusMethod<std::tuple<>, std::tuple<std::string>> constexpr KWallet_networkWallet{"org.kde.KWallet", "networkWallet"};
+DBusMethod<std::tuple<>, std::tuple<std::vector<std::string>>> constexpr KWallet_wallets{"org.kde.KWallet", "wallets"};
+DBusMethod<std::tuple<std::string>, std::tuple<bool>> constexpr KWallet_isOpen{"org.kde.KWallet", "isOpen"};
+DBusMethod<std::tuple<std::string, int64_t, std::string, bool>, std::tuple<int32_t>> constexpr KWallet_openAsync{"org.kde.KWallet", "openAsync"};
+DBusMethod<std::tuple<int32_t, std::string>, std::tuple<std::vector<std::string>>> constexpr KWallet_folderList{"org.kde.KWallet", "folderList"};
+DBusMethod<std::tuple<int32_t, std::string, std::string>, std::tuple<bool>> constexpr KWallet_hasFolder{"org.kde.KWallet", "hasFolder"};
+DBusMethod<std::tuple<int32_t, std::string, std::string, std::string>, std::tuple<std::string>> constexpr KWallet_readPassword{"org.kde.KWallet", "readPassword"};
+DBusMethod<std::tuple<int32_t, std::string, std::string>,
+           std::tuple<std::map<std::string, DBusVariantOf<std::string>>>> constexpr KWallet_passwordList{"org.kde.KWallet", "passwordList"};
+DBusMethod<std::tuple<std::string, bool>, std::tuple<int32_t>> constexpr KWallet_closeWallet{"org.kde.KWallet", "close"};
+DBusMethod<std::tuple<int32_t, bool, std::string>, std::tuple<int32_t>> constexpr KWallet_closeHandle{"org.kde.KWallet", "close"};
+
+// folders that may hold Chromium's secret (eg. 'Chromium Keys'), and the entry that does
+bool isChromiumFolder(std::string const &folder)
+{
+#if __cpp_lib_string_contains >= 202011L
+  return (folder.contains("Chrome") || folder.contains("Chromium")) &&
+    (folder.contains("Safe Storage") || folder.contains("Keys"));
+#else
+  return (folder.find("Chrome") != std::string::npos || folder.find("Chromium") != std::string::npos) &&
+    (folder.find("Safe Storage") != std::string::npos || folder.find("Keys") != std::string::npos);
+#endif
+}
+
+bool isChromiumKey(std::string const &key)
+{
+  return key == "Chromium Safe Storage" || key == "Chrome Safe Storage";
+}
+
+// wait for the walletAsyncOpened(transaction id, handle) signals answering our openAsync calls.
+// Returns the handle per transaction, missing the ones that were not answered within 'timeoutms'.
+std::map<int32_t, int32_t> waitWalletsOpened(DBusCon *dbuscon, std::set<int32_t> transactions, int timeoutms)
+{
+  std::map<int32_t, int32_t> handles;
+  LOG_DEBUG(DBus) << "(Waiting for walletAsyncOpened, " << transactions.size() << " transactions)";
+  g_log.flush(); // (this may wait for the user)
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+  while (!transactions.empty() && dbuscon->connected() && !deadlineExpired("walletAsyncOpened"))
+  {
+    long long left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+    if (left <= 0)
+    {
+      std::cout << "Timed out waiting for the wallet to be opened" << std::endl;
+      break;
+    }
+    DBusReply signal = dbuscon->nextSignal(static_cast<int>(left), "org.kde.KWallet");
+    if (!signal.ok() || signal.member() != "walletAsyncOpened")
+      continue;
+    auto opened = signal.as<int32_t, int32_t>();
+    if (opened && transactions.erase(std::get<0>(*opened)))
+      handles[std::get<0>(*opened)] = std::get<1>(*opened);
+  }
+  return handles;
+}
+
+// open all 'wallets' at once. Returns the handle per wallet, missing the ones that failed to open.
+// The wallets that were not answered within 'timeoutms' (still waiting for the user) are added
+// to 'timedout', if given.
+std::map<std::string, int32_t> openWallets(DBusCon *dbuscon, std::string const &destination, std::string const &path,
+                                           std::vector<std::string> const &wallets, int timeoutms,
+                                           std::vector<std::string> *timedout = nullptr)
+{
+  // The 'open' method blocks until the user has entered the wallet's password, and fails
+  // when that takes longer than the call's timeout (even if the wallet does get opened).
+  // 'openAsync' returns a transaction id right away, the handle comes with the
+  // walletAsyncOpened signal for that transaction.
+  LOG_DEBUG(DBus) << "[openAsync]";
+  std::vector<DBusPendingReply<int32_t>> openreplies;
+  for (auto const &wallet : wallets)
+    openreplies.push_back(dbuscon->callAsync(KWallet_openAsync,
+                                             destination,
+                                             path,
+                                             {wallet, 0 /*(int64) window id*/, "signalbackup-tools", false /*handle session*/}));
+
+  std::map<int32_t, std::string> transactions;
+  for (unsigned int i = 0; i < openreplies.size(); ++i)
+  {
+    auto openreply = dbuscon->wait(&openreplies[i]);
+    int32_t transaction = openreply ? std::get<0>(*openreply) : -1;
+    LOG_DEBUG(DBus) << " *** Transaction (" << wallets[i] << "): " << transaction;
+    if (transaction >= 0)
+      transactions[transaction] = wallets[i];
+  }
+
+  std::set<int32_t> pending;
+  for (auto const &t : transactions)
+    pending.insert(t.first);
+
+  std::map<std::string, int32_t> handles;
+  auto answered = waitWalletsOpened(dbuscon, pending, timeoutms);
+  for (auto const &[transaction, handle] : answered)
+  {
+    if (handle < 0)
+      continue;
+    LOG_DEBUG(DBus) << " *** Handle (" << transactions[transaction] << "): " << handle;
+    handles[transactions[transaction]] = handle;
+  }
+  if (timedout)
+    for (auto const &[transaction, wallet] : transactions)
+      if (answered.find(transaction) == answered.end())
+        timedout->push_back(wallet);
+  for (auto const &wallet : wallets)
+    if (handles.find(wallet) == handles.end())
+      std::cout << "Failed to open wallet '" << wallet << "'" << std::endl;
+  return handles;
+}
+
+// read the secret from all opened wallets, every step's calls for all wallets pipelined.
+// Returns whether any secret was found.
+bool readWallets(DBusCon *dbuscon, std::string const &destination, std::string const &path,
+                 std::vector<int32_t> const &handles, std::set<std::string> *secrets)
+{
+  /* DIRECT LOOKUP */
+  // Chromium and Chrome store their secret under known folder and entry names, check those
+  // directly before falling back to scanning all folders.
+  std::string const known_folders[] = {"Chromium Keys", "Chrome Keys"};
+  std::string const known_keys[] = {"Chromium Safe Storage", "Chrome Safe Storage"};
+
+  LOG_DEBUG(DBus) << "[hasFolder]";
+  std::vector<std::pair<int32_t, std::string>> hasfolder_args;
+  std::vector<DBusPendingReply<bool>> hasfolder;
+  for (int32_t handle : handles)
+    for (auto const &folder : known_folders)
+    {
+      hasfolder_args.emplace_back(handle, folder);
+      hasfolder.push_back(dbuscon->callAsync(KWallet_hasFolder,
+                                             destination,
+                                             path,
+                                             {handle, folder, "signalbackup-tools"}));
+    }
+
+  LOG_DEBUG(DBus) << "[readPassword]";
+  std::vector<int32_t> password_handles;
+  std::vector<DBusPendingReply<std::string>> passwords;
+  for (unsigned int i = 0; i < hasfolder.size(); ++i)
+  {
+    auto exists = dbuscon->wait(&hasfolder[i]);
+    if (!exists || !std::get<0>(*exists))
+      continue;
+    for (auto const &key : known_keys)
+    {
+      password_handles.push_back(hasfolder_args[i].first);
+      passwords.push_back(dbuscon->callAsync(KWallet_readPassword,
+                                             destination,
+                                             path,
+                                             {hasfolder_args[i].first, hasfolder_args[i].second, key, "signalbackup-tools"}));
+    }
+  }
+
+  std::set<int32_t> found;
+  for (unsigned int i = 0; i < passwords.size(); ++i)
+  {
+    auto password = dbuscon->wait(&passwords[i]);
+    if (password && !std::get<0>(*password).empty()) // (readPassword returns an empty string for missing entries)
+    {
+      secrets->insert(std::get<0>(*password));
+      found.insert(password_handles[i]);
+    }
+  }
+
+  /* GET FOLDERS (OF THE WALLETS WITHOUT A DIRECT HIT) */
+  std::vector<int32_t> scan;
+  for (int32_t handle : handles)
+    if (found.find(handle) == found.end())
+      scan.push_back(handle);
+
+  if (!scan.empty())
+    LOG_DEBUG(DBus) << "[folderList]";
+  std::vector<DBusPendingReply<std::vector<std::string>>> folderlists;
+  for (int32_t handle : scan)
+    folderlists.push_back(dbuscon->callAsync(KWallet_folderList,
+                                             destination,
+                                             path,
+                                             {handle, "signalbackup-tools"}));
+
+  std::vector<DBusPendingReply<std::map<std::string, DBusVariantOf<std::string>>>> passwordlists;
+  for (unsigned int i = 0; i < folderlists.size(); ++i)
+  {
+    auto folderlist = dbuscon->wait(&folderlists[i]);
+    if (!folderlist || std::get<0>(*folderlist).empty())
+    {
+      std::cout << "Failed to get any folders from wallet" << std::endl;
+      continue;
+    }
+
+    for (auto const &folder : std::get<0>(*folderlist))
+      if (isChromiumFolder(folder))
+      {
+        /* GET PASSWORD */
+        LOG_DEBUG(DBus) << "[passwordList]";
+        passwordlists.push_back(dbuscon->callAsync(KWallet_passwordList,
+                                                   destination,
+                                                   path,
+                                                   {scan[i], folder, "signalbackup-tools"}));
+      }
+  }
+
+  /*
+    The password list returns a dict (dicts are always (in) an array as per dbus spec)
+    the signature is a{sv} -> the v in our case is a string again, pretty much a map<std::string, std::string>,
+
+    The value we want seems to have the key "Chrom[e|ium] Safe Storage"...
+  */
+  bool foundany = !found.empty();
+  for (auto &p : passwordlists)
+  {
+    auto passwordlist = dbuscon->wait(&p);
+    if (!passwordlist || std::get<0>(*passwordlist).empty())
+    {
+      std::cout << "Failed to get password map" << std::endl;
+      continue;
+    }
+
+    for (auto const &e : std::get<0>(*passwordlist))
+      if (isChromiumKey(e.first))
+      {
+        secrets->insert(e.second.d_value);
+        foundany = true;
+      }
+  }
+  return foundany;
+}
+
 void getSecret_Kwallet(int version, std::set<std::string> *secrets)
 {
   if (!secrets)
@@ -35,113 +261,117 @@ void getSecret_Kwallet(int version, std::set<std::string> *secrets)
 
   std::string destination("org.kde.kwalletd" + std::to_string(version));
   std::string path("/modules/kwalletd" + std::to_string(version));
-  std::string interface("org.kde.KWallet");
-
-  /* GET WALLET */
-  if (g_verbose) std::cout << "[networkWallet]" << std::endl;
-  dbuscon.callMethod(destination.c_str(),
-                     path.c_str(),
-                     interface.c_str(),
-                     "networkWallet");
-  std::string walletname = dbuscon.get<std::string>("s", 0);
-  if (walletname.empty())
+
+  /* GET WALLETS */
+  // the secret is usually in the network wallet, but a browser may have been set up to use the
+  // local wallet or any other one, so all are checked (the network wallet first)
+  LOG_DEBUG(DBus) << "[networkWallet]";
+  auto networkwallet_pending = dbuscon.callAsync(KWallet_networkWallet,
+                                                 destination,
+                                                 path);
+  LOG_DEBUG(DBus) << "[wallets]";
+  auto wallets_pending = dbuscon.callAsync(KWallet_wallets,
+                                           destination,
+                                           path);
+  auto networkwallet = dbuscon.wait(&networkwallet_pending);
+  auto walletlist = dbuscon.wait(&wallets_pending);
+
+  std::vector<std::string> wallets;
+  if (networkwallet && !std::get<0>(*networkwallet).empty())
+    wallets.push_back(std::get<0>(*networkwallet));
+  if (walletlist)
+    for (auto const &wallet : std::get<0>(*walletlist))
+      if (!wallet.empty() && std::find(wallets.begin(), wallets.end(), wallet) == wallets.end())
+        wallets.push_back(wallet);
+  if (wallets.empty())
   {
     std::cout << "Failed to get wallet name" << std::endl;
     return;
   }
-  if (g_verbose) std::cout << " *** Wallet name: " << walletname << std::endl;
-
-  // ON KDE THE 'open' METHOD SEEMS TO BLOCK FOR PASSWORD PROMPT BY ITSELF...
-  // /* Register to wait for opening wallet */
-  // if (!matchSignal("member='walletOpened'"))
-  //   std::cout << "WARN: Failed to register for signal" << std::endl;
-
-  /* OPEN WALLET */
-  if (g_verbose) std::cout << "[open]" << std::endl;
-  dbuscon.callMethod(destination.c_str(),
-                     path.c_str(),
-                     interface.c_str(),
-                     "open",
-                     {walletname, 0ll /*(int64) window id*/, "signalbackup-tools"});
-  int32_t handle = dbuscon.get<int32_t>("i", 0 - 1);
-  if (handle < 0)
+
+  /* CHECK WHICH ARE OPEN */
+  // opening a closed wallet asks the user for its password, so those are only tried if the
+  // open wallets do not have the secret
+  LOG_DEBUG(DBus) << "[isOpen]";
+  std::vector<DBusPendingReply<bool>> isopen;
+  for (auto const &wallet : wallets)
+    isopen.push_back(dbuscon.callAsync(KWallet_isOpen,
+                                       destination,
+                                       path,
+                                       {wallet}));
+  std::vector<std::string> openwallets;
+  std::vector<std::string> closedwallets;
+  for (unsigned int i = 0; i < isopen.size(); ++i)
   {
-    std::cout << "Failed to open wallet" << std::endl;
-    return;
+    auto open = dbuscon.wait(&isopen[i]);
+    (open && std::get<0>(*open) ? openwallets : closedwallets).push_back(wallets[i]);
+    LOG_DEBUG(DBus) << " *** Wallet: " << wallets[i] << (open && std::get<0>(*open) ? " (open)" : " (closed)");
   }
-  if (g_verbose) std::cout << " *** Handle: " << handle << std::endl;
 
+  /* REGISTER FOR SIGNAL (BEFORE OPENING, THE SIGNAL MAY BE SENT RIGHT AWAY) */
+  if (!dbuscon.matchSignal("type='signal',interface='org.kde.KWallet',member='walletAsyncOpened',path='" + path + "'"))
+    std::cout << "WARN: Failed to register for signal" << std::endl;
 
-
-  /* GET FOLDERS */
-  if (g_verbose) std::cout << "[folderList]" << std::endl;
-  dbuscon.callMethod(destination.c_str(),
-                     path.c_str(),
-                     interface.c_str(),
-                     "folderList",
-                     {handle, "signalbackup-tools"});
-  std::vector<std::string> folders = dbuscon.get<std::vector<std::string>>("as", 0);
-  if (folders.empty())
+  /* READ THE OPEN WALLETS */
+  // an open wallet still asks the user the first time an application wants to use it, with
+  // --no-prompt that is only waited for briefly (an application that was allowed before is
+  // answered right away), the wallets still waiting after that are skipped
+  std::vector<int32_t> handles;
+  std::set<std::string> openedbyus;
+  bool found = false;
+  if (!openwallets.empty())
   {
-    std::cout << "Failed to get any folders from wallet" << std::endl;
-    return;
+    std::vector<std::string> timedout;
+    auto opened = openWallets(&dbuscon, destination, path, openwallets, g_noprompt ? 2500 : 60000, &timedout);
+    if (g_noprompt && !timedout.empty() && g_promptskipped.empty())
+      g_promptskipped = "wallet '" + timedout.front() + "'";
+    for (auto const &wallet : opened)
+      handles.push_back(wallet.second);
+    found = readWallets(&dbuscon, destination, path, handles, secrets);
   }
 
-  for (auto const &folder : folders)
+  /* READ THE CLOSED WALLETS (ONE AT A TIME, UNTIL ONE HAS THE SECRET) */
+  for (auto const &wallet : closedwallets)
   {
-#if __cpp_lib_string_contains >= 202011L
-    if ((folder.contains("Chrome") || folder.contains("Chromium")) &&
-        (folder.contains("Safe Storage") || folder.contains("Keys")))
-#else
-    if ((folder.find("Chrome") != std::string::npos || folder.find("Chromium") != std::string::npos) &&
-        (folder.find("Safe Storage") != std::string::npos || folder.find("Keys") != std::string::npos))
-#endif
+    // (noted whatever was found: a secret from an open wallet may not decrypt the key)
+    if (g_noprompt)
     {
-      /* GET PASSWORD */
-      if (g_verbose) std::cout << "[passwordList]" << std::endl;
-      dbuscon.callMethod(destination.c_str(),
-                         path.c_str(),
-                         interface.c_str(),
-                         "passwordList",
-                         {handle, folder, "signalbackup-tools"});
-      /*
-        The password list returns a dict (dicts are always (in) an array as per dbus spec)
-        the signature is a{sv} -> the v in our case is a string again, pretty much a map<std::string, std::string>,
-
-        The value we want seems to have the key "Chrom[e|ium] Safe Storage"...
-      */
-      std::map<std::string, std::string> passwordmap = dbuscon.get<std::map<std::string, std::string>>("a{sv}", 0);
-
-      if (passwordmap.empty())
-      {
-        std::cout << "Failed to get password map" << std::endl;
-        return;
-      }
-
-      for (auto const &e : passwordmap)
-        if (e.first == "Chromium Safe Storage" || e.first == "Chrome Safe Storage")
-          secrets->insert(e.second);
+      LOG_DEBUG(DBus) << "(Not opening closed wallet " << wallet << ")";
+      if (g_promptskipped.empty())
+        g_promptskipped = "wallet '" + wallet + "'";
+      break;
     }
+    if (found || deadlineExpired("KWallet prompt"))
+      break;
+    g_metrics.count("backend_prompts_total");
+    auto opened = openWallets(&dbuscon, destination, path, {wallet}, 60000);
+    if (opened.empty())
+      continue;
+    openedbyus.insert(wallet);
+    handles.push_back(opened.begin()->second);
+    found = readWallets(&dbuscon, destination, path, {opened.begin()->second}, secrets);
   }
 
+  /* CLOSE WALLETS */
+  // (only the ones we opened, the others were already open before we came along)
+  for (auto const &wallet : openedbyus)
+  {
+    LOG_DEBUG(DBus) << "[close (wallet)]";
+    dbuscon.send(KWallet_closeWallet,
+                 destination,
+                 path,
+                 {wallet, false});
+  }
 
-  /* CLOSE WALLET */
-  if (g_verbose) std::cout << "[close (wallet)]" << std::endl;
-  dbuscon.callMethod(destination.c_str(),
-                     path.c_str(),
-                     interface.c_str(),
-                     "close",
-                     {walletname, false});
-
-  /* CLOSE SESSION */
-  if (g_verbose) std::cout << "[close (session)]" << std::endl;
-  dbuscon.callMethod(destination.c_str(),
-                     path.c_str(),
-                     interface.c_str(),
-                     "close",
-                     {handle, false, "signalbackup-tools"});
-
-
+  /* CLOSE SESSIONS */
+  for (int32_t handle : handles)
+  {
+    LOG_DEBUG(DBus) << "[close (session)]";
+    dbuscon.send(KWallet_closeHandle,
+                 destination,
+                 path,
+                 {handle, false, "signalbackup-tools"});
+  }
 
   return;
 }
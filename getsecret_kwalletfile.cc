@@ -0,0 +1,268 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// BF_set_key() and BF_decrypt() are deprecated since OpenSSL 3.0, but still the only way to use
+// Blowfish without loading the legacy provider
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include "main.h"
+#include "keyringreader.h"
+
+#include <openssl/blowfish.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+/*
+  Reads KWallet's wallet files directly (~/.local/share/kwalletd/<wallet>.kwl), without a running
+  kwalletd or dbus. This is the format kwalletd writes (see backend/kwalletbackend.cc in
+  kwallet), integers are big endian:
+
+    "KWALLET\n\r\0\r\n"
+    major, minor version (0, 1), cipher, hash                  4 bytes
+    number of folders                                          uint32
+      per folder: MD5 of its name, number of entries           16 bytes + uint32
+        per entry: MD5 of its key                              16 bytes
+    encrypted part                                             (rest of the file)
+
+  Cipher 0 is Blowfish in ECB mode, cipher 3 Blowfish in CBC mode (iv all zero). Blowfish here
+  works on two 32-bit words in host byte order (unlike OpenSSL's BF_ecb_encrypt(), which reads
+  them big endian, but like BF_decrypt()).
+
+  Hash 2 means the key is PBKDF2-HMAC-SHA512 (50000 iterations, 56 bytes) of the password, with
+  the salt from <wallet>.salt next to the wallet file. Hash 0 is the older scheme: the password
+  is cut into (at most four) 16 byte pieces, each hashed with SHA-1 2000 times, and the key is
+  made of (the first bytes of) those hashes.
+
+  The decrypted part is: 8 random bytes, the size of the data (uint32), the data, random
+  padding, and the SHA-1 of the data (so a wrong password is detected). The data is a Qt
+  QDataStream of folders until the end:
+
+    folder name, number of entries                             QString + uint32
+      per entry: key, type, value                              QString + int32 + QByteArray
+
+  where a QString is stored like a string of UTF-16 (big endian) and a password (type 1) value is
+  a QByteArray holding a single QString.
+*/
+namespace
+{
+  int const kwallet_pbkdf2_iterations = 50000;
+  std::size_t const kwallet_key_length = 56;
+
+  // QString (UTF-16, big endian) to UTF-8
+  std::string fromUtf16(std::string const &utf16)
+  {
+    std::string utf8;
+    for (std::size_t i = 0; i + 1 < utf16.size(); i += 2)
+    {
+      uint32_t c = (static_cast<unsigned char>(utf16[i]) << 8) | static_cast<unsigned char>(utf16[i + 1]);
+      if (c >= 0xd800 && c < 0xdc00 && i + 3 < utf16.size()) // (high surrogate)
+      {
+        uint32_t low = (static_cast<unsigned char>(utf16[i + 2]) << 8) | static_cast<unsigned char>(utf16[i + 3]);
+        if (low >= 0xdc00 && low < 0xe000)
+        {
+          c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+          i += 2;
+        }
+      }
+      if (c < 0x80)
+        utf8 += static_cast<char>(c);
+      else if (c < 0x800)
+        utf8 += {static_cast<char>(0xc0 | (c >> 6)), static_cast<char>(0x80 | (c & 0x3f))};
+      else if (c < 0x10000)
+        utf8 += {static_cast<char>(0xe0 | (c >> 12)), static_cast<char>(0x80 | ((c >> 6) & 0x3f)), static_cast<char>(0x80 | (c & 0x3f))};
+      else
+        utf8 += {static_cast<char>(0xf0 | (c >> 18)), static_cast<char>(0x80 | ((c >> 12) & 0x3f)),
+                 static_cast<char>(0x80 | ((c >> 6) & 0x3f)), static_cast<char>(0x80 | (c & 0x3f))};
+    }
+    return utf8;
+  }
+
+  // the old (hash 0) key: SHA-1 of each 16 byte piece of the password (the fourth piece gets
+  // the rest), rehashed 2000 times in total
+  std::vector<unsigned char> passwordHashSha1(std::string const &password)
+  {
+    std::vector<unsigned char> blocks;
+    for (std::size_t offset = 0; offset == 0 || (offset < password.size() && offset < 64); offset += 16)
+    {
+      std::size_t length = std::min(password.size() - offset, offset == 48 ? password.size() : std::size_t(16));
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      unsigned int digestlength = 0;
+      EVP_Digest(password.data() + offset, length, digest, &digestlength, EVP_sha1(), nullptr);
+      for (int i = 1; i < 2000; ++i)
+        EVP_Digest(digest, digestlength, digest, &digestlength, EVP_sha1(), nullptr);
+      blocks.insert(blocks.end(), digest, digest + 20);
+    }
+
+    // one to three blocks: 20 bytes of each (but 16 of the third), four blocks: 14 bytes of each
+    std::size_t const count = blocks.size() / 20;
+    std::vector<unsigned char> key;
+    for (std::size_t b = 0; b < count; ++b)
+    {
+      std::size_t take = count == 4 ? 14 : (b == 2 ? 16 : 20);
+      key.insert(key.end(), blocks.begin() + b * 20, blocks.begin() + b * 20 + take);
+    }
+    OPENSSL_cleanse(blocks.data(), blocks.size());
+    return key;
+  }
+
+  bool readWallet(std::string const &filename, std::string const &password, std::set<std::string> *secrets)
+  {
+    std::vector<unsigned char> data;
+    if (!readKeyringFile(filename, &data))
+    {
+      std::cout << "Failed to read wallet file '" << filename << "'" << std::endl;
+      return false;
+    }
+
+    static constexpr unsigned char magic[] = {'K', 'W', 'A', 'L', 'L', 'E', 'T', '\n', '\r', '\0', '\r', '\n'};
+    if (data.size() < sizeof(magic) || std::memcmp(data.data(), magic, sizeof(magic)) != 0)
+    {
+      std::cout << "File '" << filename << "' is not a KWallet wallet" << std::endl;
+      return false;
+    }
+
+    KeyringReader header(data.data(), data.size(), sizeof(magic));
+    unsigned char const *version = header.bytes(4);
+    if (!version || version[0] != 0 || version[1] != 1 ||
+        (version[2] != 0 && version[2] != 3) || (version[3] != 0 && version[3] != 2))
+    {
+      std::cout << "Unsupported wallet version or algorithm in '" << filename << "'" << std::endl;
+      return false;
+    }
+    bool cbc = version[2] == 3;
+    bool pbkdf2 = version[3] == 2;
+    uint32_t folders = header.uint32();
+    for (uint32_t i = 0; header.ok() && i < folders; ++i)
+    {
+      header.bytes(16);
+      header.bytes(16 * std::size_t{header.uint32()});
+    }
+    std::size_t encryptedsize = data.size() - header.pos();
+    if (!header.ok() || encryptedsize < 8 + 4 + 20 || encryptedsize % 8 != 0)
+    {
+      std::cout << "Failed to parse wallet file '" << filename << "'" << std::endl;
+      return false;
+    }
+    LOG_DEBUG(Config) << "(Wallet: " << folders << " folders, " << (cbc ? "CBC" : "ECB") << ", " << (pbkdf2 ? "PBKDF2" : "SHA-1") << ")";
+
+    std::vector<unsigned char> key;
+    if (pbkdf2)
+    {
+      std::string saltfile = filename.substr(0, filename.rfind(".kwl")) + ".salt";
+      std::vector<unsigned char> salt;
+      if (!readKeyringFile(saltfile, &salt) || salt.empty())
+      {
+        std::cout << "Failed to read salt file '" << saltfile << "'" << std::endl;
+        return false;
+      }
+      key.resize(kwallet_key_length);
+      if (PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt.data(), salt.size(), kwallet_pbkdf2_iterations,
+                            EVP_sha512(), key.size(), key.data()) != 1)
+      {
+        std::cout << "Failed to derive wallet key" << std::endl;
+        return false;
+      }
+    }
+    else
+      key = passwordHashSha1(password);
+
+    BF_KEY bfkey;
+    BF_set_key(&bfkey, key.size(), key.data());
+    OPENSSL_cleanse(key.data(), key.size());
+
+    std::vector<unsigned char> decrypted(data.begin() + header.pos(), data.end());
+    BF_LONG previous[2] = {0, 0};
+    for (std::size_t i = 0; i < decrypted.size(); i += 8)
+    {
+      BF_LONG block[2];
+      std::memcpy(block, decrypted.data() + i, 8);
+      BF_LONG ciphertext[2] = {block[0], block[1]};
+      BF_decrypt(block, &bfkey);
+      if (cbc)
+      {
+        block[0] ^= previous[0];
+        block[1] ^= previous[1];
+        previous[0] = ciphertext[0];
+        previous[1] = ciphertext[1];
+      }
+      std::memcpy(decrypted.data() + i, block, 8);
+    }
+    OPENSSL_cleanse(&bfkey, sizeof(bfkey));
+
+    KeyringReader sizereader(decrypted.data(), decrypted.size(), 8);
+    std::size_t datasize = sizereader.uint32();
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestlength = 0;
+    if (datasize > decrypted.size() - 8 - 4 - 20 ||
+        EVP_Digest(decrypted.data() + 12, datasize, digest, &digestlength, EVP_sha1(), nullptr) != 1 ||
+        digestlength != 20 || CRYPTO_memcmp(digest, decrypted.data() + decrypted.size() - 20, 20) != 0)
+    {
+      std::cout << "Failed to decrypt wallet '" << filename << "' (wrong password?)" << std::endl;
+      return false;
+    }
+
+    KeyringReader body(decrypted.data(), 12 + datasize, 12);
+    while (!body.atEnd())
+    {
+      std::string folder = fromUtf16(body.string());
+      uint32_t entries = body.uint32();
+      LOG_DEBUG(Config) << " *** Folder: " << folder << " (" << entries << " entries)";
+      for (uint32_t e = 0; body.ok() && e < entries; ++e)
+      {
+        std::string entrykey = fromUtf16(body.string());
+        uint32_t type = body.uint32();
+        std::string value = body.string();
+        if (!body.ok() || type != 1 /*password*/ || !isChromiumFolder(folder) || !isChromiumKey(entrykey))
+          continue;
+        KeyringReader valuereader(reinterpret_cast<unsigned char const *>(value.data()), value.size());
+        std::string secret = fromUtf16(valuereader.string());
+        if (!valuereader.ok() || secret.empty())
+          continue;
+        LOG_DEBUG(Config) << " *** SECRET: " << g_log.secret(secret);
+        secrets->insert(secret);
+      }
+    }
+    OPENSSL_cleanse(decrypted.data(), decrypted.size());
+    if (!body.ok())
+    {
+      std::cout << "Failed to parse entries of wallet '" << filename << "'" << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+// 'path' is a wallet file, or a directory whose *.kwl files are all read
+void getSecret_KwalletFile(std::string const &path, std::string const &password, std::set<std::string> *secrets)
+{
+  if (!secrets)
+    return;
+
+  std::set<std::string> filenames;
+  keyringFiles(path, ".kwl", &filenames);
+  for (auto const &filename : filenames)
+  {
+    LOG_DEBUG(Config) << "[" << filename << "]";
+    readWallet(filename, password, secrets);
+  }
+}
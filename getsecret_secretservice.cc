@@ -20,211 +20,576 @@
 #include "main.h"
 
 #include "dbuscon.h"
+#include "itemcache.h"
 
-void getSecret_SecretService(std::set<std::string> *secrets)
-{
-  if (!secrets)
-    return;
+#include <algorithm>
+#include <csignal>
 
-  DBusCon dbuscon;
-  if (!dbuscon.ok())
-  {
-    std::cout << "Error connecting to dbus session" << std::endl;
-    return;
-  }
+// org.freedesktop.Secret methods used below, with their argument and reply types
+DBusMethod<std::tuple<std::string, DBusVariantOf<std::string>>,
+           std::tuple<DBusVariantOf<std::string>, DBusObjectPath>> constexpr SecretService_OpenSession{"org.freedesktop.Secret.Service", "OpenSession"};
+DBusMethod<std::tuple<std::vector<DBusObjectPath>>,
+           std::tuple<std::vector<DBusObjectPath>, DBusObjectPath>> constexpr SecretService_Unlock{"org.freedesktop.Secret.Service", "Unlock"};
+DBusMethod<std::tuple<std::string>, std::tuple<DBusObjectPath>> constexpr SecretService_ReadAlias{"org.freedesktop.Secret.Service", "ReadAlias"};
+DBusMethod<std::tuple<std::vector<DBusObjectPath>>,
+           std::tuple<std::vector<DBusObjectPath>, DBusObjectPath>> constexpr SecretService_Lock{"org.freedesktop.Secret.Service", "Lock"};
+DBusMethod<std::tuple<std::string>, std::tuple<>> constexpr SecretPrompt_Prompt{"org.freedesktop.Secret.Prompt", "Prompt"};
+DBusMethod<std::tuple<>, std::tuple<>> constexpr SecretSession_Close{"org.freedesktop.Secret.Session", "Close"};
+/*
+  The secret returned by SecretService is a struct:
+
+    struct Secret {
+      ObjectPath session ;
+      Array<Byte> parameters ;
+      Array<Byte> value ;
+      String content_type ;
+    };
 
-  /* OPEN SESSION */
-  if (g_verbose) std::cout << "[OpenSession]" << std::endl;
-  dbuscon.callMethod("org.freedesktop.secrets",
-                     "/org/freedesktop/secrets",
-                     "org.freedesktop.Secret.Service",
-                     "OpenSession",
-                     {"plain",
-                      DBusVariant{""}});
-  std::string session_objectpath = dbuscon.get<std::string>("vo", 1);
-  if (session_objectpath.empty())
+  A struct has signature (oayays), the brackets meaning 'struct'.
+*/
+using SecretStruct = std::tuple<DBusObjectPath, std::vector<unsigned char>, std::vector<unsigned char>, std::string>;
+DBusMethod<std::tuple<DBusObjectPath>, std::tuple<SecretStruct>> constexpr SecretItem_GetSecret{"org.freedesktop.Secret.Item", "GetSecret"};
+
+// the secret's value, or an empty string if it does not look like a Chromium key
+std::string secretValue(SecretStruct const &secret)
+{
+  // we want the 'value' (the second ay);
+  std::vector<unsigned char> const &secret_bytes = std::get<2>(secret);
+  std::string value{secret_bytes.begin(), secret_bytes.end()};
+  if (!isChromiumSecret(value))
   {
-    std::cout << "Error getting session" << std::endl;
-    return;
+    LOG_DEBUG(DBus) << "Retrieved data is not a valid secret";
+    return std::string();
   }
-  if (g_verbose) std::cout << " *** Session: " << session_objectpath << std::endl;
 
-  // if constexpr (false)
-  // {
-  //   /* SEARCHITEMS */
-  //   // note searching is of no use on KDE, the secret does not seem to have any attributes set.
-  //   // so lets just get all items and inspect them
-  //   std::cout << "[SearchItems(label:Chromium Keys/Chromium Safe Storage)]" << std::endl;
-  //   dbuscon.callMethod("org.freedesktop.secrets",
-  //                      "/org/freedesktop/secrets",
-  //                      "org.freedesktop.Secret.Service",
-  //                      "SearchItems",
-  //                      {DBusDict{{"org.freedesktop.Secret.Collection.Label", "Chromium Keys/Chromium Safe Storage"},
-  //                                {"Label", "Chromium Keys/Chromium Safe Storage"}}});
-  // }
+  LOG_DEBUG(DBus) << " *** SECRET: " << g_log.secret(value);
+  return value;
+}
 
-  // if constexpr (false)
-  // {
-  //   /* GET DEFAULT COLLECTION */
-  //   // not necessary we can address the default directly (without knowing what it points to), through
-  //   // the aliases/default path...
-  //   std::cout << "[ReadAlias(default)]" << std::endl;
-  //   dbuscon.callMethod("org.freedesktop.secrets",
-  //                      "/org/freedesktop/secrets",
-  //                      "org.freedesktop.Secret.Service",
-  //                      "ReadAlias",
-  //                      {"default"});
-  // }
+bool isChromiumSecret(std::string const &secret)
+{
+  // Since the secret is always 16 bytes, in base64 encoding,
+  // its length must be [16/3]*4 + two '=' padding.
+  return secret.size() == 24 &&
+    secret[23] == '=' &&
+    secret[22] == '=';
+}
+
+bool isChromiumLabel(std::string const &label)
+{
+#if __cpp_lib_string_contains >= 202011L
+  return (label.contains("Chrome") || label.contains("Chromium")) &&
+    (label.contains("Safe Storage") || label.contains("Keys")) &&
+    (!label.contains("Control"));
+#else
+  return (label.find("Chrome") != std::string::npos || label.find("Chromium") != std::string::npos) &&
+    (label.find("Safe Storage") != std::string::npos || label.find("Keys") != std::string::npos) &&
+    (label.find("Control") == std::string::npos);
+#endif
+}
 
-  /* UNLOCK THE DEFAULT COLLECTION */
-  if (g_verbose) std::cout << "[Unlock]" << std::endl;
-  dbuscon.callMethod("org.freedesktop.secrets",
-                     "/org/freedesktop/secrets",
-                     "org.freedesktop.Secret.Service",
-                     "Unlock",
-                     std::vector<DBusArg>{DBusArray{DBusObjectPath{"/org/freedesktop/secrets/aliases/default"}}});
+// unlock a collection, prompting the user if needed. Returns false if the unlock could not be
+// requested at all, 'prompted' is set if we unlocked it (and should lock it again when done).
+// Whether the collection is actually unlocked now is for the caller to check.
+bool unlockCollection(DBusCon *dbuscon, std::string const &collection, bool *prompted)
+{
+  /* UNLOCK THE COLLECTION */
+  LOG_DEBUG(DBus) << "[Unlock]";
+  auto unlock = dbuscon->call(SecretService_Unlock,
+                              "org.freedesktop.secrets",
+                              "/org/freedesktop/secrets",
+                              {{DBusObjectPath{collection}}});
   // This returns an array of already unlocked object paths (out of the input ones) and a prompt to unlock any locked ones.
   // if no collections need unlocking, the prompt is '/';
-  std::string prompt = dbuscon.get<std::string>("aoo", 1);
-  if (prompt.empty())
+  if (!unlock)
   {
     std::cout << "Error getting prompt" << std::endl;
-    return;
+    return false;
   }
-  if (g_verbose) std::cout << " *** Prompt: " << prompt << std::endl;
+  std::string prompt = std::get<1>(*unlock).d_value;
+  LOG_DEBUG(DBus) << " *** Prompt: " << prompt;
 
-  bool unlocked_by_us = false;
   if (prompt != "/")
   {
+    g_metrics.count("backend_prompts_total");
+
     /* REGISTER FOR SIGNAL */
-    if (!dbuscon.matchSignal("member='Completed'"))
+    if (!dbuscon->matchSignal("member='Completed'"))
       std::cout << "WARN: Failed to register for prompt signal" << std::endl;
 
     /* PROMPT FOR UNLOCK */
-    if (g_verbose) std::cout << "[Prompt]" << std::endl;
-    dbuscon.callMethod("org.freedesktop.secrets",
-                       prompt.c_str(),
-                       "org.freedesktop.Secret.Prompt",
-                       "Prompt",
-                       {""}); // 'Platform specific window handle to use for showing the prompt.'
+    LOG_DEBUG(DBus) << "[Prompt]";
+    dbuscon->call(SecretPrompt_Prompt,
+                  "org.freedesktop.secrets",
+                  prompt,
+                  {""}); // 'Platform specific window handle to use for showing the prompt.'
 
     /* WAIT FOR PROMPT COMPLETED SIGNAL */
     // note, we will not even check the signal contents (dismissed/result), since we check if we're
     // unlocked next anyway...
-    if (!dbuscon.waitSignal(20, 2500, "org.freedesktop.Secret.Prompt", "Completed"))
-      if (g_verbose) std::cout << "Failed to wait for unlock prompt..." << std::endl;
+    if (!dbuscon->waitSignal(20, 2500, "org.freedesktop.Secret.Prompt", "Completed"))
+      LOG_DEBUG(DBus) << "Failed to wait for unlock prompt...";
 
-    unlocked_by_us = true;
+    *prompted = true;
   }
 
-  /* CHECK COLLECTION IS UNLOCKED NOW */
-  dbuscon.callMethod("org.freedesktop.secrets",
-                     "/org/freedesktop/secrets/aliases/default",
-                     "org.freedesktop.DBus.Properties",
-                     "Get",
-                     {"org.freedesktop.Secret.Collection", "Locked"});
-  bool islocked = dbuscon.get<bool>("v", 0, true);
-  if (islocked)
+  return true;
+}
+
+struct CollectionInfo
+{
+  std::string d_path;
+  bool d_locked = true;
+  uint64_t d_modified = 0;
+  std::vector<DBusObjectPath> d_items;
+};
+
+// get Locked, Modified and Items of all collections in one round of pipelined GetAll calls
+std::vector<CollectionInfo> getCollectionInfo(DBusCon *dbuscon, std::vector<std::string> const &collections)
+{
+  std::vector<DBusPendingReply<std::map<std::string, DBusVariantOneOf<bool, uint64_t, std::vector<DBusObjectPath>>>>> pending;
+  for (auto const &collection : collections)
+    pending.push_back(dbuscon->callAsync(DBusPropertiesGetAll<bool, uint64_t, std::vector<DBusObjectPath>>,
+                                         "org.freedesktop.secrets",
+                                         collection,
+                                         {"org.freedesktop.Secret.Collection"}));
+  std::vector<CollectionInfo> info(collections.size());
+  for (unsigned int i = 0; i < collections.size(); ++i)
   {
-    std::cout << "Failed to unlock collection" << std::endl;
-    return;
+    info[i].d_path = collections[i];
+    auto props = dbuscon->wait(&pending[i]);
+    if (!props) // if we can not read the properties, we treat it as locked
+      continue;
+    for (auto const &[name, value] : std::get<0>(*props))
+    {
+      if (name == "Locked" && value.get<bool>())
+        info[i].d_locked = *value.get<bool>();
+      else if (name == "Modified" && value.get<uint64_t>())
+        info[i].d_modified = *value.get<uint64_t>();
+      else if (name == "Items" && value.get<std::vector<DBusObjectPath>>())
+        info[i].d_items = *value.get<std::vector<DBusObjectPath>>();
+    }
+    LOG_DEBUG(DBus) << " *** Collection: " << info[i].d_path << " (" << (info[i].d_locked ? "locked" : "unlocked")
+                    << ", " << info[i].d_items.size() << " items, modified " << info[i].d_modified << ")";
   }
+  return info;
+}
+
+// get the secrets from all (unlocked) collections. Every step is done for all collections/items at
+// once, with up to 'window' calls in flight at the same time. If an item cache is passed, only
+// items not in the cache are checked, collections that have not been modified are not checked at all.
+// If itemsecrets is passed, it gets the item each secret came from (item path -> secret).
+void scanCollections(DBusCon *dbuscon, std::string const &session_objectpath,
+                     std::vector<CollectionInfo> const &collections, std::set<std::string> *secrets,
+                     ItemCache *cache, std::map<std::string, std::string> *itemsecrets = nullptr)
+{
+  unsigned int const window = 64;
 
-  /* GET ITEMS */
-  if (g_verbose) std::cout << "[GetItems]" << std::endl;
-  dbuscon.callMethod("org.freedesktop.secrets",
-                     "/org/freedesktop/secrets/aliases/default",
-                     "org.freedesktop.DBus.Properties",
-                     "Get",
-                     {"org.freedesktop.Secret.Collection", "Items"});
-  std::vector<std::string> items = dbuscon.get<std::vector<std::string>>("v", 0);
-  if (items.empty())
+  // collect candidate items, and the items we still need to check the label of
+  std::vector<std::string> matching;
+  std::map<std::string, bool> fromcache;               // collections served entirely from the cache -> gave a secret
+  std::map<std::string, std::string> cacheditems;      // item -> its collection, for those collections
+  std::map<std::string, ItemCache::Collection> update; // collections whose cache entry is rebuilt
+  std::vector<std::pair<std::string, std::string>> tocheck; // (collection, item)
+  for (auto const &c : collections)
   {
-    std::cout << "Failed to get any items" << std::endl;
-    return;
+    ItemCache::Collection const *cached = cache ? cache->get(c.d_path) : nullptr;
+    if (cached && c.d_modified != 0 && cached->d_modified == c.d_modified)
+    {
+      LOG_DEBUG(DBus) << " *** Collection unchanged, using " << cached->d_matches.size() << " cached items";
+      for (auto const &m : cached->d_matches)
+      {
+        matching.push_back(m.first);
+        cacheditems[m.first] = c.d_path;
+      }
+      fromcache[c.d_path] = false;
+      continue;
+    }
+
+    ItemCache::Collection &entry = update[c.d_path];
+    entry.d_modified = c.d_modified;
+    for (auto const &item : c.d_items)
+    {
+      if (cached && cached->d_matches.find(item.d_value) != cached->d_matches.end())
+      {
+        entry.d_matches[item.d_value] = cached->d_matches.at(item.d_value);
+        matching.push_back(item.d_value);
+      }
+      else if (cached && cached->d_seen.find(item.d_value) != cached->d_seen.end())
+        entry.d_seen.insert(item.d_value);
+      else
+        tocheck.emplace_back(c.d_path, item.d_value);
+    }
   }
-  else
-    if (g_verbose) std::cout << "Got " << items.size() << " items to check" << std::endl;
+  LOG_DEBUG(DBus) << "Got " << tocheck.size() << " items to check";
 
-  for (auto const &item : items)
+  // check labels
+  for (unsigned int start = 0; start < tocheck.size(); start += window)
   {
-    // check label
-    dbuscon.callMethod("org.freedesktop.secrets",
-                       item.c_str(),
-                       "org.freedesktop.DBus.Properties",
-                       "Get",
-                       {"org.freedesktop.Secret.Item", "Label"});
-    std::string label = dbuscon.get<std::string>("v", 0);
-    if (g_verbose) std::cout << " *** Label: " << label << std::endl;
-
-#if __cpp_lib_string_contains >= 202011L
-    if ((label.contains("Chrome") || label.contains("Chromium")) &&
-        (label.contains("Safe Storage") || label.contains("Keys")) &&
-        (!label.contains("Control")))
-#else
-    if ((label.find("Chrome") != std::string::npos || label.find("Chromium") != std::string::npos) &&
-        (label.find("Safe Storage") != std::string::npos || label.find("Keys") != std::string::npos) &&
-        (label.find("Control") == std::string::npos))
-#endif
+    std::vector<DBusPendingReply<DBusVariantOf<std::string>>> pending_labels;
+    for (unsigned int i = start; i < tocheck.size() && i < start + window; ++i)
+      pending_labels.push_back(dbuscon->callCachedAsync(DBusPropertiesGet<std::string>,
+                                                        "org.freedesktop.secrets",
+                                                        tocheck[i].second,
+                                                        {"org.freedesktop.Secret.Item", "Label"}));
+    for (unsigned int i = 0; i < pending_labels.size(); ++i)
     {
-      /* GET SECRETS */
-      if (g_verbose) std::cout << "[GetSecret]" << std::endl;
-      dbuscon.callMethod("org.freedesktop.secrets",
-                         item,
-                         "org.freedesktop.Secret.Item",
-                         "GetSecret",
-                         {DBusObjectPath{session_objectpath}});
-      /*
-        The secret returned by SecretService is a struct:
-
-          struct Secret {
-            ObjectPath session ;
-            Array<Byte> parameters ;
-            Array<Byte> value ;
-            String content_type ;
-          };
-
-        A struct has signature (oayays), the brackets meaning 'struct'. we want the 'value' (the second ay);
-      */
-      std::vector<unsigned char> secret_bytes = dbuscon.get<std::vector<unsigned char>>("(oayays)", {0, 2});
-
-      // Since the secret is always 16 bytes, in base64 encoding,
-      // its length must be [16/3]*4 + two '=' padding.
-      if (secret_bytes.size() != 24 ||
-          secret_bytes[23] != '=' ||
-          secret_bytes[22] != '=')
+      auto const &[collection, item] = tocheck[start + i];
+      auto labelreply = dbuscon->wait(&pending_labels[i]);
+      if (!labelreply)
       {
-        if (g_verbose) [[unlikely]] std::cout << "Retrieved data is not a valid secret" << std::endl;
+        update[collection].d_modified = 0; // make sure this item gets checked again next time
         continue;
       }
-
-      if (g_verbose) [[unlikely]]
+      std::string const &label = std::get<0>(*labelreply).d_value;
+      LOG_DEBUG(DBus) << " *** Label: " << label;
+      if (isChromiumLabel(label))
       {
-        std::cout << " *** SECRET: ";
-        for (auto c : secret_bytes)
-          std::cout << c;
-        std::cout << std::endl;
+        update[collection].d_matches[item] = label;
+        matching.push_back(item);
       }
-      secrets->insert(std::string{secret_bytes.begin(), secret_bytes.end()});
+      else
+        update[collection].d_seen.insert(item);
+    }
+  }
+
+  if (cache)
+    for (auto &[collection, entry] : update)
+      cache->set(collection, std::move(entry));
+
+  /* GET SECRETS */
+  LOG_DEBUG(DBus) << "[GetSecret]";
+  bool gotsecret = false;
+  std::vector<DBusPendingReply<SecretStruct>> pending_secrets;
+  for (auto const &item : matching)
+    pending_secrets.push_back(dbuscon->callCachedAsync(SecretItem_GetSecret,
+                                                       "org.freedesktop.secrets",
+                                                       item,
+                                                       {DBusObjectPath{session_objectpath}}));
+  for (unsigned int i = 0; i < pending_secrets.size(); ++i)
+  {
+    auto secretreply = dbuscon->wait(&pending_secrets[i]);
+    if (!secretreply)
+      continue;
+    std::string secret = secretValue(std::get<0>(*secretreply));
+    if (secret.empty())
+      continue;
+    secrets->insert(secret);
+    gotsecret = true;
+    if (itemsecrets)
+      (*itemsecrets)[matching[i]] = secret;
+    auto cacheditem = cacheditems.find(matching[i]);
+    if (cacheditem != cacheditems.end())
+      fromcache[cacheditem->second] = true;
+  }
+
+  // the cache should never make us miss a secret: check a collection again without it if its
+  // cached items gave no secret, or, if nothing gave a secret at all, also when it had none
+  std::vector<CollectionInfo> rescan;
+  for (auto const &c : collections)
+  {
+    auto it = fromcache.find(c.d_path);
+    if (it == fromcache.end() || it->second)
+      continue;
+    bool hadmatches = std::any_of(cacheditems.begin(), cacheditems.end(), [&c](auto const &item) { return item.second == c.d_path; });
+    if (hadmatches || !gotsecret)
+    {
+      cache->erase(c.d_path);
+      rescan.push_back(c);
     }
   }
+  if (!rescan.empty())
+  {
+    LOG_DEBUG(DBus) << "Cached items gave no secret, rescanning " << rescan.size() << " collection(s)";
+    scanCollections(dbuscon, session_objectpath, rescan, secrets, cache, itemsecrets);
+  }
+}
 
-  /* LOCK COLLECTION */
-  if (unlocked_by_us)
+// open a (plain) session and list the collections, the default one first. The calls are pipelined.
+bool openSession(DBusCon *dbuscon, std::string *session_objectpath, std::vector<std::string> *collections)
+{
+  /* OPEN SESSION, LIST COLLECTIONS, GET DEFAULT COLLECTION */
+  LOG_DEBUG(DBus) << "[OpenSession + Collections + ReadAlias(default)]";
+  auto pending_session = dbuscon->callAsync(SecretService_OpenSession,
+                                            "org.freedesktop.secrets",
+                                            "/org/freedesktop/secrets",
+                                            {"plain",
+                                             DBusVariantOf<std::string>{""}});
+  auto pending_collections = dbuscon->callAsync(DBusPropertiesGet<std::vector<DBusObjectPath>>,
+                                                "org.freedesktop.secrets",
+                                                "/org/freedesktop/secrets",
+                                                {"org.freedesktop.Secret.Service", "Collections"});
+  auto pending_default = dbuscon->callAsync(SecretService_ReadAlias,
+                                            "org.freedesktop.secrets",
+                                            "/org/freedesktop/secrets",
+                                            {"default"});
+  auto session = dbuscon->wait(&pending_session);
+  auto collectionsreply = dbuscon->wait(&pending_collections);
+  auto defaultreply = dbuscon->wait(&pending_default);
+  if (!session)
   {
-    if (g_verbose) std::cout << "[Lock]" << std::endl;
-    dbuscon.callMethod("org.freedesktop.secrets",
-                       "/org/freedesktop/secrets",
-                       "org.freedesktop.Secret.Service",
-                       "Lock",
-                       std::vector<DBusArg>{DBusArray{DBusObjectPath{"/org/freedesktop/secrets/aliases/default"}}});
+    std::cout << "Error getting session" << std::endl;
+    return false;
+  }
+  *session_objectpath = std::get<1>(*session).d_value;
+  LOG_DEBUG(DBus) << " *** Session: " << *session_objectpath;
+
+  // if constexpr (false)
+  // {
+  //   /* SEARCHITEMS */
+  //   // note searching is of no use on KDE, the secret does not seem to have any attributes set.
+  //   // so lets just get all items and inspect them
+  //   std::cout << "[SearchItems(label:Chromium Keys/Chromium Safe Storage)]" << std::endl;
+  //   DBusMethod<std::tuple<std::map<std::string, std::string>>,
+  //              std::tuple<std::vector<DBusObjectPath>, std::vector<DBusObjectPath>>> constexpr SecretService_SearchItems{"org.freedesktop.Secret.Service", "SearchItems"};
+  //   dbuscon.call(SecretService_SearchItems,
+  //                "org.freedesktop.secrets",
+  //                "/org/freedesktop/secrets",
+  //                {{{"org.freedesktop.Secret.Collection.Label", "Chromium Keys/Chromium Safe Storage"},
+  //                  {"Label", "Chromium Keys/Chromium Safe Storage"}}});
+  // }
+
+  // the default collection goes first, if we could not list the collections, we
+  // just try the default one through its alias.
+  std::string defaultcollection = defaultreply ? std::get<0>(*defaultreply).d_value : std::string();
+  if (!defaultcollection.empty() && defaultcollection != "/")
+    collections->push_back(defaultcollection);
+  if (collectionsreply)
+    for (auto const &c : std::get<0>(*collectionsreply).d_value)
+      if (c.d_value != defaultcollection)
+        collections->push_back(c.d_value);
+  if (collections->empty())
+    collections->push_back("/org/freedesktop/secrets/aliases/default");
+  LOG_DEBUG(DBus) << " *** Got " << collections->size() << " collections";
+  return true;
+}
+
+// 'works' tells whether any of the secrets found so far decrypts the key, only if none does
+// are locked collections unlocked (which prompts the user)
+void getSecret_SecretService(std::set<std::string> *secrets, std::function<bool(std::set<std::string> const &)> const &works)
+{
+  if (!secrets)
+    return;
+
+  DBusCon dbuscon;
+  if (!dbuscon.ok())
+  {
+    std::cout << "Error connecting to dbus session" << std::endl;
+    return;
+  }
+
+  std::string session_objectpath;
+  std::vector<std::string> collections;
+  if (!openSession(&dbuscon, &session_objectpath, &collections))
+    return;
+
+  ItemCache itemcache;
+  ItemCache *cache = nullptr;
+  if (!g_itemcache.empty())
+  {
+    itemcache.load(g_itemcache);
+    cache = &itemcache;
+  }
+
+  /* CHECK WHICH COLLECTIONS ARE LOCKED (AND GET THEIR ITEMS) */
+  LOG_DEBUG(DBus) << "[GetAll(Collection)]";
+  std::vector<CollectionInfo> unlocked;
+  std::vector<std::string> locked;
+  for (auto &c : getCollectionInfo(&dbuscon, collections))
+  {
+    if (c.d_locked)
+      locked.push_back(c.d_path);
+    else
+      unlocked.push_back(std::move(c));
+  }
+
+  /* SCAN UNLOCKED COLLECTIONS */
+  if (!unlocked.empty())
+    scanCollections(&dbuscon, session_objectpath, unlocked, secrets, cache);
+
+  // (Unlock hands us a prompt for a locked collection, nothing else). Skipped collections are
+  // noted even if we have candidates, those may not work.
+  if (g_noprompt && !locked.empty())
+  {
+    for (auto const &collection : locked)
+      LOG_DEBUG(DBus) << "(Not unlocking " << collection << ")";
+    if (g_promptskipped.empty())
+      g_promptskipped = "collection '" + locked.front() + "'";
+    locked.clear();
+  }
+
+  /* UNLOCK OTHERS (ONE AT A TIME) ONLY IF THAT GOT US NO WORKING SECRET */
+  // (an unlocked collection may well hold a stale copy of the item, while the default one is locked)
+  std::vector<DBusObjectPath> unlocked_by_us;
+  std::size_t checked = 0;
+  bool found = false;
+  for (auto const &collection : locked)
+  {
+    if (secrets->size() != checked)
+    {
+      checked = secrets->size();
+      found = works(*secrets);
+    }
+    if (found)
+      break;
+
+    bool prompted = false;
+    bool requested = unlockCollection(&dbuscon, collection, &prompted);
+    if (prompted)
+      unlocked_by_us.push_back(DBusObjectPath{collection});
+    if (!requested)
+      continue;
+
+    /* CHECK COLLECTION IS UNLOCKED NOW */
+    std::vector<CollectionInfo> info = getCollectionInfo(&dbuscon, {collection});
+    if (info[0].d_locked)
+    {
+      std::cout << "Failed to unlock collection" << std::endl;
+      continue;
+    }
+    scanCollections(&dbuscon, session_objectpath, info, secrets, cache);
+  }
+
+  if (cache)
+    cache->save(g_itemcache);
+
+  /* LOCK COLLECTIONS */
+  if (!unlocked_by_us.empty())
+  {
+    LOG_DEBUG(DBus) << "[Lock]";
+    dbuscon.send(SecretService_Lock,
+                 "org.freedesktop.secrets",
+                 "/org/freedesktop/secrets",
+                 {unlocked_by_us});
   }
 
   /* CLOSE SESSION */
-  if (g_verbose) std::cout << "[Close]" << std::endl;
-  dbuscon.callMethod("org.freedesktop.secrets",
-                     session_objectpath.c_str(), //"/org/freedesktop/secrets",
-                     "org.freedesktop.Secret.Session",
-                     "Close");
+  LOG_DEBUG(DBus) << "[Close]";
+  dbuscon.send(SecretSession_Close,
+               "org.freedesktop.secrets",
+               session_objectpath); //"/org/freedesktop/secrets",
+
+}
+
+// the secret of a single item, if its label marks it as a Chromium key (else an empty string)
+std::string getItemSecret(DBusCon *dbuscon, std::string const &session_objectpath, std::string const &item)
+{
+  auto labelreply = dbuscon->call(DBusPropertiesGet<std::string>,
+                                  "org.freedesktop.secrets",
+                                  item,
+                                  {"org.freedesktop.Secret.Item", "Label"});
+  if (!labelreply)
+    return std::string();
+  std::string const &label = std::get<0>(*labelreply).d_value;
+  LOG_DEBUG(DBus) << " *** Label: " << label;
+  if (!isChromiumLabel(label))
+    return std::string();
+
+  LOG_DEBUG(DBus) << "[GetSecret]";
+  auto secretreply = dbuscon->call(SecretItem_GetSecret,
+                                   "org.freedesktop.secrets",
+                                   item,
+                                   {DBusObjectPath{session_objectpath}});
+  if (!secretreply)
+    return std::string();
+  return secretValue(std::get<0>(*secretreply));
+}
+
+namespace
+{
+  volatile std::sig_atomic_t s_stopwatching = 0;
+  void stopWatching(int)
+  {
+    s_stopwatching = 1;
+  }
+}
+
+/*
+  Keeps the candidate secrets up to date for as long as we run (see --watch). Instead of
+  rescanning, this subscribes to the ItemCreated, ItemChanged and ItemDeleted signals of each
+  collection (the rules are scoped to the collection's path), and only looks at the item a signal
+  is about. 'changed' is called with the new set of candidates whenever it changes, watching stops
+  when it returns false, when the connection is lost, when the deadline passes or on SIGINT/SIGTERM
+  (so the session is still closed).
+
+  Locked collections are not unlocked for this (we never prompt in the background), changes to
+  them are picked up once something else unlocks them.
+*/
+void watchSecret_SecretService(std::function<bool(std::set<std::string> const &)> const &changed)
+{
+  DBusCon dbuscon;
+  if (!dbuscon.ok())
+  {
+    std::cout << "Error connecting to dbus session" << std::endl;
+    return;
+  }
+
+  std::string session_objectpath;
+  std::vector<std::string> collections;
+  if (!openSession(&dbuscon, &session_objectpath, &collections))
+    return;
+
+  // subscribe before the initial scan, so no change in between is missed
+  for (auto const &collection : collections)
+    if (!dbuscon.matchSignal("type='signal',interface='org.freedesktop.Secret.Collection',path='" + collection + "'"))
+      std::cout << "WARN: Failed to register for item signals on " << collection << std::endl;
+
+  std::vector<CollectionInfo> unlocked;
+  for (auto &c : getCollectionInfo(&dbuscon, collections))
+    if (!c.d_locked)
+      unlocked.push_back(std::move(c));
+  std::set<std::string> secrets;
+  std::map<std::string, std::string> candidates; // item path -> secret
+  scanCollections(&dbuscon, session_objectpath, unlocked, &secrets, nullptr, &candidates);
+  LOG_DEBUG(DBus) << "(Watching " << collections.size() << " collections, " << candidates.size() << " candidate items)";
+  g_log.flush();
+
+  // (no SA_RESTART: the signal interrupts the wait in nextSignal())
+  struct sigaction stop = {}, oldint, oldterm;
+  stop.sa_handler = stopWatching;
+  sigaction(SIGINT, &stop, &oldint);
+  sigaction(SIGTERM, &stop, &oldterm);
 
+  while (!s_stopwatching && dbuscon.connected() && !deadlineExpired("watch"))
+  {
+    DBusReply signal = dbuscon.nextSignal(5000, "org.freedesktop.Secret.Collection");
+    auto item = signal.as<DBusObjectPath>();
+    if (!item)
+      continue;
+    std::string const &path = std::get<0>(*item).d_value;
+    std::string member = signal.member();
+
+    bool update = false;
+    if (member == "ItemDeleted")
+      update = candidates.erase(path) > 0;
+    else if (member == "ItemCreated" || member == "ItemChanged")
+    {
+      std::string secret = getItemSecret(&dbuscon, session_objectpath, path);
+      if (secret.empty())
+        update = candidates.erase(path) > 0;
+      else if (candidates[path] != secret)
+      {
+        candidates[path] = secret;
+        update = true;
+      }
+    }
+    if (!update)
+      continue;
+
+    LOG_DEBUG(DBus) << "(Candidates changed, " << candidates.size() << " candidate items)";
+    secrets.clear();
+    for (auto const &c : candidates)
+      secrets.insert(c.second);
+    if (!changed(secrets))
+      break;
+    g_log.flush();
+  }
+  sigaction(SIGINT, &oldint, nullptr);
+  sigaction(SIGTERM, &oldterm, nullptr);
+
+  /* CLOSE SESSION */
+  LOG_DEBUG(DBus) << "[Close]";
+  dbuscon.send(SecretSession_Close,
+               "org.freedesktop.secrets",
+               session_objectpath);
 }
@@ -20,6 +20,15 @@
 #ifndef GLOBALS_H_
 #define GLOBALS_H_
 
-extern bool g_verbose;
+#include <chrono>
+#include <string>
+
+extern bool g_nativedbus;
+extern bool g_hasdeadline;
+extern std::chrono::steady_clock::time_point g_deadline;
+extern std::string g_deadlinestage;
+extern std::string g_itemcache;
+extern bool g_noprompt;
+extern std::string g_promptskipped;
 
 #endif
@@ -0,0 +1,187 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ITEMCACHE_H_
+#define ITEMCACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "atomicfile.h"
+#include "globals.h"
+#include "log.h"
+
+/*
+  On-disk index of Secret Service items (see --item-cache=<path>). For every collection it
+  holds the collection's Modified timestamp, the items whose label matched (path + label) and
+  the paths of all other items that were checked. It never holds any secret.
+
+  The file is plain text, one record per line:
+
+    collection <path> <modified>
+    match <itempath> <label>
+    seen <itempath>
+
+  'match' and 'seen' lines belong to the 'collection' line above them. In labels, newlines are
+  written as '\n' (and backslashes as '\\').
+*/
+class ItemCache
+{
+ public:
+  struct Collection
+  {
+    uint64_t d_modified = 0;
+    std::map<std::string, std::string> d_matches; // item path -> label
+    std::set<std::string> d_seen;                 // non-matching item paths
+  };
+
+ private:
+  std::map<std::string, Collection> d_collections;
+  bool d_changed = false;
+
+ public:
+  inline bool load(std::string const &filename);
+  inline bool save(std::string const &filename);
+
+  // cached entry for collection, nullptr if there is none
+  inline Collection const *get(std::string const &collection) const;
+  inline void set(std::string const &collection, Collection &&entry);
+  inline void erase(std::string const &collection);
+
+ private:
+  inline static std::string escape(std::string const &label);
+  inline static std::string unescape(std::string const &label);
+};
+
+inline bool ItemCache::load(std::string const &filename)
+{
+  std::ifstream file(filename);
+  if (!file.is_open())
+  {
+    LOG_DEBUG(Config) << "(No item cache at '" << filename << "')";
+    return false;
+  }
+
+  d_collections.clear();
+  Collection *current = nullptr;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream record(line);
+    std::string type, path;
+    if (!(record >> type >> path))
+      continue;
+    if (type == "collection")
+    {
+      current = &d_collections[path];
+      if (!(record >> current->d_modified))
+        current->d_modified = 0; // never matches, so the collection is rescanned
+    }
+    else if (current && type == "match")
+    {
+      std::string label;
+      record.get(); // the separating space
+      std::getline(record, label);
+      current->d_matches[path] = unescape(label);
+    }
+    else if (current && type == "seen")
+      current->d_seen.insert(path);
+  }
+  LOG_DEBUG(Config) << "(Loaded item cache for " << d_collections.size() << " collections)";
+  d_changed = false;
+  return true;
+}
+
+inline bool ItemCache::save(std::string const &filename)
+{
+  if (!d_changed)
+    return true;
+
+  // (see writeFileAtomically(), a concurrent run never reads a half-written cache)
+  std::ostringstream file;
+  for (auto const &[path, c] : d_collections)
+  {
+    file << "collection " << path << " " << c.d_modified << "\n";
+    for (auto const &[item, label] : c.d_matches)
+      file << "match " << item << " " << escape(label) << "\n";
+    for (auto const &item : c.d_seen)
+      file << "seen " << item << "\n";
+  }
+  if (!writeFileAtomically(filename, file.str(), 0600))
+  {
+    std::cout << "Failed to write item cache '" << filename << "'" << std::endl;
+    return false;
+  }
+  d_changed = false;
+  return true;
+}
+
+inline ItemCache::Collection const *ItemCache::get(std::string const &collection) const
+{
+  auto it = d_collections.find(collection);
+  return it == d_collections.end() ? nullptr : &it->second;
+}
+
+inline void ItemCache::set(std::string const &collection, Collection &&entry)
+{
+  d_collections[collection] = std::move(entry);
+  d_changed = true;
+}
+
+inline void ItemCache::erase(std::string const &collection)
+{
+  if (d_collections.erase(collection))
+    d_changed = true;
+}
+
+inline std::string ItemCache::escape(std::string const &label)
+{
+  std::string escaped;
+  for (char c : label)
+  {
+    if (c == '\\')
+      escaped += "\\\\";
+    else if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+inline std::string ItemCache::unescape(std::string const &label)
+{
+  std::string unescaped;
+  for (unsigned int i = 0; i < label.size(); ++i)
+  {
+    if (label[i] == '\\' && i + 1 < label.size())
+      unescaped += (label[++i] == 'n') ? '\n' : label[i];
+    else
+      unescaped += label[i];
+  }
+  return unescaped;
+}
+
+#endif
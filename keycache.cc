@@ -0,0 +1,117 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <openssl/evp.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <memory>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/keyctl.h>
+
+/*
+  The decrypted key is cached in the kernel's session keyring (see keyrings(7)), as a 'user' key
+  that expires after the given timeout. It never touches the filesystem.
+
+  The key's description is derived from a hash of the (absolute) config file path and the
+  encrypted key, so a changed encryptedKey simply never finds the old entry (which then expires).
+*/
+namespace
+{
+  std::string keyCacheDescription(std::string const &configfile, std::string const &encrypted_key)
+  {
+    std::unique_ptr<char, decltype(&::free)> abspath(realpath(configfile.c_str(), nullptr), &::free);
+    std::string input(abspath ? abspath.get() : configfile);
+    input += '\0';
+    input += encrypted_key;
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestlength = 0;
+    if (EVP_Digest(input.data(), input.size(), digest, &digestlength, EVP_sha256(), nullptr) != 1)
+      return std::string();
+
+    std::ostringstream description;
+    description << "get_signal_desktop_key:" << std::hex << std::setfill('0');
+    for (unsigned int i = 0; i < digestlength; ++i)
+      description << std::setw(2) << static_cast<int>(digest[i]);
+    return description.str();
+  }
+}
+
+bool keyCacheLookup(std::string const &configfile, std::string const &encrypted_key, std::string *key)
+{
+  std::string description = keyCacheDescription(configfile, encrypted_key);
+  if (description.empty())
+    return false;
+
+  long id = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING, "user", description.c_str(), 0);
+  if (id < 0)
+  {
+    LOG_DEBUG(Crypto) << "(Key not in kernel keyring)";
+    return false;
+  }
+
+  char buffer[256];
+  long size = syscall(SYS_keyctl, KEYCTL_READ, id, buffer, sizeof(buffer));
+  if (size <= 0 || size > static_cast<long>(sizeof(buffer)))
+  {
+    LOG_DEBUG(Crypto) << "(Failed to read key from kernel keyring)";
+    return false;
+  }
+  key->assign(buffer, size);
+  LOG_DEBUG(Crypto) << "(Got key from kernel keyring)";
+  return true;
+}
+
+bool keyCacheStore(std::string const &configfile, std::string const &encrypted_key, std::string const &key, unsigned int timeout)
+{
+  std::string description = keyCacheDescription(configfile, encrypted_key);
+  if (description.empty())
+    return false;
+
+  // resolve the session keyring without creating one: a process that has none (eg. not started
+  // from a login session) searches the user-session keyring instead, so we store the key there.
+  long keyring = syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID, KEY_SPEC_SESSION_KEYRING, 0);
+  if (keyring < 0)
+  {
+    std::cout << "Failed to find session keyring" << std::endl;
+    return false;
+  }
+
+  // adding a key with an existing description replaces (updates) it
+  long id = syscall(SYS_add_key, "user", description.c_str(), key.data(), key.size(), keyring);
+  if (id < 0)
+  {
+    std::cout << "Failed to store key in kernel keyring" << std::endl;
+    return false;
+  }
+  if (syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id, timeout) < 0)
+  {
+    // never leave a key without its expiry behind
+    std::cout << "Failed to set timeout on cached key" << std::endl;
+    syscall(SYS_keyctl, KEYCTL_INVALIDATE, id);
+    return false;
+  }
+  LOG_DEBUG(Crypto) << "(Stored key in kernel keyring for " << timeout << " seconds)";
+  return true;
+}
@@ -0,0 +1,113 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef KEYRINGREADER_H_
+#define KEYRINGREADER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/*
+  Reads the big endian integers and length-prefixed strings that keyring files are made of
+  (gnome-keyring's .keyring and KWallet's .kwl, which is a Qt QDataStream). A string is a
+  uint32 length followed by that many bytes, a length of 0xffffffff means 'null'.
+
+  Reading past the end makes the reader !ok(), after which everything reads as 0 or empty, so
+  a whole record can be read before checking.
+*/
+class KeyringReader
+{
+  unsigned char const *d_data;
+  std::size_t d_size;
+  std::size_t d_pos;
+  bool d_ok;
+
+ public:
+  inline KeyringReader(unsigned char const *data, std::size_t size, std::size_t pos = 0);
+  inline bool ok() const;
+  inline bool atEnd() const;
+  inline std::size_t pos() const;
+  inline unsigned char const *bytes(std::size_t n);
+  inline uint32_t uint32();
+  inline std::string string();
+};
+
+inline bool readKeyringFile(std::string const &filename, std::vector<unsigned char> *data)
+{
+  std::ifstream file(filename, std::ios_base::binary);
+  if (!file.is_open())
+    return false;
+  data->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+inline KeyringReader::KeyringReader(unsigned char const *data, std::size_t size, std::size_t pos)
+  :
+  d_data(data),
+  d_size(size),
+  d_pos(pos),
+  d_ok(pos <= size)
+{}
+
+inline bool KeyringReader::ok() const
+{
+  return d_ok;
+}
+
+inline bool KeyringReader::atEnd() const
+{
+  return !d_ok || d_pos == d_size;
+}
+
+inline std::size_t KeyringReader::pos() const
+{
+  return d_pos;
+}
+
+inline unsigned char const *KeyringReader::bytes(std::size_t n)
+{
+  if (!d_ok || n > d_size - d_pos)
+  {
+    d_ok = false;
+    return nullptr;
+  }
+  d_pos += n;
+  return d_data + d_pos - n;
+}
+
+inline uint32_t KeyringReader::uint32()
+{
+  unsigned char const *b = bytes(4);
+  return b ? (uint32_t{b[0]} << 24) | (uint32_t{b[1]} << 16) | (uint32_t{b[2]} << 8) | b[3] : 0;
+}
+
+inline std::string KeyringReader::string()
+{
+  uint32_t length = uint32();
+  if (length == 0xffffffff)
+    return std::string();
+  unsigned char const *b = bytes(length);
+  return b ? std::string(reinterpret_cast<char const *>(b), length) : std::string();
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAZYLIB_H_
+#define LAZYLIB_H_
+
+#include <dlfcn.h>
+#include <cstdlib>
+#include <iostream>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+#include "globals.h"
+#include "log.h"
+
+/*
+  A shared library that is only loaded (dlopen) when the first of its functions is called
+  (see libdbus_shim.cc and libcrypto_shim.cc, only built with -DLAZY_LOAD_LIBS). If the
+  library or a symbol can not be found, there is nothing we can do but exit.
+*/
+class LazyLib
+{
+  std::vector<char const *> d_sonames;
+  void *d_handle;
+  std::once_flag d_once;
+
+ public:
+  inline explicit LazyLib(std::initializer_list<char const *> sonames);
+  template <typename F>
+  inline F sym(char const *name);
+
+ private:
+  inline void load();
+};
+
+inline LazyLib::LazyLib(std::initializer_list<char const *> sonames)
+  :
+  d_sonames(sonames),
+  d_handle(nullptr)
+{}
+
+inline void LazyLib::load()
+{
+  for (char const *soname : d_sonames)
+  {
+    d_handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL);
+    if (d_handle)
+    {
+      LOG_DEBUG(General) << "(Loaded " << soname << ")";
+      return;
+    }
+  }
+  std::cout << "Failed to load " << d_sonames.front() << ": " << dlerror() << std::endl;
+  std::exit(1);
+}
+
+template <typename F>
+inline F LazyLib::sym(char const *name)
+{
+  std::call_once(d_once, &LazyLib::load, this);
+  void *s = dlsym(d_handle, name);
+  if (!s)
+  {
+    std::cout << "Failed to find symbol '" << name << "': " << dlerror() << std::endl;
+    std::exit(1);
+  }
+  return reinterpret_cast<F>(s);
+}
+
+// defines a function with the signature declared in the library's header, which calls the
+// library's own implementation (looked up on the first call)
+#define LAZYLIB_FORWARD(lib, ret, name, params, args)         \
+  extern "C" ret name params                                   \
+  {                                                            \
+    static auto const fn = lib.sym<decltype(&::name)>(#name);  \
+    return fn args;                                            \
+  }
+
+#endif
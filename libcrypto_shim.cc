@@ -0,0 +1,72 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+  With -DLAZY_LOAD_LIBS the program is not linked against libcrypto, instead the functions it
+  uses are defined here and forwarded to the library, which is loaded on the first call.
+*/
+
+#ifdef LAZY_LOAD_LIBS
+
+// (the Blowfish functions are deprecated since OpenSSL 3.0, see getsecret_kwalletfile.cc)
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include "lazylib.h"
+
+#include <openssl/blowfish.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+
+namespace
+{
+  LazyLib libcrypto({"libcrypto.so.3", "libcrypto.so.1.1", "libcrypto.so"});
+}
+
+#define CRYPTO_FORWARD(ret, name, params, args) LAZYLIB_FORWARD(libcrypto, ret, name, params, args)
+
+CRYPTO_FORWARD(void, BF_set_key, (BF_KEY *key, int len, unsigned char const *data), (key, len, data))
+CRYPTO_FORWARD(void, BF_decrypt, (BF_LONG *data, BF_KEY const *key), (data, key))
+CRYPTO_FORWARD(EVP_CIPHER_CTX *, EVP_CIPHER_CTX_new, (void), ())
+CRYPTO_FORWARD(void, EVP_CIPHER_CTX_free, (EVP_CIPHER_CTX *c), (c))
+CRYPTO_FORWARD(int, EVP_CIPHER_CTX_set_padding, (EVP_CIPHER_CTX *c, int pad), (c, pad))
+CRYPTO_FORWARD(int, EVP_DecryptInit_ex, (EVP_CIPHER_CTX *ctx, EVP_CIPHER const *cipher, ENGINE *impl, unsigned char const *key, unsigned char const *iv),
+               (ctx, cipher, impl, key, iv))
+CRYPTO_FORWARD(int, EVP_DecryptUpdate, (EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl, unsigned char const *in, int inl), (ctx, out, outl, in, inl))
+CRYPTO_FORWARD(int, EVP_DecryptFinal_ex, (EVP_CIPHER_CTX *ctx, unsigned char *outm, int *outl), (ctx, outm, outl))
+CRYPTO_FORWARD(int, EVP_Digest, (void const *data, size_t count, unsigned char *md, unsigned int *size, EVP_MD const *type, ENGINE *impl),
+               (data, count, md, size, type, impl))
+CRYPTO_FORWARD(int, EVP_BytesToKey, (EVP_CIPHER const *type, EVP_MD const *md, unsigned char const *salt, unsigned char const *data, int datal,
+                                     int count, unsigned char *key, unsigned char *iv),
+               (type, md, salt, data, datal, count, key, iv))
+CRYPTO_FORWARD(EVP_CIPHER const *, EVP_aes_128_cbc, (void), ())
+CRYPTO_FORWARD(EVP_MD const *, EVP_md5, (void), ())
+CRYPTO_FORWARD(EVP_MD const *, EVP_sha256, (void), ())
+CRYPTO_FORWARD(EVP_MD const *, EVP_sha512, (void), ())
+CRYPTO_FORWARD(EVP_MD const *, EVP_sha1, (void), ())
+CRYPTO_FORWARD(unsigned char *, HMAC, (EVP_MD const *evp_md, void const *key, int key_len, unsigned char const *data, size_t data_len, unsigned char *md, unsigned int *md_len),
+               (evp_md, key, key_len, data, data_len, md, md_len))
+CRYPTO_FORWARD(int, CRYPTO_memcmp, (void const *in_a, void const *in_b, size_t len), (in_a, in_b, len))
+CRYPTO_FORWARD(void, OPENSSL_cleanse, (void *ptr, size_t len), (ptr, len))
+CRYPTO_FORWARD(int, PKCS5_PBKDF2_HMAC, (char const *pass, int passlen, unsigned char const *salt, int saltlen, int iter, EVP_MD const *digest, int keylen, unsigned char *out),
+               (pass, passlen, salt, saltlen, iter, digest, keylen, out))
+CRYPTO_FORWARD(int, PKCS5_PBKDF2_HMAC_SHA1, (char const *pass, int passlen, unsigned char const *salt, int saltlen, int iter, int keylen, unsigned char *out),
+               (pass, passlen, salt, saltlen, iter, keylen, out))
+
+#endif
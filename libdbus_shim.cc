@@ -0,0 +1,116 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+  With -DLAZY_LOAD_LIBS the program is not linked against libdbus-1, instead the functions it
+  uses are defined here and forwarded to the library, which is loaded on the first call.
+*/
+
+#ifdef LAZY_LOAD_LIBS
+
+#include "lazylib.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <dbus/dbus.h>
+
+namespace
+{
+  LazyLib libdbus({"libdbus-1.so.3", "libdbus-1.so"});
+}
+
+#define DBUS_FORWARD(ret, name, params, args) LAZYLIB_FORWARD(libdbus, ret, name, params, args)
+
+DBUS_FORWARD(void, dbus_bus_add_match, (DBusConnection *connection, char const *rule, DBusError *error), (connection, rule, error))
+DBUS_FORWARD(DBusConnection *, dbus_bus_get_private, (DBusBusType type, DBusError *error), (type, error))
+DBUS_FORWARD(void, dbus_connection_close, (DBusConnection *connection), (connection))
+DBUS_FORWARD(void, dbus_connection_flush, (DBusConnection *connection), (connection))
+DBUS_FORWARD(DBusDispatchStatus, dbus_connection_get_dispatch_status, (DBusConnection *connection), (connection))
+DBUS_FORWARD(dbus_bool_t, dbus_connection_get_is_connected, (DBusConnection *connection), (connection))
+DBUS_FORWARD(DBusMessage *, dbus_connection_pop_message, (DBusConnection *connection), (connection))
+DBUS_FORWARD(dbus_bool_t, dbus_connection_read_write, (DBusConnection *connection, int timeout_milliseconds), (connection, timeout_milliseconds))
+DBUS_FORWARD(dbus_bool_t, dbus_connection_send, (DBusConnection *connection, DBusMessage *message, dbus_uint32_t *client_serial), (connection, message, client_serial))
+DBUS_FORWARD(dbus_bool_t, dbus_connection_send_with_reply, (DBusConnection *connection, DBusMessage *message, DBusPendingCall **pending_return, int timeout_milliseconds),
+             (connection, message, pending_return, timeout_milliseconds))
+DBUS_FORWARD(DBusMessage *, dbus_connection_send_with_reply_and_block, (DBusConnection *connection, DBusMessage *message, int timeout_milliseconds, DBusError *error),
+             (connection, message, timeout_milliseconds, error))
+DBUS_FORWARD(void, dbus_connection_unref, (DBusConnection *connection), (connection))
+DBUS_FORWARD(void, dbus_error_free, (DBusError *error), (error))
+DBUS_FORWARD(dbus_bool_t, dbus_error_has_name, (DBusError const *error, char const *name), (error, name))
+DBUS_FORWARD(void, dbus_error_init, (DBusError *error), (error))
+DBUS_FORWARD(dbus_bool_t, dbus_error_is_set, (DBusError const *error), (error))
+DBUS_FORWARD(void, dbus_free, (void *memory), (memory))
+DBUS_FORWARD(DBusMessage *, dbus_message_copy, (DBusMessage const *message), (message))
+DBUS_FORWARD(DBusMessage *, dbus_message_demarshal, (char const *str, int len, DBusError *error), (str, len, error))
+DBUS_FORWARD(char const *, dbus_message_get_destination, (DBusMessage *message), (message))
+DBUS_FORWARD(char const *, dbus_message_get_interface, (DBusMessage *message), (message))
+DBUS_FORWARD(char const *, dbus_message_get_member, (DBusMessage *message), (message))
+DBUS_FORWARD(char const *, dbus_message_get_path, (DBusMessage *message), (message))
+DBUS_FORWARD(dbus_uint32_t, dbus_message_get_serial, (DBusMessage *message), (message))
+DBUS_FORWARD(dbus_uint32_t, dbus_message_get_reply_serial, (DBusMessage *message), (message))
+DBUS_FORWARD(char const *, dbus_message_get_sender, (DBusMessage *message), (message))
+DBUS_FORWARD(char const *, dbus_message_get_signature, (DBusMessage *message), (message))
+DBUS_FORWARD(int, dbus_message_get_type, (DBusMessage *message), (message))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_append_basic, (DBusMessageIter *iter, int type, void const *value), (iter, type, value))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_append_fixed_array, (DBusMessageIter *iter, int element_type, void const *value, int n_elements),
+             (iter, element_type, value, n_elements))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_close_container, (DBusMessageIter *iter, DBusMessageIter *sub), (iter, sub))
+DBUS_FORWARD(int, dbus_message_iter_get_arg_type, (DBusMessageIter *iter), (iter))
+DBUS_FORWARD(void, dbus_message_iter_get_basic, (DBusMessageIter *iter, void *value), (iter, value))
+DBUS_FORWARD(int, dbus_message_iter_get_element_count, (DBusMessageIter *iter), (iter))
+DBUS_FORWARD(int, dbus_message_iter_get_element_type, (DBusMessageIter *iter), (iter))
+DBUS_FORWARD(void, dbus_message_iter_get_fixed_array, (DBusMessageIter *iter, void *value, int *n_elements), (iter, value, n_elements))
+DBUS_FORWARD(char *, dbus_message_iter_get_signature, (DBusMessageIter *iter), (iter))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_init, (DBusMessage *message, DBusMessageIter *iter), (message, iter))
+DBUS_FORWARD(void, dbus_message_iter_init_append, (DBusMessage *message, DBusMessageIter *iter), (message, iter))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_next, (DBusMessageIter *iter), (iter))
+DBUS_FORWARD(dbus_bool_t, dbus_message_iter_open_container, (DBusMessageIter *iter, int type, char const *contained_signature, DBusMessageIter *sub),
+             (iter, type, contained_signature, sub))
+DBUS_FORWARD(void, dbus_message_iter_recurse, (DBusMessageIter *iter, DBusMessageIter *sub), (iter, sub))
+DBUS_FORWARD(dbus_bool_t, dbus_message_marshal, (DBusMessage *msg, char **marshalled_data_p, int *len_p), (msg, marshalled_data_p, len_p))
+DBUS_FORWARD(DBusMessage *, dbus_message_new, (int message_type), (message_type))
+DBUS_FORWARD(DBusMessage *, dbus_message_new_method_call, (char const *bus_name, char const *path, char const *iface, char const *method),
+             (bus_name, path, iface, method))
+DBUS_FORWARD(void, dbus_message_set_no_reply, (DBusMessage *message, dbus_bool_t no_reply), (message, no_reply))
+DBUS_FORWARD(dbus_bool_t, dbus_message_set_reply_serial, (DBusMessage *message, dbus_uint32_t reply_serial), (message, reply_serial))
+DBUS_FORWARD(dbus_bool_t, dbus_message_set_path, (DBusMessage *message, char const *object_path), (message, object_path))
+DBUS_FORWARD(void, dbus_message_set_serial, (DBusMessage *message, dbus_uint32_t serial), (message, serial))
+DBUS_FORWARD(void, dbus_message_unref, (DBusMessage *message), (message))
+DBUS_FORWARD(void, dbus_pending_call_block, (DBusPendingCall *pending), (pending))
+DBUS_FORWARD(DBusMessage *, dbus_pending_call_steal_reply, (DBusPendingCall *pending), (pending))
+DBUS_FORWARD(void, dbus_pending_call_unref, (DBusPendingCall *pending), (pending))
+DBUS_FORWARD(dbus_bool_t, dbus_type_is_basic, (int typecode), (typecode))
+DBUS_FORWARD(dbus_bool_t, dbus_set_error_from_message, (DBusError *error, DBusMessage *message), (error, message))
+
+// (there is no va_list version of this one, so the message is formatted here)
+extern "C" void dbus_set_error(DBusError *error, char const *name, char const *format, ...)
+{
+  static auto const fn = libdbus.sym<decltype(&::dbus_set_error)>("dbus_set_error");
+  char message[512] = {};
+  if (format)
+  {
+    va_list var_args;
+    va_start(var_args, format);
+    std::vsnprintf(message, sizeof(message), format, var_args);
+    va_end(var_args);
+  }
+  fn(error, name, "%s", message);
+}
+
+#endif
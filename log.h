@@ -0,0 +1,199 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+/*
+  Diagnostic output (see -v, -vv, --log=<categories> and --log-secrets).
+
+  Messages have a level (debug, or the much noisier trace, eg. every dbus reply in full) and
+  a category. They are collected in memory and written to stderr in one go: when the program
+  ends, when the buffer gets large, and right before we block waiting on the user (eg. for an
+  unlock prompt), so nothing on the dbus path ever waits for the terminal.
+
+  Building with -DNO_TRACE_LOGGING removes the trace level entirely (its messages are never
+  formatted and the code is dropped by the compiler).
+
+  Secrets, derived keys and decrypted data are only ever logged through Log::secret(), which
+  replaces them with their length unless --log-secrets was given.
+*/
+enum class LogLevel
+{
+  Off = 0,
+  Debug,
+  Trace,
+};
+
+enum class LogCategory
+{
+  General = 0,
+  DBus,
+  Crypto,
+  Config,
+};
+
+class Log
+{
+  static constexpr std::size_t s_flushsize = 64 * 1024;
+  std::string d_buffer;
+  LogLevel d_level;
+  unsigned int d_categories; // bit per LogCategory
+  bool d_secrets;
+
+ public:
+  inline Log();
+  inline ~Log();
+  inline void setLevel(LogLevel level);
+  inline bool setCategories(std::string const &list);
+  inline void allowSecrets(bool allow);
+  inline bool secretsAllowed() const;
+  inline bool enabled(LogLevel level, LogCategory category) const;
+  inline void append(std::string const &message);
+  inline void flush();
+
+  inline std::string secret(std::string const &value) const;
+  inline static std::string redacted(std::size_t size);
+};
+
+// one message, added to the log when it goes out of scope
+class LogMessage
+{
+  std::ostringstream d_stream;
+ public:
+  inline ~LogMessage();
+  inline std::ostream &stream();
+};
+
+// turns 'LogVoid() & stream << ...' into a void expression, so LOG() can be a conditional
+// expression instead of an if statement (which would steal the 'else' of an enclosing if)
+struct LogVoid
+{
+  void operator&(std::ostream &) {}
+};
+
+extern Log g_log;
+
+// usage: LOG_DEBUG(DBus) << "message"; (nothing after LOG_DEBUG() is evaluated if not enabled)
+#define LOG_ENABLED(level, category) g_log.enabled(LogLevel::level, LogCategory::category)
+#define LOG(level, category) !LOG_ENABLED(level, category) ? (void)0 : LogVoid() & LogMessage().stream()
+#define LOG_DEBUG(category) LOG(Debug, category)
+#ifdef NO_TRACE_LOGGING
+#define LOG_TRACE_ENABLED(category) false
+#define LOG_TRACE(category) true ? (void)0 : LogVoid() & LogMessage().stream()
+#else
+#define LOG_TRACE_ENABLED(category) LOG_ENABLED(Trace, category)
+#define LOG_TRACE(category) LOG(Trace, category)
+#endif
+
+inline Log::Log()
+  :
+  d_level(LogLevel::Off),
+  d_categories(~0u),
+  d_secrets(false)
+{}
+
+inline Log::~Log()
+{
+  flush();
+}
+
+inline void Log::setLevel(LogLevel level)
+{
+  d_level = level;
+}
+
+// comma separated: general, dbus, crypto, config
+inline bool Log::setCategories(std::string const &list)
+{
+  static char const *const names[] = {"general", "dbus", "crypto", "config"};
+  unsigned int categories = 0;
+  std::istringstream s(list);
+  std::string name;
+  while (std::getline(s, name, ','))
+  {
+    unsigned int i = 0;
+    while (i < sizeof(names) / sizeof(names[0]) && name != names[i])
+      ++i;
+    if (i == sizeof(names) / sizeof(names[0]))
+      return false;
+    categories |= 1u << i;
+  }
+  d_categories = categories;
+  return true;
+}
+
+inline void Log::allowSecrets(bool allow)
+{
+  d_secrets = allow;
+}
+
+inline bool Log::secretsAllowed() const
+{
+  return d_secrets;
+}
+
+inline bool Log::enabled(LogLevel level, LogCategory category) const
+{
+  return level <= d_level && (d_categories & (1u << static_cast<int>(category)));
+}
+
+inline void Log::append(std::string const &message)
+{
+  d_buffer += message;
+  if (message.empty() || message.back() != '\n')
+    d_buffer += '\n';
+  if (d_buffer.size() >= s_flushsize)
+    flush();
+}
+
+inline void Log::flush()
+{
+  if (d_buffer.empty())
+    return;
+  std::fwrite(d_buffer.data(), 1, d_buffer.size(), stderr);
+  std::fflush(stderr);
+  d_buffer.clear();
+}
+
+inline std::string Log::secret(std::string const &value) const
+{
+  return d_secrets ? value : redacted(value.size());
+}
+
+inline std::string Log::redacted(std::size_t size)
+{
+  return "<redacted, " + std::to_string(size) + " bytes>";
+}
+
+inline LogMessage::~LogMessage()
+{
+  g_log.append(d_stream.str());
+}
+
+inline std::ostream &LogMessage::stream()
+{
+  return d_stream;
+}
+
+#endif
@@ -19,87 +19,378 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <sysexits.h>
+#include <unistd.h>
 
 #include "main.h"
 #include "dbuscon.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "bench.h"
+#include "dbustranscript.h"
 
-bool g_verbose;
+Log g_log;
+bool g_nativedbus;
+bool g_hasdeadline;
+std::chrono::steady_clock::time_point g_deadline;
+std::string g_deadlinestage;
+std::string g_itemcache;
+bool g_noprompt;
+std::string g_promptskipped;
+Metrics g_metrics;
+Bench g_bench;
+DBusTranscript g_transcript;
 
 int main(int argc, char *argv[])
 {
-  auto getKey = [](std::set<std::string> const &secrets, std::string const &encryptedkey, std::string &decrypted)
+  auto getKey = [](std::set<std::string> const &secrets, std::string const &encryptedkey, std::vector<unsigned char> const &verifypage, std::string &decrypted)
   {
-    if (g_verbose) [[unlikely]]
-      for (auto const &s : secrets)
-        std::cout << "(Got secrets: " << s << ")" << std::endl;
+    if (secrets.empty())
+      return false;
+    auto start = std::chrono::steady_clock::now();
     for (auto const &s : secrets)
+      LOG_DEBUG(General) << "(Got secrets: " << g_log.secret(s) << ")";
+    // derive the keys for all secrets at once, then try them in order
+    std::vector<std::string> candidates(secrets.begin(), secrets.end());
+    std::vector<std::string> keys = decryptKeys_linux_mac(candidates, encryptedkey);
+    bool found = false;
+    for (auto const &key : keys)
     {
-      decrypted = decryptKey_linux_mac(s, encryptedkey);
+      g_metrics.count("decrypt_attempts_total");
+      decrypted = key;
+      if (!decrypted.empty() && !verifypage.empty() && !verifyKey_sqlcipher(verifypage, decrypted))
+      {
+        std::cout << "Decrypted key does not open the database, trying next secret" << std::endl;
+        decrypted.clear();
+      }
       if (!decrypted.empty())
-        return true;
+      {
+        found = true;
+        break;
+      }
     }
-    return false;
+    g_bench.observe("decrypt", start);
+    return found;
   };
 
+  auto start = std::chrono::steady_clock::now();
+
   // arg handling
-  g_verbose = false;
+  bool autostart = true;
+  unsigned int keycachetimeout = 0;
+  std::string metricsfile;
+  bool verify = false;
+  std::string recordfile;
+  std::string replayfile;
+  double replayspeed = 1;
+  std::string verifydb;
+  bool watch = false;
+  long long deadline = -1;
+  unsigned int benchruns = 0;
+  unsigned int benchconcurrency = 1;
+  std::string keyringfile;
+  std::string kwalletfile;
+  int passwordfd = -1;
+  g_nativedbus = false;
+  g_hasdeadline = false;
+  g_noprompt = false;
   std::string signal_config_file(std::getenv("HOME"));
   signal_config_file += "/.config/Signal/config.json";
   for (int i = 1; i < argc; ++i)
   {
     if (argv[i] == "-v"s)
-      g_verbose = true;
+      g_log.setLevel(LogLevel::Debug);
+    else if (argv[i] == "-vv"s)
+      g_log.setLevel(LogLevel::Trace);
+    else if (std::strncmp(argv[i], "--log=", 6) == 0)
+    {
+      if (!g_log.setCategories(argv[i] + 6))
+      {
+        std::cout << "Unknown log category in '" << argv[i] << "'" << std::endl;
+        return 1;
+      }
+    }
+    else if (argv[i] == "--log-secrets"s)
+      g_log.allowSecrets(true);
+    else if (argv[i] == "--native-dbus"s)
+      g_nativedbus = true;
+    else if (argv[i] == "--no-autostart"s)
+      autostart = false;
+    else if (argv[i] == "--no-prompt"s)
+      g_noprompt = true;
+    else if (std::strncmp(argv[i], "--deadline=", 11) == 0)
+    {
+      char *end = nullptr;
+      deadline = std::strtoll(argv[i] + 11, &end, 10);
+      if (end == argv[i] + 11 || *end != '\0' || deadline < 0)
+      {
+        std::cout << "Invalid deadline in '" << argv[i] << "' (expected --deadline=<ms>)" << std::endl;
+        return 1;
+      }
+    }
+    else if (std::strncmp(argv[i], "--item-cache=", 13) == 0)
+      g_itemcache = argv[i] + 13;
+    else if (std::strncmp(argv[i], "--key-cache=", 12) == 0)
+      keycachetimeout = std::strtoul(argv[i] + 12, nullptr, 10);
+    else if (std::strncmp(argv[i], "--record=", 9) == 0)
+      recordfile = argv[i] + 9;
+    else if (std::strncmp(argv[i], "--replay=", 9) == 0)
+      replayfile = argv[i] + 9;
+    else if (std::strncmp(argv[i], "--replay-speed=", 15) == 0)
+      replayspeed = std::strtod(argv[i] + 15, nullptr);
+    else if (argv[i] == "--watch"s)
+      watch = true;
+    else if (argv[i] == "--verify-db"s)
+      verify = true;
+    else if (std::strncmp(argv[i], "--verify-db=", 12) == 0)
+      verifydb = argv[i] + 12;
+    else if (argv[i] == "--keyring-file"s)
+      keyringfile = std::string(std::getenv("HOME")) + "/.local/share/keyrings";
+    else if (std::strncmp(argv[i], "--keyring-file=", 15) == 0)
+      keyringfile = argv[i] + 15;
+    else if (argv[i] == "--kwallet-file"s)
+      kwalletfile = std::string(std::getenv("HOME")) + "/.local/share/kwalletd";
+    else if (std::strncmp(argv[i], "--kwallet-file=", 15) == 0)
+      kwalletfile = argv[i] + 15;
+    else if (std::strncmp(argv[i], "--password-fd=", 14) == 0)
+      passwordfd = std::strtol(argv[i] + 14, nullptr, 10);
+    else if (std::strncmp(argv[i], "--bench=", 8) == 0)
+    {
+      char *end = nullptr;
+      benchruns = std::strtoul(argv[i] + 8, &end, 10);
+      if (*end == ',')
+        benchconcurrency = std::strtoul(end + 1, nullptr, 10);
+      if (benchruns == 0 || benchconcurrency == 0)
+      {
+        std::cout << "Invalid benchmark in '" << argv[i] << "' (expected --bench=<runs>[,<concurrency>])" << std::endl;
+        return 1;
+      }
+    }
+    else if (std::strncmp(argv[i], "--metrics=", 10) == 0)
+    {
+      metricsfile = argv[i] + 10;
+      g_metrics.enable();
+    }
     else
       signal_config_file = argv[i];
   }
 
+  if (benchruns && (watch || !recordfile.empty()))
+  {
+    std::cout << "--bench can not be combined with --watch or --record" << std::endl;
+    return 1;
+  }
+
+  // the offline backends read keyring files directly, dbus is not used at all then
+  bool offline = !keyringfile.empty() || !kwalletfile.empty();
+  if (offline && watch)
+  {
+    std::cout << "--watch can not be combined with reading keyring files" << std::endl;
+    return 1;
+  }
+
+  // the password for keyring and wallet files, read up to the first newline (once, also with --bench)
+  std::string password;
+  if (passwordfd >= 0)
+  {
+    char c;
+    ssize_t n;
+    while ((n = read(passwordfd, &c, 1)) > 0 && c != '\n')
+      password += c;
+    if (n < 0)
+    {
+      std::cout << "Failed to read password from file descriptor " << passwordfd << std::endl;
+      return 1;
+    }
+    if (!password.empty() && password.back() == '\r')
+      password.pop_back();
+  }
+
+  // with --bench, this only returns (-1) in the processes that do the actual runs
+  if (benchruns)
+  {
+    int ret = runBench(benchruns, benchconcurrency);
+    if (ret >= 0)
+      return ret;
+    start = std::chrono::steady_clock::now();
+  }
+  if (deadline >= 0)
+    setDeadline(deadline);
+
+  if ((!recordfile.empty() && !g_transcript.record(recordfile)) ||
+      (!replayfile.empty() && !g_transcript.replay(replayfile, replayspeed)))
+    return 1;
+
+  // the database is in the same directory as the config file
+  if (verify && verifydb.empty())
+    verifydb = signal_config_file.substr(0, signal_config_file.find_last_of('/') + 1) + "sql/db.sqlite";
+
+  auto done = [&](int ret)
+  {
+    if (!metricsfile.empty())
+      g_metrics.write(metricsfile, std::chrono::steady_clock::now() - start, ret == 0);
+    return ret;
+  };
+
   // get encrypted key from Signal Desktop config
+  auto configstart = std::chrono::steady_clock::now();
   std::string encryptedkey = getEncryptedKey(signal_config_file);
+  g_bench.observe("config", configstart);
   if (encryptedkey.empty())
   {
     std::cout << "Failed to get encrypted key" << std::endl;
-    return 1;
+    return done(1);
   }
-  if (g_verbose) [[unlikely]] std::cout << "(Encrypted key: " << encryptedkey << ")" << std::endl;
+  LOG_DEBUG(General) << "(Encrypted key: " << encryptedkey << ")";
 
-  std::set<std::string> secrets;
-  std::string decrypted;
+  // every candidate key is checked against the same first page of the database
+  std::vector<unsigned char> verifypage;
+  if (!verifydb.empty() && !readPage_sqlcipher(verifydb, &verifypage))
+    return done(1);
 
-  // get secret from libsecret (should work on Gnome and KDE 6)
-  getSecret_SecretService(&secrets);
-  if (getKey(secrets, encryptedkey, decrypted)) // try what we got now (maybe we dont need to check kwallet)...
+  // with --watch, keep running after the key is found, and print it again whenever it changes.
+  // A new secret in the keyring comes with a newly encrypted key in the config, so that is
+  // read again too.
+  auto watchKey = [&](std::string key)
   {
+    if (!watch)
+      return;
+    watchSecret_SecretService([&](std::set<std::string> const &candidates)
+    {
+      std::string newencryptedkey = getEncryptedKey(signal_config_file);
+      if (!newencryptedkey.empty())
+        encryptedkey = newencryptedkey;
+      std::string newkey;
+      if (!getKey(candidates, encryptedkey, verifypage, newkey) || newkey == key)
+        return true;
+      key = newkey;
+      if (keycachetimeout)
+        keyCacheStore(signal_config_file, encryptedkey, key, keycachetimeout);
+      std::cout << " *** Decrypted key : " << key << " ***" << std::endl;
+      return true;
+    });
+  };
+
+  // the key is written (and flushed) before anything else is done, so whoever reads our
+  // output does not wait for the bookkeeping below
+  auto keyFound = [&](std::string const &key)
+  {
+    std::cout << " *** Decrypted key : " << key << " ***" << std::endl;
+    if (keycachetimeout)
+      keyCacheStore(signal_config_file, encryptedkey, key, keycachetimeout);
+    g_metrics.count("backend_successes_total");
+    watchKey(key);
+    return done(0);
+  };
+
+  // check if we still have the key from a previous run
+  std::string decrypted;
+  g_metrics.setBackend("keycache");
+  auto lookupstart = std::chrono::steady_clock::now();
+  bool cached = keycachetimeout && keyCacheLookup(signal_config_file, encryptedkey, &decrypted);
+  if (keycachetimeout)
+    g_bench.observe("lookup", lookupstart);
+  if (cached)
+  {
+    g_metrics.count("backend_successes_total");
     std::cout << " *** Decrypted key : " << decrypted << " ***" << std::endl;
-    return 0;
+    watchKey(decrypted);
+    return done(0);
   }
 
-  // get secret from kwallet (should work on KDE 6)
-  getSecret_Kwallet(6, &secrets);
-  if (getKey(secrets, encryptedkey, decrypted))
+  std::set<std::string> secrets;
+  auto runBackend = [&](char const *name, auto const &getsecrets)
   {
-    std::cout << " *** Decrypted key : " << decrypted << " ***" << std::endl;
-    return 0;
+    g_metrics.setBackend(name);
+    g_metrics.count("backend_attempts_total");
+    std::size_t before = secrets.size();
+    auto backendstart = std::chrono::steady_clock::now();
+    getsecrets();
+    g_bench.observe("total", backendstart);
+    g_metrics.count("backend_candidates_total", secrets.size() - before);
+  };
+
+  if (offline)
+  {
+    // get secret from gnome-keyring's files
+    if (!keyringfile.empty())
+      runBackend("keyringfile", [&]() { getSecret_KeyringFile(keyringfile, password, &secrets); });
+    if (getKey(secrets, encryptedkey, verifypage, decrypted))
+      return keyFound(decrypted);
+
+    // get secret from KWallet's files
+    if (!kwalletfile.empty())
+      runBackend("kwalletfile", [&]() { getSecret_KwalletFile(kwalletfile, password, &secrets); });
+    if (getKey(secrets, encryptedkey, verifypage, decrypted))
+      return keyFound(decrypted);
+
+    std::cout << (secrets.empty() ? "Failed to get any secrets" : "Failed to decrypt valid key. :(") << std::endl;
+    return done(1);
   }
 
+  // check which keyring services are there at all
+  std::set<std::string> services;
+  g_metrics.setBackend("probe");
+  auto probestart = std::chrono::steady_clock::now();
+  bool probed = probeServices(autostart, &services);
+  g_bench.observe("total", probestart);
+  auto available = [&](std::string const &service)
+  {
+    return !probed || services.find(service) != services.end();
+  };
+
+  // get secret from libsecret (should work on Gnome and KDE 6). It tries the secrets it has
+  // itself, before it prompts to unlock any more collections
+  bool verified = false;
+  auto works = [&](std::set<std::string> const &candidates)
+  {
+    return (verified = getKey(candidates, encryptedkey, verifypage, decrypted));
+  };
+  if (available("org.freedesktop.secrets"))
+    runBackend("secretservice", [&]() { getSecret_SecretService(&secrets, works); });
+  if (verified || getKey(secrets, encryptedkey, verifypage, decrypted)) // try what we got now (maybe we dont need to check kwallet)...
+    return keyFound(decrypted);
+
+  if (deadlineExpired("SecretService"))
+    return done(1);
+
+  // get secret from kwallet (should work on KDE 6)
+  if (available("org.kde.kwalletd6"))
+    runBackend("kwallet6", [&]() { getSecret_Kwallet(6, &secrets); });
+  if (getKey(secrets, encryptedkey, verifypage, decrypted))
+    return keyFound(decrypted);
+
+  if (deadlineExpired("KWallet 6"))
+    return done(1);
+
   // get secret from kwallet (should work on KDE 5)
-  getSecret_Kwallet(5, &secrets);
-  if (getKey(secrets, encryptedkey, decrypted))
+  if (available("org.kde.kwalletd5"))
+    runBackend("kwallet5", [&]() { getSecret_Kwallet(5, &secrets); });
+  if (getKey(secrets, encryptedkey, verifypage, decrypted))
+    return keyFound(decrypted);
+
+  if (deadlineExpired("KWallet 5"))
+    return done(1);
+
+  // a locked collection or closed wallet may hold the key, so it is worth trying again later
+  if (!g_promptskipped.empty())
   {
-    std::cout << " *** Decrypted key : " << decrypted << " ***" << std::endl;
-    return 0;
+    std::cout << "Not prompting to unlock " << g_promptskipped << " (--no-prompt)" << std::endl;
+    return done(EX_TEMPFAIL);
   }
 
   if (secrets.empty())
   {
     std::cout << "Failed to get any secrets" << std::endl;
-    return 1;
+    return done(1);
   }
 
   if (decrypted.empty())
   {
     std::cout << "Failed to decrypt valid key. :(" << std::endl;
-    return 1;
+    return done(1);
   }
 
-  return 1;
+  return done(1);
 }
@@ -21,17 +21,40 @@
 #define MAIN_H_
 
 #include "globals.h"
+#include "log.h"
 
+#include <functional>
 #include <set>
 #include <string>
+#include <vector>
 
 using std::literals::string_literals::operator""s;
 
 std::string getEncryptedKey(std::string const &configfile);
 
-void getSecret_SecretService(std::set<std::string> *secrets);
+bool probeServices(bool allowautostart, std::set<std::string> *services);
+
+void getSecret_SecretService(std::set<std::string> *secrets, std::function<bool(std::set<std::string> const &)> const &works);
+void watchSecret_SecretService(std::function<bool(std::set<std::string> const &)> const &changed);
 void getSecret_Kwallet(int version, std::set<std::string> *secrets);
+void getSecret_KeyringFile(std::string const &path, std::string const &password, std::set<std::string> *secrets);
+bool keyringFiles(std::string const &path, std::string const &extension, std::set<std::string> *filenames);
+void getSecret_KwalletFile(std::string const &path, std::string const &password, std::set<std::string> *secrets);
+bool isChromiumLabel(std::string const &label);
+bool isChromiumSecret(std::string const &secret);
+bool isChromiumFolder(std::string const &folder);
+bool isChromiumKey(std::string const &key);
 
 std::string decryptKey_linux_mac(std::string const &secret, std::string const &encrypted_key);
+std::vector<std::string> decryptKeys_linux_mac(std::vector<std::string> const &secrets, std::string const &encrypted_key);
+bool pbkdf2HmacSha1Multi(std::vector<std::string> const &passwords, unsigned char const *salt, std::size_t saltlength,
+                         int iterations, std::size_t keylength, unsigned char *out);
+bool readPage_sqlcipher(std::string const &databasefile, std::vector<unsigned char> *page);
+bool verifyKey_sqlcipher(std::vector<unsigned char> const &page, std::string const &hexkey);
+
+int runBench(unsigned int runs, unsigned int concurrency);
+
+bool keyCacheLookup(std::string const &configfile, std::string const &encrypted_key, std::string *key);
+bool keyCacheStore(std::string const &configfile, std::string const &encrypted_key, std::string const &key, unsigned int timeout);
 
 #endif
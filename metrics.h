@@ -0,0 +1,249 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "atomicfile.h"
+
+/*
+  Run metrics, written in the Prometheus text format for node_exporter's textfile collector
+  (see --metrics=<path>). Counters and histograms are added to the values already in the file,
+  so they count over all runs, gauges describe the last run only.
+
+  Everything is labeled with the backend (stage) that was active when it was recorded, see
+  setBackend().
+*/
+class Metrics
+{
+  struct Family
+  {
+    char const *name;
+    char const *type;
+    char const *help;
+  };
+  static constexpr Family s_families[] =
+  {
+    {"get_signal_desktop_key_backend_attempts_total", "counter", "Number of times a backend was tried."},
+    {"get_signal_desktop_key_backend_successes_total", "counter", "Number of times a backend provided the secret that decrypted the key."},
+    {"get_signal_desktop_key_backend_candidates_total", "counter", "Number of candidate secrets a backend returned."},
+    {"get_signal_desktop_key_backend_prompts_total", "counter", "Number of times a backend prompted the user (eg. to unlock)."},
+    {"get_signal_desktop_key_dbus_calls_total", "counter", "Number of dbus method calls (round trips) made."},
+    {"get_signal_desktop_key_dbus_call_errors_total", "counter", "Number of dbus method calls that failed or timed out."},
+    {"get_signal_desktop_key_dbus_call_duration_seconds", "histogram", "Time from sending a dbus method call to receiving its reply."},
+    {"get_signal_desktop_key_decrypt_attempts_total", "counter", "Number of attempts to decrypt the key with a candidate secret."},
+    {"get_signal_desktop_key_runs_total", "counter", "Number of runs."},
+    {"get_signal_desktop_key_last_run_duration_seconds", "gauge", "Wall time of the last run."},
+    {"get_signal_desktop_key_last_run_success", "gauge", "1 if the last run decrypted the key, 0 otherwise."},
+    {"get_signal_desktop_key_last_run_timestamp_seconds", "gauge", "Time the last run finished."},
+  };
+  static constexpr double s_buckets[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25};
+
+  // a series (metric name + labels) and its value, kept in the order they were first added
+  std::vector<std::pair<std::string, double>> d_series;
+  std::map<std::string, std::size_t> d_index;
+  std::string d_backend;
+  bool d_enabled;
+
+ public:
+  inline Metrics();
+  inline void enable();
+  inline bool enabled() const;
+  inline void setBackend(std::string const &backend);
+  inline std::string backend() const;
+
+  // count for the current backend (name without 'get_signal_desktop_key_' prefix)
+  inline void count(char const *name, double n = 1);
+  inline void observeCall(std::chrono::steady_clock::duration duration, bool ok);
+
+  // the gauges and run counter are set here, then merged with 'filename' and written back
+  inline bool write(std::string const &filename, std::chrono::steady_clock::duration duration, bool success);
+
+ private:
+  inline double &series(std::string const &name);
+  inline std::string label() const;
+  inline static Family const *family(std::string const &series);
+  inline static std::string formatValue(double value);
+};
+
+inline Metrics::Metrics()
+  :
+  d_enabled(false)
+{}
+
+inline void Metrics::enable()
+{
+  d_enabled = true;
+}
+
+inline bool Metrics::enabled() const
+{
+  return d_enabled;
+}
+
+inline void Metrics::setBackend(std::string const &backend)
+{
+  d_backend = backend;
+}
+
+inline std::string Metrics::backend() const
+{
+  return d_backend.empty() ? std::string("none") : d_backend;
+}
+
+inline double &Metrics::series(std::string const &name)
+{
+  auto it = d_index.find(name);
+  if (it != d_index.end())
+    return d_series[it->second].second;
+  d_index[name] = d_series.size();
+  return d_series.emplace_back(name, 0).second;
+}
+
+inline std::string Metrics::label() const
+{
+  return "backend=\"" + backend() + "\"";
+}
+
+inline void Metrics::count(char const *name, double n)
+{
+  if (!d_enabled)
+    return;
+  series(std::string("get_signal_desktop_key_") + name + "{" + label() + "}") += n;
+}
+
+inline void Metrics::observeCall(std::chrono::steady_clock::duration duration, bool ok)
+{
+  if (!d_enabled)
+    return;
+  count("dbus_calls_total");
+  if (!ok)
+    count("dbus_call_errors_total");
+
+  double seconds = std::chrono::duration<double>(duration).count();
+  std::string name("get_signal_desktop_key_dbus_call_duration_seconds");
+  for (double le : s_buckets)
+    series(name + "_bucket{" + label() + ",le=\"" + formatValue(le) + "\"}") += (seconds <= le ? 1 : 0);
+  series(name + "_bucket{" + label() + ",le=\"+Inf\"}") += 1;
+  series(name + "_sum{" + label() + "}") += seconds;
+  series(name + "_count{" + label() + "}") += 1;
+}
+
+inline Metrics::Family const *Metrics::family(std::string const &series)
+{
+  std::string name = series.substr(0, series.find('{'));
+  for (auto const &f : s_families)
+  {
+    std::string fname(f.name);
+    if (name == fname ||
+        (std::string(f.type) == "histogram" && name.compare(0, fname.size(), fname) == 0 &&
+         (name == fname + "_bucket" || name == fname + "_sum" || name == fname + "_count")))
+      return &f;
+  }
+  return nullptr;
+}
+
+inline std::string Metrics::formatValue(double value)
+{
+  std::ostringstream s;
+  s.precision(15);
+  s << value;
+  return s.str();
+}
+
+inline bool Metrics::write(std::string const &filename, std::chrono::steady_clock::duration duration, bool success)
+{
+  if (!d_enabled)
+    return true;
+
+  series("get_signal_desktop_key_runs_total") += 1;
+  series("get_signal_desktop_key_last_run_duration_seconds") = std::chrono::duration<double>(duration).count();
+  series("get_signal_desktop_key_last_run_success") = success ? 1 : 0;
+  series("get_signal_desktop_key_last_run_timestamp_seconds") = static_cast<double>(std::time(nullptr));
+
+  // runs that finish at the same time take turns, or one's counts would overwrite the other's
+  int lockfd = open((filename + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lockfd >= 0)
+    flock(lockfd, LOCK_EX);
+
+  // merge with the previous contents: the file's order is kept, new series go at the end
+  Metrics merged;
+  std::ifstream oldfile(filename);
+  std::string line;
+  while (std::getline(oldfile, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::string::size_type space = line.rfind(' ');
+    if (space == std::string::npos || !family(line.substr(0, space)))
+      continue;
+    merged.series(line.substr(0, space)) = std::strtod(line.c_str() + space + 1, nullptr);
+  }
+  for (auto const &[name, value] : d_series)
+  {
+    if (std::string(family(name)->type) == "gauge")
+      merged.series(name) = value;
+    else
+      merged.series(name) += value;
+  }
+
+  // the collector may read the file at any time (see writeFileAtomically())
+  std::ostringstream file;
+  for (auto const &f : s_families)
+  {
+    bool header = false;
+    for (auto const &[name, value] : merged.d_series)
+    {
+      if (family(name) != &f)
+        continue;
+      if (!header)
+      {
+        file << "# HELP " << f.name << " " << f.help << "\n"
+             << "# TYPE " << f.name << " " << f.type << "\n";
+        header = true;
+      }
+      file << name << " " << formatValue(value) << "\n";
+    }
+  }
+  bool ok = writeFileAtomically(filename, file.str(), 0644);
+  if (lockfd >= 0)
+    close(lockfd); // (releases the lock)
+  if (!ok)
+    std::cout << "Failed to write metrics to '" << filename << "'" << std::endl;
+  return ok;
+}
+
+extern Metrics g_metrics;
+
+#endif
@@ -0,0 +1,275 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+/*
+  PBKDF2-HMAC-SHA1 for several passwords at once (all with the same salt and iteration count,
+  which is the case for the candidate secrets of one encrypted key). Every SHA-1 word holds one
+  password ('lane') per vector element, so one pass through the compression function does the
+  work for 4 (SSE2, NEON) or 8 (AVX2, if the cpu supports it) passwords.
+
+  Only what Chromium's key derivation needs is supported: a salt that fits in one block with
+  the block counter, and an output of at most one SHA-1 block (20 bytes). Returns false for
+  anything else, so the caller can fall back to OpenSSL.
+*/
+namespace
+{
+  using Lanes4 = uint32_t __attribute__((vector_size(16)));
+#if defined(__x86_64__) || defined(__i386__)
+  using Lanes8 = uint32_t __attribute__((vector_size(32)));
+#endif
+
+  template <typename V>
+  constexpr int lanes = sizeof(V) / sizeof(uint32_t);
+
+  // in place, so no 32 byte vector is ever passed or returned by value (gcc warns about the abi)
+  template <int N, typename V>
+  __attribute__((always_inline)) inline void rotl(V &x)
+  {
+    x = (x << N) | (x >> (32 - N));
+  }
+
+  // SHA-1 compression of one (per lane) 16 word block into state
+  template <typename V>
+  __attribute__((always_inline)) inline void sha1Compress(V *state, V const *block)
+  {
+    V w[16];
+    for (int i = 0; i < 16; ++i)
+      w[i] = block[i];
+    V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; ++i)
+    {
+      if (i >= 16)
+      {
+        w[i & 15] ^= w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15];
+        rotl<1>(w[i & 15]);
+      }
+      V f;
+      uint32_t k;
+      if (i < 20)
+      {
+        f = d ^ (b & (c ^ d));
+        k = 0x5a827999;
+      }
+      else if (i < 40)
+      {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      }
+      else if (i < 60)
+      {
+        f = (b & c) | (d & (b | c));
+        k = 0x8f1bbcdc;
+      }
+      else
+      {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      V t = a;
+      rotl<5>(t);
+      t += f + e + w[i & 15] + k;
+      e = d;
+      d = c;
+      c = b;
+      rotl<30>(c);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+
+  template <typename V>
+  __attribute__((always_inline)) inline void sha1Init(V *state)
+  {
+    state[0] = V{} + 0x67452301;
+    state[1] = V{} + 0xefcdab89;
+    state[2] = V{} + 0x98badcfe;
+    state[3] = V{} + 0x10325476;
+    state[4] = V{} + 0xc3d2e1f0;
+  }
+
+  // block = 20 byte digest (in the first 5 words), padded, as the last block of a 64 + 20 byte message
+  template <typename V>
+  __attribute__((always_inline)) inline void digestBlock(V *block, V const *digest)
+  {
+    for (int i = 0; i < 5; ++i)
+      block[i] = digest[i];
+    block[5] = V{} + 0x80000000;
+    for (int i = 6; i < 15; ++i)
+      block[i] = V{};
+    block[15] = V{} + (64 + 20) * 8;
+  }
+
+  // the hmac keys (already hashed if longer than a block) are given per lane, big endian words
+  template <typename V>
+  __attribute__((always_inline)) inline void pbkdf2Lanes(uint32_t const (*keys)[16], V const *saltblock, int iterations, uint32_t (*out)[5])
+  {
+    // inner and outer hash states after the (fixed) key block, reused for every hmac
+    V ipad[16], opad[16];
+    for (int w = 0; w < 16; ++w)
+      for (int l = 0; l < lanes<V>; ++l)
+      {
+        ipad[w][l] = keys[l][w] ^ 0x36363636;
+        opad[w][l] = keys[l][w] ^ 0x5c5c5c5c;
+      }
+    V istate[5], ostate[5];
+    sha1Init(istate);
+    sha1Compress(istate, ipad);
+    sha1Init(ostate);
+    sha1Compress(ostate, opad);
+
+    // U1 = HMAC(salt | INT(1)), T = U1 ^ U2 ^ ... ^ Uiterations
+    V u[5], t[5], block[16];
+    for (int i = 0; i < 5; ++i)
+      u[i] = istate[i];
+    sha1Compress(u, saltblock);
+    digestBlock(block, u);
+    for (int i = 0; i < 5; ++i)
+      u[i] = ostate[i];
+    sha1Compress(u, block);
+    for (int i = 0; i < 5; ++i)
+      t[i] = u[i];
+
+    for (int it = 1; it < iterations; ++it)
+    {
+      digestBlock(block, u);
+      for (int i = 0; i < 5; ++i)
+        u[i] = istate[i];
+      sha1Compress(u, block);
+      digestBlock(block, u);
+      for (int i = 0; i < 5; ++i)
+        u[i] = ostate[i];
+      sha1Compress(u, block);
+      for (int i = 0; i < 5; ++i)
+        t[i] ^= u[i];
+    }
+
+    for (int l = 0; l < lanes<V>; ++l)
+      for (int i = 0; i < 5; ++i)
+        out[l][i] = t[i][l];
+  }
+
+  void pbkdf2Lanes4(uint32_t const (*keys)[16], uint32_t const *saltblock, int iterations, uint32_t (*out)[5])
+  {
+    Lanes4 salt[16];
+    for (int i = 0; i < 16; ++i)
+      salt[i] = Lanes4{} + saltblock[i];
+    pbkdf2Lanes(keys, salt, iterations, out);
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  __attribute__((target("avx2"))) void pbkdf2Lanes8(uint32_t const (*keys)[16], uint32_t const *saltblock, int iterations, uint32_t (*out)[5])
+  {
+    Lanes8 salt[16];
+    for (int i = 0; i < 16; ++i)
+      salt[i] = Lanes8{} + saltblock[i];
+    pbkdf2Lanes(keys, salt, iterations, out);
+  }
+#endif
+
+  // loads up to 64 bytes as 16 big endian words (zero padded)
+  void loadBlock(unsigned char const *data, std::size_t size, uint32_t *block)
+  {
+    unsigned char bytes[64] = {};
+    std::memcpy(bytes, data, size);
+    for (int i = 0; i < 16; ++i)
+      block[i] = (uint32_t(bytes[i * 4]) << 24) | (uint32_t(bytes[i * 4 + 1]) << 16) | (uint32_t(bytes[i * 4 + 2]) << 8) | bytes[i * 4 + 3];
+  }
+
+  // a password longer than the block size is replaced by its hash (as HMAC does)
+  void hmacKeyBlock(std::string const &password, uint32_t *block)
+  {
+    if (password.size() <= 64)
+    {
+      loadBlock(reinterpret_cast<unsigned char const *>(password.data()), password.size(), block);
+      return;
+    }
+
+    uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    uint32_t w[16];
+    std::string padded(password);
+    padded += '\x80';
+    padded.append((119 - password.size() % 64) % 64, '\0');
+    uint64_t bits = uint64_t(password.size()) * 8;
+    for (int i = 7; i >= 0; --i)
+      padded += static_cast<char>(bits >> (i * 8));
+    for (std::size_t offset = 0; offset < padded.size(); offset += 64)
+    {
+      loadBlock(reinterpret_cast<unsigned char const *>(padded.data()) + offset, 64, w);
+      sha1Compress(state, w);
+    }
+    for (int i = 0; i < 16; ++i)
+      block[i] = i < 5 ? state[i] : 0;
+  }
+}
+
+bool pbkdf2HmacSha1Multi(std::vector<std::string> const &passwords, unsigned char const *salt, std::size_t saltlength,
+                         int iterations, std::size_t keylength, unsigned char *out)
+{
+  if (saltlength + 4 + 9 > 64 || keylength > 20 || iterations < 1)
+    return false;
+
+  // the salt block: salt | INT(1) | padding, as the last block of a 64 + saltlength + 4 byte message
+  unsigned char saltbytes[64] = {};
+  std::memcpy(saltbytes, salt, saltlength);
+  saltbytes[saltlength + 3] = 1;
+  saltbytes[saltlength + 4] = 0x80;
+  uint32_t saltblock[16];
+  loadBlock(saltbytes, 64, saltblock);
+  saltblock[15] = (64 + saltlength + 4) * 8;
+
+  int width = 4;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2"))
+    width = 8;
+#endif
+  LOG_DEBUG(Crypto) << "(Deriving " << passwords.size() << " keys, " << width << " at a time)";
+
+  for (std::size_t first = 0; first < passwords.size(); first += width)
+  {
+    // unused lanes just repeat the last password
+    uint32_t keys[8][16];
+    uint32_t result[8][5];
+    for (int l = 0; l < width; ++l)
+      hmacKeyBlock(passwords[std::min(first + l, passwords.size() - 1)], keys[l]);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (width == 8)
+      pbkdf2Lanes8(keys, saltblock, iterations, result);
+    else
+#endif
+      pbkdf2Lanes4(keys, saltblock, iterations, result);
+
+    for (int l = 0; l < width && first + l < passwords.size(); ++l)
+      for (std::size_t i = 0; i < keylength; ++i)
+        out[(first + l) * keylength + i] = result[l][i / 4] >> (24 - (i % 4) * 8);
+  }
+  return true;
+}
@@ -0,0 +1,82 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include "dbuscon.h"
+
+#include <algorithm>
+
+DBusMethod<std::tuple<>, std::tuple<std::vector<std::string>>> constexpr DBus_ListNames{"org.freedesktop.DBus", "ListNames"};
+DBusMethod<std::tuple<>, std::tuple<std::vector<std::string>>> constexpr DBus_ListActivatableNames{"org.freedesktop.DBus", "ListActivatableNames"};
+
+/*
+  Find out which keyring services can answer at all, before calling them: a call to a
+  service that is not running (and can not be started) only returns after an error or a
+  timeout. Both lists are requested at once, so this costs one round trip.
+
+  Services that are not running, but can be started through dbus activation, are only
+  included if 'allowautostart' is set.
+*/
+bool probeServices(bool allowautostart, std::set<std::string> *services)
+{
+  if (!services)
+    return false;
+
+  DBusCon dbuscon;
+  if (!dbuscon.ok())
+  {
+    std::cout << "Error connecting to dbus session" << std::endl;
+    return false;
+  }
+
+  LOG_DEBUG(DBus) << "[ListNames + ListActivatableNames]";
+  auto pending_names = dbuscon.callAsync(DBus_ListNames, DBUS_SERVICE_DBUS, DBUS_PATH_DBUS);
+  auto pending_activatable = dbuscon.callAsync(DBus_ListActivatableNames, DBUS_SERVICE_DBUS, DBUS_PATH_DBUS);
+  auto names = dbuscon.wait(&pending_names);
+  auto activatable = dbuscon.wait(&pending_activatable);
+  if (!names)
+  {
+    std::cout << "Failed to list dbus services" << std::endl;
+    return false;
+  }
+
+  for (auto const &name : {"org.freedesktop.secrets", "org.kde.kwalletd6", "org.kde.kwalletd5"})
+  {
+    auto contains = [&name](std::vector<std::string> const &list)
+    {
+      return std::find(list.begin(), list.end(), name) != list.end();
+    };
+
+    if (contains(std::get<0>(*names)))
+    {
+      LOG_DEBUG(DBus) << " *** " << name << ": running";
+      services->insert(name);
+    }
+    else if (activatable && contains(std::get<0>(*activatable)))
+    {
+      LOG_DEBUG(DBus) << " *** " << name << ": activatable" << (allowautostart ? "" : " (not starting)");
+      if (allowautostart)
+        services->insert(name);
+    }
+    else
+      LOG_DEBUG(DBus) << " *** " << name << ": not available";
+  }
+  return true;
+}
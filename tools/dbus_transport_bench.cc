@@ -0,0 +1,125 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+  Compares the two dbus transports (libdbus' connection and the native DBusWire, see
+  --native-dbus): the cost of setting up a connection (connect, authenticate, Hello) and of a
+  method call round trip. Run it against the stand-in keyring, on a private bus:
+
+    g++ -std=c++17 -O2 -I. tools/dbus_transport_bench.cc $(pkg-config --libs --cflags dbus-1) -o tools/dbus_transport_bench
+    tools/run_standin.sh -- tools/dbus_transport_bench [<connects> [<calls>]]
+
+  The round trips are Properties.Get calls for an item's Label, one at a time. For the same
+  call it also times building the message alone, the way call() does (marshalling the arguments
+  every time) and the way callCached() does (copying a cached template and setting its path),
+  without sending it.
+*/
+
+#include "dbuscon.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+Log g_log;
+bool g_nativedbus;
+bool g_hasdeadline;
+std::chrono::steady_clock::time_point g_deadline;
+std::string g_deadlinestage;
+std::string g_itemcache;
+bool g_noprompt;
+std::string g_promptskipped;
+Metrics g_metrics;
+Bench g_bench;
+DBusTranscript g_transcript;
+
+void benchMessageConstruction(DBusCon *dbuscon, bool native, int calls)
+{
+  std::tuple<std::string, std::string> const args{"org.freedesktop.Secret.Item", "Label"};
+  std::vector<std::string> paths;
+  for (int i = 0; i < 100; ++i)
+    paths.push_back("/org/freedesktop/secrets/collection/login/" + std::to_string(i));
+
+  auto time = [calls](auto &&build)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; ++i)
+      build(i);
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / calls;
+  };
+
+  double full = 0;
+  double cached = 0;
+  if (native)
+  {
+    full = time([&](int i) { DBusWireMessage m(dbuscon->newWireMethodCall(DBusPropertiesGet<std::string>, "org.freedesktop.secrets", paths[i % paths.size()], args)); });
+    cached = time([&](int i) { DBusWireMessage m(dbuscon->cachedWireMethodCall(DBusPropertiesGet<std::string>, "org.freedesktop.secrets", paths[i % paths.size()], args)); });
+  }
+  else
+  {
+    full = time([&](int i) { dbus_message_unref(dbuscon->newMethodCall(DBusPropertiesGet<std::string>, "org.freedesktop.secrets", paths[i % paths.size()], args)); });
+    cached = time([&](int i) { dbus_message_unref(dbuscon->cachedMethodCall(DBusPropertiesGet<std::string>, "org.freedesktop.secrets", paths[i % paths.size()], args)); });
+  }
+  std::cout << (native ? "native " : "libdbus")
+            << "  build: " << full << " us  cached copy: " << cached << " us" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  int connects = argc > 1 ? std::atoi(argv[1]) : 200;
+  int calls = argc > 2 ? std::atoi(argv[2]) : 5000;
+
+  std::cout << std::fixed << std::setprecision(1);
+  for (bool native : {false, true})
+  {
+    g_nativedbus = native;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < connects; ++i)
+    {
+      DBusCon dbuscon;
+      if (!dbuscon.ok())
+      {
+        std::cout << "Failed to connect to the session bus" << std::endl;
+        return 1;
+      }
+    }
+    auto connected = std::chrono::steady_clock::now();
+
+    DBusCon dbuscon;
+    int failed = 0;
+    for (int i = 0; i < calls; ++i)
+      if (!dbuscon.call(DBusPropertiesGet<std::string>,
+                        "org.freedesktop.secrets",
+                        "/org/freedesktop/secrets/collection/login/0",
+                        {"org.freedesktop.Secret.Item", "Label"}))
+        ++failed;
+    auto done = std::chrono::steady_clock::now();
+
+    std::cout << (native ? "native " : "libdbus")
+              << "  connect: " << std::chrono::duration<double, std::micro>(connected - start).count() / connects << " us"
+              << "  round trip: " << std::chrono::duration<double, std::micro>(done - connected).count() / calls << " us"
+              << (failed ? "  (" + std::to_string(failed) + " calls failed)" : std::string()) << std::endl;
+
+    benchMessageConstruction(&dbuscon, native, calls * 20);
+  }
+  return 0;
+}
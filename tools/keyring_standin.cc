@@ -0,0 +1,738 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+  A stand-in for the Secret Service (org.freedesktop.secrets) and KWallet (org.kde.kwalletd5 and
+  org.kde.kwalletd6), for testing and benchmarking the program without a desktop keyring. It only
+  implements the calls the backends make, and is meant to run on a private bus (see
+  run_standin.sh). It is not part of the program itself.
+
+  Build:
+    g++ -std=c++17 -O2 tools/keyring_standin.cc $(pkg-config --libs --cflags dbus-1) -o tools/keyring_standin
+
+  Options:
+    --collection=<name>[,<setting>...]  add a Secret Service collection (the first one is the
+                                        'default' alias). Settings: 'locked', 'items=<n>',
+                                        'label=<label>', 'secret=<secret>', 'nosecret' and
+                                        'modified=<n>', the ones not given come from the options
+                                        below. Without any, there is one collection 'login'.
+    --items=<n>                         items per collection (default 10). The last item of a
+                                        collection is the Chromium key, the others are not.
+    --label=<label>                     label of the Chromium item ('\n' is a newline)
+    --secret=<secret>                   its secret (default c1nTCJlU5p//wEOI/qVNOg==, which
+                                        decrypts tools/config.json)
+    --locked                            collections start locked. Unlocking one needs a prompt.
+    --wallet=<name>[,<setting>...]      add a KWallet wallet (the first one is the network and
+                                        local wallet). Settings: 'closed', 'secret=<secret>',
+                                        'nosecret' and 'folder=<folder>' (to keep the secret
+                                        somewhere readPassword does not look, default
+                                        'Chromium Keys'). Without any, there is one open wallet
+                                        'kdewallet' with the secret.
+    --wallet-closed                     wallets start closed
+    --prompt-delay=<ms>                 time the user takes to answer a prompt (unlocking a
+                                        collection or opening a wallet)
+    --dismiss                           the user dismisses every prompt
+    --latency=<ms>                      wait this long before answering any call
+    --no-reply=<member>                 never answer calls of this method (to run into timeouts),
+                                        can be given more than once
+    --no-secret-service, --no-kwallet   do not register that service
+    --daemon                            go to the background once the services are registered
+                                        (and print the pid)
+    --log                               print every call received to stderr
+
+  The stand-in is single threaded: a latency or prompt delay holds up all other calls as well.
+
+  For tests of --watch, it also has a control interface at path '/':
+    local.KeyringStandIn.SetSecret(s)   change the first collection's Chromium secret (ItemChanged)
+    local.KeyringStandIn.Delete()       only send ItemDeleted for that item
+*/
+
+#include <dbus/dbus.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace
+{
+  std::string const secrets_root("/org/freedesktop/secrets");
+  std::string const default_secret("c1nTCJlU5p//wEOI/qVNOg==");
+
+  struct Collection
+  {
+    std::string d_name;
+    bool d_locked = false;
+    int d_items = 10;
+    std::string d_label = "Chromium Safe Storage";
+    std::string d_secret = default_secret; // empty: no Chromium item
+    uint64_t d_modified = 1000;
+  };
+
+  struct Wallet
+  {
+    std::string d_name;
+    bool d_open = true;
+    std::string d_secret = default_secret; // empty: no Chromium folder
+    std::string d_folder = "Chromium Keys";
+  };
+
+  struct Settings
+  {
+    std::vector<Collection> collections;
+    std::vector<Wallet> wallets;
+    int prompt_delay_ms = 0;
+    bool dismiss = false;
+    int latency_ms = 0;
+    std::set<std::string> no_reply;
+    bool secretservice = true;
+    bool kwallet = true;
+    bool log = false;
+  } g;
+
+  std::map<std::string, std::vector<std::string>> g_prompts; // prompt path -> collections it unlocks
+  std::map<int32_t, std::string> g_handles;                   // wallet handle -> wallet
+
+  std::string collectionPath(Collection const &c)
+  {
+    return secrets_root + "/collection/" + c.d_name;
+  }
+
+  // the collection at 'path' (or its alias), nullptr if there is none
+  Collection *findCollection(std::string const &path)
+  {
+    if (path == secrets_root + "/aliases/default")
+      return g.collections.empty() ? nullptr : &g.collections.front();
+    for (auto &c : g.collections)
+      if (collectionPath(c) == path)
+        return &c;
+    return nullptr;
+  }
+
+  // the collection and index of the item at 'path', nullptr if there is none
+  Collection *findItem(std::string const &path, int *index)
+  {
+    std::string::size_type slash = path.rfind('/');
+    if (slash == std::string::npos)
+      return nullptr;
+    Collection *c = findCollection(path.substr(0, slash));
+    if (!c)
+      return nullptr;
+    *index = std::atoi(path.c_str() + slash + 1);
+    return (*index >= 0 && *index < c->d_items) ? c : nullptr;
+  }
+
+  bool isChromiumItem(Collection const &c, int index)
+  {
+    return !c.d_secret.empty() && index == c.d_items - 1;
+  }
+
+  Wallet *findWallet(std::string const &name)
+  {
+    for (auto &w : g.wallets)
+      if (w.d_name == name)
+        return &w;
+    return nullptr;
+  }
+
+  void appendString(DBusMessageIter *iter, std::string const &value, int type = DBUS_TYPE_STRING)
+  {
+    char const *s = value.c_str();
+    dbus_message_iter_append_basic(iter, type, &s);
+  }
+
+  void appendPaths(DBusMessageIter *iter, std::vector<std::string> const &paths)
+  {
+    DBusMessageIter array;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "o", &array);
+    for (auto const &p : paths)
+      appendString(&array, p, DBUS_TYPE_OBJECT_PATH);
+    dbus_message_iter_close_container(iter, &array);
+  }
+
+  std::vector<std::string> itemPaths(Collection const &c)
+  {
+    std::vector<std::string> items;
+    for (int i = 0; i < c.d_items; ++i)
+      items.push_back(collectionPath(c) + "/" + std::to_string(i));
+    return items;
+  }
+
+  // a property value, as a variant. Returns false if the object has no such property.
+  bool appendProperty(DBusMessageIter *iter, std::string const &path, std::string const &name)
+  {
+    DBusMessageIter variant;
+    int index = 0;
+    Collection *c = nullptr;
+    if (path == secrets_root && name == "Collections")
+    {
+      std::vector<std::string> paths;
+      for (auto const &col : g.collections)
+        paths.push_back(collectionPath(col));
+      dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "ao", &variant);
+      appendPaths(&variant, paths);
+    }
+    else if ((c = findCollection(path)))
+    {
+      if (name == "Locked")
+      {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "b", &variant);
+        dbus_bool_t locked = c->d_locked;
+        dbus_message_iter_append_basic(&variant, DBUS_TYPE_BOOLEAN, &locked);
+      }
+      else if (name == "Items")
+      {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "ao", &variant);
+        appendPaths(&variant, itemPaths(*c));
+      }
+      else if (name == "Modified")
+      {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "t", &variant);
+        dbus_uint64_t modified = c->d_modified;
+        dbus_message_iter_append_basic(&variant, DBUS_TYPE_UINT64, &modified);
+      }
+      else if (name == "Label")
+      {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "s", &variant);
+        appendString(&variant, c->d_name);
+      }
+      else
+        return false;
+    }
+    else if ((c = findItem(path, &index)) && name == "Label")
+    {
+      dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "s", &variant);
+      appendString(&variant, isChromiumItem(*c, index) ? c->d_label : "Item " + std::to_string(index));
+    }
+    else
+      return false;
+    dbus_message_iter_close_container(iter, &variant);
+    return true;
+  }
+
+  void sendAndUnref(DBusConnection *connection, DBusMessage *message)
+  {
+    dbus_connection_send(connection, message, nullptr);
+    dbus_connection_flush(connection);
+    dbus_message_unref(message);
+  }
+
+  DBusMessage *error(DBusMessage *call, char const *name, std::string const &text)
+  {
+    return dbus_message_new_error(call, name, text.c_str());
+  }
+
+  DBusMessage *handleSecretService(DBusConnection *connection, DBusMessage *call,
+                                   std::string const &path, std::string const &interface, std::string const &member)
+  {
+    DBusMessage *reply = dbus_message_new_method_return(call);
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(reply, &iter);
+
+    if (interface == "org.freedesktop.Secret.Service" && member == "OpenSession")
+    {
+      DBusMessageIter variant;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "s", &variant);
+      appendString(&variant, "");
+      dbus_message_iter_close_container(&iter, &variant);
+      appendString(&iter, secrets_root + "/session/1", DBUS_TYPE_OBJECT_PATH);
+    }
+    else if (interface == "org.freedesktop.Secret.Service" && member == "ReadAlias")
+    {
+      char const *alias = "";
+      dbus_message_get_args(call, nullptr, DBUS_TYPE_STRING, &alias, DBUS_TYPE_INVALID);
+      appendString(&iter, (std::string(alias) == "default" && !g.collections.empty()) ?
+                   collectionPath(g.collections.front()) : "/", DBUS_TYPE_OBJECT_PATH);
+    }
+    else if (interface == "org.freedesktop.Secret.Service" && (member == "Unlock" || member == "Lock"))
+    {
+      char **paths = nullptr;
+      int count = 0;
+      dbus_message_get_args(call, nullptr, DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH, &paths, &count, DBUS_TYPE_INVALID);
+      std::vector<std::string> done;
+      std::vector<std::string> prompted;
+      for (int i = 0; i < count; ++i)
+      {
+        Collection *c = findCollection(paths[i]);
+        if (!c)
+          continue;
+        if (member == "Lock")
+          c->d_locked = true;
+        if (member == "Lock" || !c->d_locked)
+          done.push_back(paths[i]);
+        else
+          prompted.push_back(paths[i]);
+      }
+      dbus_free_string_array(paths);
+      std::string prompt("/");
+      if (!prompted.empty())
+      {
+        prompt = secrets_root + "/prompt/" + std::to_string(g_prompts.size() + 1);
+        g_prompts[prompt] = prompted;
+      }
+      appendPaths(&iter, done);
+      appendString(&iter, prompt, DBUS_TYPE_OBJECT_PATH);
+    }
+    else if (interface == "org.freedesktop.Secret.Prompt" && member == "Prompt" && g_prompts.count(path))
+    {
+      // the reply comes right away, the Completed signal when the user is done
+      sendAndUnref(connection, reply);
+      usleep(g.prompt_delay_ms * 1000);
+      if (!g.dismiss)
+        for (auto const &p : g_prompts[path])
+          if (Collection *c = findCollection(p))
+            c->d_locked = false;
+
+      DBusMessage *signal = dbus_message_new_signal(path.c_str(), "org.freedesktop.Secret.Prompt", "Completed");
+      DBusMessageIter siter, variant;
+      dbus_message_iter_init_append(signal, &siter);
+      dbus_bool_t dismissed = g.dismiss;
+      dbus_message_iter_append_basic(&siter, DBUS_TYPE_BOOLEAN, &dismissed);
+      dbus_message_iter_open_container(&siter, DBUS_TYPE_VARIANT, "ao", &variant);
+      appendPaths(&variant, g.dismiss ? std::vector<std::string>() : g_prompts[path]);
+      dbus_message_iter_close_container(&siter, &variant);
+      sendAndUnref(connection, signal);
+      return nullptr;
+    }
+    else if (interface == "org.freedesktop.Secret.Session" && member == "Close")
+      ;
+    else if (interface == "org.freedesktop.Secret.Item" && member == "GetSecret")
+    {
+      int index = 0;
+      Collection *c = findItem(path, &index);
+      if (!c)
+      {
+        dbus_message_unref(reply);
+        return error(call, "org.freedesktop.Secret.Error.NoSuchObject", path);
+      }
+      if (c->d_locked)
+      {
+        dbus_message_unref(reply);
+        return error(call, "org.freedesktop.Secret.Error.IsLocked", path);
+      }
+      // (oayays): session, parameters, value, content type
+      std::string value = isChromiumItem(*c, index) ? c->d_secret : "not a secret";
+      DBusMessageIter secret, bytes;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_STRUCT, nullptr, &secret);
+      appendString(&secret, secrets_root + "/session/1", DBUS_TYPE_OBJECT_PATH);
+      dbus_message_iter_open_container(&secret, DBUS_TYPE_ARRAY, "y", &bytes);
+      dbus_message_iter_close_container(&secret, &bytes);
+      dbus_message_iter_open_container(&secret, DBUS_TYPE_ARRAY, "y", &bytes);
+      unsigned char const *data = reinterpret_cast<unsigned char const *>(value.data());
+      dbus_message_iter_append_fixed_array(&bytes, DBUS_TYPE_BYTE, &data, value.size());
+      dbus_message_iter_close_container(&secret, &bytes);
+      appendString(&secret, "text/plain");
+      dbus_message_iter_close_container(&iter, &secret);
+    }
+    else if (interface == "org.freedesktop.DBus.Properties" && member == "Get")
+    {
+      char const *propinterface = "";
+      char const *name = "";
+      dbus_message_get_args(call, nullptr, DBUS_TYPE_STRING, &propinterface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+      if (!appendProperty(&iter, path, name))
+      {
+        dbus_message_unref(reply);
+        return error(call, DBUS_ERROR_UNKNOWN_PROPERTY, name);
+      }
+    }
+    else if (interface == "org.freedesktop.DBus.Properties" && member == "GetAll" && findCollection(path))
+    {
+      DBusMessageIter dict, entry;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+      for (std::string const name : {"Label", "Locked", "Modified", "Items"})
+      {
+        dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, nullptr, &entry);
+        appendString(&entry, name);
+        appendProperty(&entry, path, name);
+        dbus_message_iter_close_container(&dict, &entry);
+      }
+      dbus_message_iter_close_container(&iter, &dict);
+    }
+    else if (interface == "local.KeyringStandIn" && (member == "SetSecret" || member == "Delete") && !g.collections.empty())
+    {
+      Collection &c = g.collections.front();
+      if (member == "SetSecret")
+      {
+        char const *secret = "";
+        dbus_message_get_args(call, nullptr, DBUS_TYPE_STRING, &secret, DBUS_TYPE_INVALID);
+        c.d_secret = secret;
+        ++c.d_modified;
+      }
+      sendAndUnref(connection, reply);
+      DBusMessage *signal = dbus_message_new_signal(collectionPath(c).c_str(), "org.freedesktop.Secret.Collection",
+                                                    member == "SetSecret" ? "ItemChanged" : "ItemDeleted");
+      DBusMessageIter siter;
+      dbus_message_iter_init_append(signal, &siter);
+      appendString(&siter, collectionPath(c) + "/" + std::to_string(c.d_items - 1), DBUS_TYPE_OBJECT_PATH);
+      sendAndUnref(connection, signal);
+      return nullptr;
+    }
+    else
+    {
+      dbus_message_unref(reply);
+      return error(call, DBUS_ERROR_UNKNOWN_METHOD, interface + "." + member);
+    }
+    return reply;
+  }
+
+  DBusMessage *handleKWallet(DBusConnection *connection, DBusMessage *call,
+                             std::string const &path, std::string const &member)
+  {
+    DBusMessage *reply = dbus_message_new_method_return(call);
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(reply, &iter);
+
+    // the calls take a wallet handle and/or strings (wallet name, or folder, key and app id)
+    dbus_int32_t handle = -1;
+    std::vector<std::string> strings;
+    DBusMessageIter args;
+    if (dbus_message_iter_init(call, &args))
+      do
+      {
+        if (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_INT32)
+          dbus_message_iter_get_basic(&args, &handle);
+        else if (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_STRING)
+        {
+          char const *s = nullptr;
+          dbus_message_iter_get_basic(&args, &s);
+          strings.push_back(s);
+        }
+      } while (dbus_message_iter_next(&args));
+    strings.resize(std::max<std::size_t>(strings.size(), 2));
+
+    std::string walletsecret;
+    std::string walletfolder;
+    if (g_handles.count(handle))
+    {
+      walletsecret = findWallet(g_handles[handle])->d_secret;
+      walletfolder = findWallet(g_handles[handle])->d_folder;
+    }
+    bool chromiumfolder = !walletsecret.empty() && strings[0] == walletfolder;
+
+    if (member == "networkWallet" || member == "localWallet")
+      appendString(&iter, g.wallets.empty() ? "" : g.wallets.front().d_name);
+    else if (member == "wallets")
+    {
+      DBusMessageIter array;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+      for (auto const &w : g.wallets)
+        appendString(&array, w.d_name);
+      dbus_message_iter_close_container(&iter, &array);
+    }
+    else if (member == "isOpen")
+    {
+      Wallet *w = findWallet(strings[0]);
+      dbus_bool_t open = w && w->d_open;
+      dbus_message_iter_append_basic(&iter, DBUS_TYPE_BOOLEAN, &open);
+    }
+    else if (member == "openAsync")
+    {
+      static dbus_int32_t transaction = 0;
+      dbus_int32_t t = ++transaction;
+      dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &t);
+      sendAndUnref(connection, reply);
+
+      // an answer to someone else's openAsync first, then ours
+      Wallet *w = findWallet(strings[0]);
+      if (g.prompt_delay_ms)
+      {
+        DBusMessage *other = dbus_message_new_signal(path.c_str(), "org.kde.KWallet", "walletAsyncOpened");
+        dbus_int32_t othertransaction = -t;
+        dbus_int32_t otherhandle = 1;
+        dbus_message_append_args(other, DBUS_TYPE_INT32, &othertransaction, DBUS_TYPE_INT32, &otherhandle, DBUS_TYPE_INVALID);
+        sendAndUnref(connection, other);
+        usleep(g.prompt_delay_ms * 1000);
+      }
+      dbus_int32_t h = -1;
+      if (w && !(g.dismiss && !w->d_open))
+      {
+        w->d_open = true;
+        h = 1000 + static_cast<int32_t>(g_handles.size());
+        g_handles[h] = w->d_name;
+      }
+      DBusMessage *signal = dbus_message_new_signal(path.c_str(), "org.kde.KWallet", "walletAsyncOpened");
+      dbus_message_append_args(signal, DBUS_TYPE_INT32, &t, DBUS_TYPE_INT32, &h, DBUS_TYPE_INVALID);
+      sendAndUnref(connection, signal);
+      return nullptr;
+    }
+    else if (member == "close")
+    {
+      // close(s wallet, b force) closes the wallet, close(i handle, b force, s appid) only the handle
+      if (Wallet *w = (dbus_message_has_signature(call, "sb") ? findWallet(strings[0]) : nullptr))
+        w->d_open = false;
+      dbus_int32_t ret = 0;
+      dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &ret);
+    }
+    else if (!g_handles.count(handle))
+    {
+      dbus_message_unref(reply);
+      return error(call, DBUS_ERROR_INVALID_ARGS, "Invalid handle");
+    }
+    else if (member == "folderList")
+    {
+      DBusMessageIter array;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+      for (std::string const folder : {"Form Data", "Passwords"})
+        appendString(&array, folder);
+      if (!walletsecret.empty())
+        appendString(&array, walletfolder);
+      dbus_message_iter_close_container(&iter, &array);
+    }
+    else if (member == "hasFolder" || member == "hasEntry")
+    {
+      dbus_bool_t has = chromiumfolder && (member == "hasFolder" || strings[1] == "Chromium Safe Storage");
+      dbus_message_iter_append_basic(&iter, DBUS_TYPE_BOOLEAN, &has);
+    }
+    else if (member == "readPassword")
+      appendString(&iter, (chromiumfolder && strings[1] == "Chromium Safe Storage") ? walletsecret : "");
+    else if (member == "passwordList")
+    {
+      DBusMessageIter dict, entry, variant;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+      if (chromiumfolder)
+      {
+        dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, nullptr, &entry);
+        appendString(&entry, "Chromium Safe Storage");
+        dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "s", &variant);
+        appendString(&variant, walletsecret);
+        dbus_message_iter_close_container(&entry, &variant);
+        dbus_message_iter_close_container(&dict, &entry);
+      }
+      dbus_message_iter_close_container(&iter, &dict);
+    }
+    else
+    {
+      dbus_message_unref(reply);
+      return error(call, DBUS_ERROR_UNKNOWN_METHOD, member);
+    }
+    return reply;
+  }
+
+  // the reply to a method call, nullptr if it was already sent (or should never be)
+  DBusMessage *handle(DBusConnection *connection, DBusMessage *call)
+  {
+    std::string path(dbus_message_get_path(call) ? dbus_message_get_path(call) : "");
+    std::string interface(dbus_message_get_interface(call) ? dbus_message_get_interface(call) : "");
+    std::string member(dbus_message_get_member(call) ? dbus_message_get_member(call) : "");
+    std::string destination(dbus_message_get_destination(call) ? dbus_message_get_destination(call) : "");
+    if (g.log)
+      std::cerr << "standin: " << destination << " " << path << " " << interface << "." << member
+                << " (" << dbus_message_get_signature(call) << ")" << std::endl;
+
+    if (g.no_reply.count(member))
+      return nullptr;
+    if (g.latency_ms)
+      usleep(g.latency_ms * 1000);
+
+    if (destination.compare(0, 16, "org.kde.kwalletd") == 0)
+      return handleKWallet(connection, call, path, member);
+    return handleSecretService(connection, call, path, interface, member);
+  }
+
+  // "name,setting,key=value" -> name and the settings
+  std::string splitSpec(std::string const &spec, std::map<std::string, std::string> *settings)
+  {
+    std::vector<std::string> parts;
+    std::string::size_type start = 0;
+    while (true)
+    {
+      std::string::size_type comma = spec.find(',', start);
+      parts.push_back(spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+      if (comma == std::string::npos)
+        break;
+      start = comma + 1;
+    }
+    for (unsigned int i = 1; i < parts.size(); ++i)
+    {
+      std::string::size_type eq = parts[i].find('=');
+      (*settings)[parts[i].substr(0, eq)] = eq == std::string::npos ? std::string() : parts[i].substr(eq + 1);
+    }
+    return parts[0];
+  }
+
+  std::string unescape(std::string label)
+  {
+    std::string::size_type pos;
+    while ((pos = label.find("\\n")) != std::string::npos)
+      label.replace(pos, 2, "\n");
+    return label;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  Collection defaultcollection;
+  defaultcollection.d_name = "login";
+  Wallet defaultwallet;
+  defaultwallet.d_name = "kdewallet";
+  std::vector<std::string> collectionspecs;
+  std::vector<std::string> walletspecs;
+  bool daemon = false;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg(argv[i]);
+    std::string value(arg.find('=') == std::string::npos ? std::string() : arg.substr(arg.find('=') + 1));
+    if (arg.compare(0, 13, "--collection=") == 0)
+      collectionspecs.push_back(value);
+    else if (arg.compare(0, 8, "--items=") == 0)
+      defaultcollection.d_items = std::atoi(value.c_str());
+    else if (arg.compare(0, 8, "--label=") == 0)
+      defaultcollection.d_label = unescape(value);
+    else if (arg.compare(0, 9, "--secret=") == 0)
+      defaultcollection.d_secret = defaultwallet.d_secret = value;
+    else if (arg == "--locked")
+      defaultcollection.d_locked = true;
+    else if (arg.compare(0, 9, "--wallet=") == 0)
+      walletspecs.push_back(value);
+    else if (arg == "--wallet-closed")
+      defaultwallet.d_open = false;
+    else if (arg.compare(0, 15, "--prompt-delay=") == 0)
+      g.prompt_delay_ms = std::atoi(value.c_str());
+    else if (arg == "--dismiss")
+      g.dismiss = true;
+    else if (arg.compare(0, 10, "--latency=") == 0)
+      g.latency_ms = std::atoi(value.c_str());
+    else if (arg.compare(0, 11, "--no-reply=") == 0)
+      g.no_reply.insert(value);
+    else if (arg == "--no-secret-service")
+      g.secretservice = false;
+    else if (arg == "--no-kwallet")
+      g.kwallet = false;
+    else if (arg == "--daemon")
+      daemon = true;
+    else if (arg == "--log")
+      g.log = true;
+    else
+    {
+      std::cerr << "Unknown option '" << arg << "' (see the comment at the top of keyring_standin.cc)" << std::endl;
+      return 1;
+    }
+  }
+
+  for (auto const &spec : collectionspecs)
+  {
+    std::map<std::string, std::string> settings;
+    Collection c = defaultcollection;
+    c.d_name = splitSpec(spec, &settings);
+    c.d_locked = c.d_locked || settings.count("locked");
+    if (settings.count("items"))
+      c.d_items = std::atoi(settings["items"].c_str());
+    if (settings.count("label"))
+      c.d_label = unescape(settings["label"]);
+    if (settings.count("secret"))
+      c.d_secret = settings["secret"];
+    if (settings.count("nosecret"))
+      c.d_secret.clear();
+    if (settings.count("modified"))
+      c.d_modified = std::strtoull(settings["modified"].c_str(), nullptr, 10);
+    g.collections.push_back(c);
+  }
+  if (g.collections.empty())
+    g.collections.push_back(defaultcollection);
+
+  for (auto const &spec : walletspecs)
+  {
+    std::map<std::string, std::string> settings;
+    Wallet w = defaultwallet;
+    w.d_name = splitSpec(spec, &settings);
+    w.d_open = w.d_open && !settings.count("closed");
+    if (settings.count("secret"))
+      w.d_secret = settings["secret"];
+    if (settings.count("nosecret"))
+      w.d_secret.clear();
+    if (settings.count("folder"))
+      w.d_folder = settings["folder"];
+    g.wallets.push_back(w);
+  }
+  if (g.wallets.empty())
+    g.wallets.push_back(defaultwallet);
+
+  // with --daemon, the parent only waits until the child has registered its names
+  int ready[2] = {-1, -1};
+  if (daemon)
+  {
+    if (pipe(ready) != 0)
+      return 1;
+    pid_t pid = fork();
+    if (pid < 0)
+      return 1;
+    if (pid > 0)
+    {
+      close(ready[1]);
+      char c = 0;
+      bool ok = read(ready[0], &c, 1) == 1;
+      if (ok)
+        std::cout << pid << std::endl;
+      return ok ? 0 : 1;
+    }
+    close(ready[0]);
+    std::cout.flush();
+    std::freopen("/dev/null", "w", stdout); // (whoever reads the pid waits for this to close)
+  }
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusConnection *connection = dbus_bus_get(DBUS_BUS_SESSION, &error);
+  if (!connection)
+  {
+    std::cerr << "Failed to connect to session bus: " << error.message << std::endl;
+    return 1;
+  }
+  std::vector<char const *> names;
+  if (g.secretservice)
+    names.push_back("org.freedesktop.secrets");
+  if (g.kwallet)
+  {
+    names.push_back("org.kde.kwalletd6");
+    names.push_back("org.kde.kwalletd5");
+  }
+  for (char const *name : names)
+    if (dbus_bus_request_name(connection, name, DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    {
+      std::cerr << "Failed to register " << name << " (is a real keyring running on this bus?)" << std::endl;
+      return 1;
+    }
+
+  if (daemon)
+  {
+    if (write(ready[1], "1", 1) != 1)
+      return 1;
+    close(ready[1]);
+  }
+
+  while (dbus_connection_read_write(connection, -1))
+  {
+    DBusMessage *message;
+    while ((message = dbus_connection_pop_message(connection)))
+    {
+      if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        if (DBusMessage *reply = handle(connection, message))
+          sendAndUnref(connection, reply);
+      dbus_message_unref(message);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+#
+# Run a command against the keyring stand-in (keyring_standin.cc), on a private session bus
+# that only lives as long as the command:
+#
+#   tools/run_standin.sh [stand-in options] -- <command> [arguments]
+#
+# for example
+#
+#   tools/run_standin.sh --items=1000 --latency=1 -- ./get_signal_desktop_key -v tools/config.json
+#
+# The stand-in binary is expected next to this script (or set STANDIN). The exit code is the
+# command's.
+
+if [ -z "$STANDIN_BUS" ]
+then
+  STANDIN_BUS=1 exec dbus-run-session -- "$0" "$@"
+fi
+
+STANDIN=${STANDIN:-$(dirname "$0")/keyring_standin}
+standin_args=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]
+do
+  standin_args+=("$1")
+  shift
+done
+shift
+
+if [ $# -eq 0 ]
+then
+  echo "usage: $0 [stand-in options] -- <command> [arguments]" >&2
+  exit 2
+fi
+
+# --daemon only returns once the stand-in's names are registered on the bus
+pid=$("$STANDIN" --daemon "${standin_args[@]}") || exit 1
+"$@"
+ret=$?
+kill "$pid"
+exit $ret
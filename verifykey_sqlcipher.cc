@@ -0,0 +1,128 @@
+/*
+  Copyright (C) 2024  Selwin van Dijk
+
+  This file is part of get_signal_desktop_key.
+
+  get_signal_desktop_key is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  get_signal_desktop_key is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with get_signal_desktop_key.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+/*
+  Checks a candidate key against an SQLCipher database by verifying the HMAC of its first page,
+  which needs nothing more than that one page (no sqlite, no decryption).
+
+  Signal Desktop passes its key as a raw key (PRAGMA key = "x'<64 hex chars>'"), so the key is
+  used as the encryption key as is. The page layout and HMAC key derivation are SQLCipher's:
+
+    page 1 = salt (16) | encrypted data | iv (16) | hmac | padding (to a multiple of 16)
+
+    hmac key = PBKDF2(key, salt ^ 0x3a, 2 iterations)
+    hmac     = HMAC(hmac key, encrypted data | iv | page number (4 bytes, little endian))
+
+  The current defaults (SQLCipher 4) are tried first, then those of SQLCipher 3.
+*/
+namespace
+{
+  struct SQLCipherParams
+  {
+    char const *name;
+    unsigned int pagesize;
+    unsigned int hmacsize;
+    EVP_MD const *(*md)();
+  };
+
+  SQLCipherParams const sqlcipherparams[] = {{"SQLCipher 4", 4096, 64, &EVP_sha512},
+                                             {"SQLCipher 3", 1024, 20, &EVP_sha1}};
+
+  bool verifyPage(std::vector<unsigned char> const &page, unsigned char const *key, unsigned int keysize, SQLCipherParams const &params)
+  {
+    unsigned int const saltsize = 16;
+    unsigned int const ivsize = 16;
+    unsigned int const hmacsize = params.hmacsize;
+    unsigned int const reserve = ((ivsize + hmacsize + 15) / 16) * 16;
+    if (page.size() < params.pagesize)
+      return false;
+
+    // derive the hmac key
+    unsigned char hmacsalt[saltsize];
+    for (unsigned int i = 0; i < saltsize; ++i)
+      hmacsalt[i] = page[i] ^ 0x3a;
+    unsigned char hmackey[32];
+    if (PKCS5_PBKDF2_HMAC(reinterpret_cast<char const *>(key), keysize, hmacsalt, saltsize, 2, params.md(), sizeof(hmackey), hmackey) != 1)
+      return false;
+
+    // hmac the encrypted data + iv + page number
+    unsigned int datasize = params.pagesize - saltsize - reserve + ivsize;
+    std::vector<unsigned char> input(page.begin() + saltsize, page.begin() + saltsize + datasize);
+    input.insert(input.end(), {1, 0, 0, 0});
+    unsigned char hmac[EVP_MAX_MD_SIZE];
+    unsigned int hmaclength = 0;
+    if (!HMAC(params.md(), hmackey, sizeof(hmackey), input.data(), input.size(), hmac, &hmaclength))
+      return false;
+
+    return hmaclength == hmacsize &&
+      CRYPTO_memcmp(hmac, page.data() + saltsize + datasize, hmacsize) == 0;
+  }
+}
+
+// reads the first page of the database, once per run: it is all verifyKey_sqlcipher() needs
+bool readPage_sqlcipher(std::string const &databasefile, std::vector<unsigned char> *page)
+{
+  std::ifstream database(databasefile, std::ios_base::binary);
+  if (!database.is_open())
+  {
+    std::cout << "Failed to open file '" << databasefile << "' for reading" << std::endl;
+    return false;
+  }
+  page->resize(sqlcipherparams[0].pagesize);
+  database.read(reinterpret_cast<char *>(page->data()), page->size());
+  page->resize(database.gcount());
+
+  if (page->size() < sqlcipherparams[1].pagesize)
+  {
+    std::cout << "File '" << databasefile << "' is too small to be an SQLCipher database" << std::endl;
+    return false;
+  }
+  LOG_DEBUG(Crypto) << "(Verifying keys against " << databasefile << ")";
+  return true;
+}
+
+bool verifyKey_sqlcipher(std::vector<unsigned char> const &page, std::string const &hexkey)
+{
+  if (hexkey.size() != 64 ||
+      hexkey.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+    return false;
+  unsigned char key[32];
+  for (unsigned int i = 0; i < sizeof(key); ++i)
+    key[i] = std::strtoul(hexkey.substr(i * 2, 2).c_str(), nullptr, 16);
+
+  for (auto const &p : sqlcipherparams)
+    if (verifyPage(page, key, sizeof(key), p))
+    {
+      LOG_DEBUG(Crypto) << "(Key verified against the database (" << p.name << "))";
+      return true;
+    }
+
+  LOG_DEBUG(Crypto) << "(Key does not match the database)";
+  return false;
+}